@@ -0,0 +1,94 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include "arena.h"
+
+/* bytes allocated at a time, unless a single request needs more */
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+struct arena_block
+{
+  struct arena_block *next;
+  size_t size;
+  unsigned char data[1];
+};
+
+void arena_init(struct arena *arena, size_t limit)
+{
+  arena->blocks = 0;
+  arena->used = 0;
+  arena->total = 0;
+  arena->limit = limit;
+}
+
+/* Return size bytes of memory that stay valid until the arena is freed,
+   or NULL if handing them out would exceed the arena's limit or memory
+   is short. */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+  struct arena_block *block;
+  size_t blocksize;
+  void *memory;
+
+  if (size > arena->limit - arena->total)
+    return 0;
+
+  block = arena->blocks;
+
+  if (block == 0 || block->size - arena->used < size)
+  {
+    blocksize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+    block = (struct arena_block*) malloc(sizeof(struct arena_block) + blocksize);
+    if (block == 0)
+      return 0;
+
+    block->next = arena->blocks;
+    block->size = blocksize;
+
+    arena->blocks = block;
+    arena->used = 0;
+  }
+
+  memory = block->data + arena->used;
+
+  arena->used += size;
+  arena->total += size;
+
+  return memory;
+}
+
+void arena_free(struct arena *arena)
+{
+  struct arena_block *block;
+
+  while (arena->blocks != 0)
+  {
+    block = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = block;
+  }
+
+  arena->used = 0;
+  arena->total = 0;
+}
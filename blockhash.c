@@ -0,0 +1,205 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "blockhash.h"
+#include "hashdb.h"
+#include "errormsg.h"
+#include "sigint.h"
+#include "flags.h"
+#include "fdcache.h"
+
+#define MD5_DIGEST_LENGTH 16
+
+/* Add length bytes of fd, starting at offset, to state, and to
+   blockstate as well if it is not null. Returns 0 if they cannot all be
+   read, or if interrupted. */
+static int blockhash__append(int fd, off_t offset, off_t length, md5_state_t *state, md5_state_t *blockstate)
+{
+  static md5_byte_t chunk[CHUNK_SIZE];
+  size_t toread;
+
+  while (length > 0) {
+    if (got_sigint)
+      return 0;
+
+    toread = length >= CHUNK_SIZE ? CHUNK_SIZE : (size_t) length;
+    if (pread(fd, chunk, toread, offset) != (ssize_t) toread)
+      return 0;
+
+    md5_append(state, chunk, toread);
+    if (blockstate != 0)
+      md5_append(blockstate, chunk, toread);
+
+    offset += toread;
+    length -= toread;
+  }
+
+  return 1;
+}
+
+/* Whether the first count blocks of fd still have the digests saved in
+   blocks. */
+static int blockhash__intact(int fd, const struct hashdb_blocklist *blocks, size_t count)
+{
+  md5_state_t blockstate;
+  md5_byte_t blockdigest[MD5_DIGEST_LENGTH];
+  size_t x;
+
+  for (x = 0; x < count; ++x) {
+    md5_init(&blockstate);
+
+    if (!blockhash__append(fd, (off_t) x * BLOCK_HASH_SIZE, BLOCK_HASH_SIZE, &blockstate, 0))
+      return 0;
+
+    md5_finish(&blockstate, blockdigest);
+
+    if (memcmp(blockdigest, blocks->digests + x * MD5_DIGEST_LENGTH, MD5_DIGEST_LENGTH) != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Calculate a file's full MD5 signature, saving the digest of every
+   BLOCK_HASH_SIZE block along with the state of the MD5 calculation at
+   the last block boundary. When a file has only grown since its block
+   list was saved (same inode, larger size), every saved block is read
+   again and checked against its digest; if all of them are intact, the
+   calculation is resumed from the saved state, so that only the new
+   tail is hashed into the whole-file digest. Otherwise the file is
+   hashed from the start. */
+md5_byte_t *getblocksignature(sqlite3 *db, file_t *file)
+{
+  struct hashdb_blocklist blocks;
+  md5_state_t state;
+  md5_state_t blockstate;
+  md5_byte_t *digest;
+  md5_byte_t *digests;
+  size_t keep = 0;
+  size_t blockcount;
+  off_t offset;
+  off_t blockend;
+  int fd;
+
+  digest = (md5_byte_t*) malloc(MD5_DIGEST_LENGTH * sizeof(md5_byte_t));
+  if (digest == NULL) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  fd = fdcache_open(file);
+  if (fd == -1) {
+    errormsg("error opening file %s\n", file->d_name);
+    free(digest);
+    return NULL;
+  }
+
+  if (hashdb_loadblocks(db, file, BLOCK_HASH_SIZE, &blocks))
+  {
+    if (blocks.inode == file->inode &&
+        blocks.size == file->size &&
+        blocks.ctime == file->ctime &&
+        blocks.mtime == file->mtime &&
+        blocks.ctime_nsec == file->ctime_nsec &&
+        blocks.mtime_nsec == file->mtime_nsec)
+    {
+      keep = blocks.blockcount;
+    }
+    else if (blocks.inode == file->inode && blocks.size < file->size && blocks.blockcount > 0)
+    {
+      if (blockhash__intact(fd, &blocks, blocks.blockcount))
+        keep = blocks.blockcount;
+      else if (got_sigint) {
+        printf("\n");
+        exit(0);
+      }
+    }
+  }
+  else
+  {
+    blocks.digests = 0;
+  }
+
+  blockcount = file->size / BLOCK_HASH_SIZE;
+
+  digests = (md5_byte_t*) realloc(blocks.digests, (blockcount > 0 ? blockcount : 1) * MD5_DIGEST_LENGTH);
+  if (digests == NULL) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  blocks.digests = digests;
+  blocks.blocksize = BLOCK_HASH_SIZE;
+
+  if (keep > 0)
+    state = blocks.state;
+  else
+    md5_init(&state);
+
+  offset = (off_t) keep * BLOCK_HASH_SIZE;
+
+  while (offset < file->size) {
+    blockend = offset + BLOCK_HASH_SIZE;
+    if (blockend > file->size)
+      blockend = file->size;
+
+    md5_init(&blockstate);
+
+    if (!blockhash__append(fd, offset, blockend - offset, &state, &blockstate)) {
+      if (got_sigint) {
+        printf("\n");
+        exit(0);
+      }
+
+      errormsg("error reading from file %s\n", file->d_name);
+      fdcache_release(file, fd);
+      free(blocks.digests);
+      free(digest);
+      return NULL;
+    }
+
+    offset = blockend;
+
+    /* only complete blocks are recorded; a partial tail is rehashed every time */
+    if (blockend % BLOCK_HASH_SIZE == 0) {
+      md5_finish(&blockstate, blocks.digests + (blockend / BLOCK_HASH_SIZE - 1) * MD5_DIGEST_LENGTH);
+      blocks.state = state;
+    }
+  }
+
+  fdcache_release(file, fd);
+
+  blocks.blockcount = blockcount;
+
+  if (!ISFLAG(flags, F_READONLYCACHE))
+    hashdb_saveblocks(db, file, &blocks);
+
+  free(blocks.digests);
+
+  md5_finish(&state, digest);
+
+  return digest;
+}
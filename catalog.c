@@ -0,0 +1,451 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "catalog.h"
+#include "errormsg.h"
+#ifndef NO_SQLITE
+#include "manifest.h"
+#endif
+
+#define MD5_DIGEST_LENGTH 16
+
+/* A reference catalog lists the MD5 digests of files that need not be
+   readable now, such as those in an offline archive. It may be an
+   fdupes manifest, whose entries carry file sizes and partial hashes,
+   or the output of md5sum, whose entries do not. Entries of known size
+   are kept sorted by size and digest, the rest by digest alone. */
+
+struct catalog_entry
+{
+  char *path;
+  off_t size;
+  int haspartial;
+  md5_byte_t partialhash[MD5_DIGEST_LENGTH];
+  md5_byte_t fullhash[MD5_DIGEST_LENGTH];
+  file_t *reference;
+};
+
+struct catalog_list
+{
+  struct catalog_entry *entries;
+  size_t count;
+  size_t allocated;
+};
+
+static struct catalog_list sized = {0, 0, 0};
+static struct catalog_list unsized = {0, 0, 0};
+
+/* name of the catalog, used to label references to its entries */
+static const char *catalog_name;
+
+static file_t *references = 0;
+static file_t *lastreference = 0;
+
+static struct catalog_entry *catalog__newentry(struct catalog_list *list, const char *path)
+{
+  struct catalog_entry *entries;
+  struct catalog_entry *entry;
+  size_t allocated;
+
+  if (list->count == list->allocated)
+  {
+    allocated = list->allocated == 0 ? 1024 : list->allocated * 2;
+
+    entries = realloc(list->entries, allocated * sizeof(struct catalog_entry));
+    if (entries == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    list->entries = entries;
+    list->allocated = allocated;
+  }
+
+  entry = &list->entries[list->count++];
+  memset(entry, 0, sizeof(struct catalog_entry));
+
+  entry->path = strdup(path);
+  if (entry->path == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  return entry;
+}
+
+static int catalog__compare(const void *a, const void *b)
+{
+  const struct catalog_entry *entry1 = a;
+  const struct catalog_entry *entry2 = b;
+
+  if (entry1->size != entry2->size)
+    return entry1->size < entry2->size ? -1 : 1;
+
+  return memcmp(entry1->fullhash, entry2->fullhash, MD5_DIGEST_LENGTH);
+}
+
+static int catalog__hexdigit(int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  else if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  else if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+/* Convert a hexadecimal digest of exactly length digits. */
+static int catalog__parsedigest(const char *hex, size_t length, md5_byte_t *digest)
+{
+  size_t x;
+  int high;
+  int low;
+
+  if (length != MD5_DIGEST_LENGTH * 2)
+    return 0;
+
+  for (x = 0; x < MD5_DIGEST_LENGTH; ++x)
+  {
+    high = catalog__hexdigit(hex[x * 2]);
+    low = catalog__hexdigit(hex[x * 2 + 1]);
+
+    if (high < 0 || low < 0)
+      return 0;
+
+    digest[x] = (high << 4) | low;
+  }
+
+  return 1;
+}
+
+/* Undo the escaping md5sum applies to names containing a backslash or
+   newline, which it signals by starting the line with a backslash. */
+static void catalog__unescape(char *name)
+{
+  char *from = name;
+  char *to = name;
+
+  while (*from != '\0')
+  {
+    if (from[0] == '\\' && from[1] == 'n') {
+      *to++ = '\n';
+      from += 2;
+    } else if (from[0] == '\\' && from[1] == '\\') {
+      *to++ = '\\';
+      from += 2;
+    } else {
+      *to++ = *from++;
+    }
+  }
+
+  *to = '\0';
+}
+
+/* Parse one line of md5sum output, in either its default form
+   ("DIGEST  NAME", or "DIGEST *NAME" for binary mode) or its BSD form
+   ("MD5 (NAME) = DIGEST"). */
+static int catalog__parseline(char *line, unsigned long linenumber)
+{
+  struct catalog_entry *entry;
+  md5_byte_t digest[MD5_DIGEST_LENGTH];
+  char *name;
+  char *hex;
+  size_t hexlength;
+  size_t length;
+  int escaped;
+
+  length = strlen(line);
+  while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+    line[--length] = '\0';
+
+  if (length == 0 || line[0] == '#')
+    return 1;
+
+  escaped = line[0] == '\\';
+  if (escaped)
+    ++line;
+
+  if (strncmp(line, "MD5 (", 5) == 0)
+  {
+    name = line + 5;
+
+    hex = strstr(name, ") = ");
+    if (hex == 0)
+      return 0;
+
+    *hex = '\0';
+    hex += 4;
+    hexlength = strlen(hex);
+  }
+  else if (strncmp(line, "SHA", 3) == 0 && strstr(line, " (") != 0)
+  {
+    errormsg("catalog line %lu: only MD5 digests are supported\n", linenumber);
+    return 0;
+  }
+  else
+  {
+    hex = line;
+    hexlength = strspn(hex, "0123456789abcdefABCDEF");
+
+    if (hex[hexlength] != ' ' || (hex[hexlength + 1] != ' ' && hex[hexlength + 1] != '*'))
+      return 0;
+
+    name = hex + hexlength + 2;
+  }
+
+  if (!catalog__parsedigest(hex, hexlength, digest))
+  {
+    if (hexlength > MD5_DIGEST_LENGTH * 2)
+      errormsg("catalog line %lu: only MD5 digests are supported\n", linenumber);
+
+    return 0;
+  }
+
+  if (escaped)
+    catalog__unescape(name);
+
+  entry = catalog__newentry(&unsized, name);
+  entry->size = -1;
+  memcpy(entry->fullhash, digest, MD5_DIGEST_LENGTH);
+
+  return 1;
+}
+
+#ifndef NO_SQLITE
+static int catalog__addsignature(const char *path, const struct hashdb_signature *signature)
+{
+  struct catalog_entry *entry;
+
+  if (signature->hashfunction != HASH_FUNCTION_MD5 || signature->fullhash == 0)
+    return 1;
+
+  entry = catalog__newentry(&sized, path);
+  entry->size = signature->size;
+  memcpy(entry->fullhash, signature->fullhash, MD5_DIGEST_LENGTH);
+
+  if (signature->partialhash != 0 && signature->partialbytes == PARTIAL_MD5_SIZE)
+  {
+    entry->haspartial = 1;
+    memcpy(entry->partialhash, signature->partialhash, MD5_DIGEST_LENGTH);
+  }
+
+  return 1;
+}
+#endif
+
+int catalog_load(const char *path)
+{
+  FILE *file;
+  char *line = 0;
+  size_t linesize = 0;
+  unsigned long linenumber = 0;
+  char magic[8];
+  int ismanifest;
+
+  file = fopen(path, "rb");
+  if (file == 0)
+  {
+    errormsg("could not open catalog %s\n", path);
+    return 0;
+  }
+
+  ismanifest = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, "FDUPESMF", sizeof(magic)) == 0;
+
+  catalog_name = path;
+
+  if (ismanifest)
+  {
+    fclose(file);
+
+#ifndef NO_SQLITE
+    if (!manifest_foreachentry(path, catalog__addsignature))
+    {
+      errormsg("could not read catalog %s\n", path);
+      return 0;
+    }
+#else
+    errormsg("manifest catalogs are not supported in this fdupes build\n");
+    return 0;
+#endif
+  }
+  else
+  {
+    rewind(file);
+
+    while (getline(&line, &linesize, file) != -1)
+    {
+      if (!catalog__parseline(line, ++linenumber))
+      {
+        errormsg("could not parse line %lu of catalog %s\n", linenumber, path);
+        free(line);
+        fclose(file);
+        return 0;
+      }
+    }
+
+    free(line);
+    fclose(file);
+  }
+
+  qsort(sized.entries, sized.count, sizeof(struct catalog_entry), catalog__compare);
+  qsort(unsized.entries, unsized.count, sizeof(struct catalog_entry), catalog__compare);
+
+  return 1;
+}
+
+/* index of the first entry of known size not smaller than size */
+static size_t catalog__lowerbound(off_t size)
+{
+  size_t low = 0;
+  size_t high = sized.count;
+  size_t middle;
+
+  while (low < high)
+  {
+    middle = low + (high - low) / 2;
+
+    if (sized.entries[middle].size < size)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+int catalog_candidates(off_t size)
+{
+  size_t x;
+  int result = CATALOG_NONE;
+
+  if (unsized.count > 0)
+    return CATALOG_FULL;
+
+  for (x = catalog__lowerbound(size); x < sized.count && sized.entries[x].size == size; ++x)
+  {
+    if (!sized.entries[x].haspartial)
+      return CATALOG_FULL;
+
+    result = CATALOG_PARTIAL;
+  }
+
+  return result;
+}
+
+int catalog_matchespartial(off_t size, const md5_byte_t *partialhash)
+{
+  size_t x;
+
+  if (unsized.count > 0)
+    return 1;
+
+  for (x = catalog__lowerbound(size); x < sized.count && sized.entries[x].size == size; ++x)
+    if (!sized.entries[x].haspartial || memcmp(sized.entries[x].partialhash, partialhash, MD5_DIGEST_LENGTH) == 0)
+      return 1;
+
+  return 0;
+}
+
+static struct catalog_entry *catalog__search(struct catalog_list *list, const struct catalog_entry *key)
+{
+  struct catalog_entry *entry;
+
+  entry = bsearch(key, list->entries, list->count, sizeof(struct catalog_entry), catalog__compare);
+  if (entry == 0)
+    return 0;
+
+  /* entries with identical contents share the first one's reference */
+  while (entry > list->entries && catalog__compare(entry - 1, key) == 0)
+    --entry;
+
+  return entry;
+}
+
+/* Return the reference standing for the cataloged file with the given
+   size and digest, to which matching files are to be attached as
+   duplicates. */
+file_t *catalog_find(off_t size, const md5_byte_t *fullhash)
+{
+  struct catalog_entry key;
+  struct catalog_entry *entry;
+  file_t *reference;
+
+  key.size = size;
+  memcpy(key.fullhash, fullhash, MD5_DIGEST_LENGTH);
+
+  entry = catalog__search(&sized, &key);
+  if (entry == 0)
+  {
+    key.size = -1;
+    entry = catalog__search(&unsized, &key);
+  }
+
+  if (entry == 0)
+    return 0;
+
+  if (entry->reference == 0)
+  {
+    reference = (file_t*) malloc(sizeof(file_t));
+    if (reference == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    memset(reference, 0, sizeof(file_t));
+
+    reference->d_name = malloc(strlen(catalog_name) + strlen(entry->path) + 2);
+    if (reference->d_name == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    sprintf(reference->d_name, "%s:%s", catalog_name, entry->path);
+    reference->size = size;
+
+    if (lastreference != 0)
+      lastreference->next = reference;
+    else
+      references = reference;
+
+    lastreference = reference;
+
+    entry->reference = reference;
+  }
+
+  return entry->reference;
+}
+
+/* list of references to cataloged files found to have matches */
+file_t *catalog_references()
+{
+  return references;
+}
@@ -22,35 +22,283 @@
 #include "config.h"
 #include "sigint.h"
 #include "confirmmatch.h"
+#include "sparse.h"
+#include "errormsg.h"
 #include <stdlib.h>
 #include <memory.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* bytes read per call, by each thread comparing ranges in parallel */
+#define CONFIRM_BUFFER_SIZE (1024 * 1024)
+
+/* alignment of buffers for reading ranges in parallel */
+#define CONFIRM_BUFFER_ALIGNMENT 4096
+
+#define CONFIRM_DIFFERENT    0
+#define CONFIRM_SAME         1
+#define CONFIRM_INTERRUPTED -1
+
+/* what the threads comparing ranges of a pair of files have in common */
+struct confirmmatch_shared
+{
+  int fd1;
+  int fd2;
+  off_t size;
+  off_t rangecount;
+  int threads;
+  int stop; /* set as soon as any range differs */
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t lock;
+#endif
+};
+
+static int confirmmatch__stopped(struct confirmmatch_shared *shared)
+{
+  int stop = 0;
+
+  if (got_sigint)
+    return 1;
+
+#ifdef HAVE_PTHREAD
+  if (shared != 0)
+  {
+    pthread_mutex_lock(&shared->lock);
+    stop = shared->stop;
+    pthread_mutex_unlock(&shared->lock);
+  }
+#endif
+
+  return stop;
+}
+
+/* Compare the bytes from start to end of two files, reading them into
+   buffers of the given size and adding them to state if not null.
+
+   Ranges that are holes in both files are equal without being read, and
+   data facing a hole in the other file need only be checked for zeros. */
+static int confirmmatch__range(int fd1, int fd2, off_t start, off_t end, unsigned char *c1, unsigned char *c2,
+    size_t buffersize, md5_state_t *state, struct confirmmatch_shared *shared)
+{
+  off_t offset;
+  off_t data1 = start;
+  off_t data2 = start;
+  off_t hole1 = start;
+  off_t hole2 = start;
+  off_t limit;
+  size_t length;
+  int indata1;
+  int indata2;
+
+  for (offset = start; offset < end; offset += length) {
+    if (confirmmatch__stopped(shared))
+      return CONFIRM_INTERRUPTED;
+
+    if (offset >= hole1)
+      sparse_region(fd1, offset, end, &data1, &hole1);
+
+    if (offset >= hole2)
+      sparse_region(fd2, offset, end, &data2, &hole2);
+
+    indata1 = offset >= data1;
+    indata2 = offset >= data2;
+
+    /* read no further than the next change from hole to data or back */
+    limit = indata1 ? hole1 : data1;
+    if ((indata2 ? hole2 : data2) < limit)
+      limit = indata2 ? hole2 : data2;
+
+    /* the file changed if no region lies ahead */
+    if (limit <= offset)
+      return CONFIRM_DIFFERENT;
+
+    /* compare as off_t, which may be wider than size_t */
+    if (limit - offset > (off_t) buffersize)
+      length = buffersize;
+    else
+      length = (size_t) (limit - offset);
+
+    if (!indata1 && !indata2) {
+      if (state)
+        sparse_appendzeros(state, length);
+
+      continue;
+    }
+
+    if (indata1 && pread(fd1, c1, length, offset) != (ssize_t) length) return CONFIRM_DIFFERENT;
+    if (indata2 && pread(fd2, c2, length, offset) != (ssize_t) length) return CONFIRM_DIFFERENT;
+
+    if (indata1 && indata2) {
+      if (memcmp (c1, c2, length)) return CONFIRM_DIFFERENT; /* file contents are different */
+    }
+    else if (!sparse_iszero(indata1 ? c1 : c2, length)) return CONFIRM_DIFFERENT;
+
+    if (state)
+      md5_append(state, indata1 ? c1 : c2, length);
+  }
+
+  return CONFIRM_SAME;
+}
+
+#ifdef HAVE_PTHREAD
+struct confirmmatch_worker
+{
+  struct confirmmatch_shared *shared;
+  int index;
+  int result;
+  pthread_t thread;
+};
+
+/* Compare every range assigned to this worker, stopping every other
+   worker as soon as one differs. */
+static void *confirmmatch__work(void *argument)
+{
+  struct confirmmatch_worker *worker = argument;
+  struct confirmmatch_shared *shared = worker->shared;
+  unsigned char *c1;
+  unsigned char *c2;
+  off_t range;
+  off_t start;
+  off_t end;
+
+  if (posix_memalign((void**) &c1, CONFIRM_BUFFER_ALIGNMENT, CONFIRM_BUFFER_SIZE) != 0 ||
+      posix_memalign((void**) &c2, CONFIRM_BUFFER_ALIGNMENT, CONFIRM_BUFFER_SIZE) != 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  worker->result = CONFIRM_SAME;
+
+  for (range = worker->index; range < shared->rangecount; range += shared->threads)
+  {
+    start = range * CONFIRM_RANGE_SIZE;
+    end = start + CONFIRM_RANGE_SIZE < shared->size ? start + CONFIRM_RANGE_SIZE : shared->size;
+
+    worker->result = confirmmatch__range(shared->fd1, shared->fd2, start, end, c1, c2, CONFIRM_BUFFER_SIZE, 0, shared);
+    if (worker->result != CONFIRM_SAME)
+      break;
+  }
+
+  if (worker->result == CONFIRM_DIFFERENT)
+  {
+    pthread_mutex_lock(&shared->lock);
+    shared->stop = 1;
+    pthread_mutex_unlock(&shared->lock);
+  }
+
+  free(c2);
+  free(c1);
+
+  return 0;
+}
+
+/* Compare ranges of two files on several threads at once. */
+static int confirmmatch__parallel(int fd1, int fd2, off_t size, int threads)
+{
+  struct confirmmatch_shared shared;
+  struct confirmmatch_worker *workers;
+  int *started;
+  int result;
+  int x;
+
+  shared.fd1 = fd1;
+  shared.fd2 = fd2;
+  shared.size = size;
+  shared.rangecount = (size + CONFIRM_RANGE_SIZE - 1) / CONFIRM_RANGE_SIZE;
+  shared.threads = threads;
+  shared.stop = 0;
+  pthread_mutex_init(&shared.lock, 0);
+
+  workers = (struct confirmmatch_worker*) malloc(threads * sizeof(struct confirmmatch_worker));
+  started = (int*) malloc(threads * sizeof(int));
+  if (workers == 0 || started == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  for (x = 0; x < threads; ++x)
+  {
+    workers[x].shared = &shared;
+    workers[x].index = x;
+
+    started[x] = pthread_create(&workers[x].thread, 0, confirmmatch__work, &workers[x]) == 0;
+  }
+
+  /* do the work of any thread that could not be started here */
+  for (x = 0; x < threads; ++x)
+  {
+    if (started[x])
+      pthread_join(workers[x].thread, 0);
+    else
+      confirmmatch__work(&workers[x]);
+  }
+
+  result = CONFIRM_SAME;
+  for (x = 0; x < threads; ++x)
+    if (workers[x].result == CONFIRM_DIFFERENT)
+      result = CONFIRM_DIFFERENT;
+
+  free(started);
+  free(workers);
+
+  pthread_mutex_destroy(&shared.lock);
+
+  return result;
+}
+#endif
 
 /* Do a bit-for-bit comparison in case two different files produce the
-   same signature. Unlikely, but better safe than sorry. */
+   same signature. Unlikely, but better safe than sorry. If digest is not
+   null, the MD5 signature of the files' contents is calculated along the
+   way and stored there when the files match. Otherwise, files larger
+   than CONFIRM_RANGE_SIZE are compared a range per thread, using up to
+   the given number of threads where supported. */
 
-int confirmmatch(FILE *file1, FILE *file2)
+int confirmmatch(int fd1, int fd2, md5_byte_t *digest, int threads)
 {
   unsigned char c1[CHUNK_SIZE];
   unsigned char c2[CHUNK_SIZE];
-  size_t r1;
-  size_t r2;
+  struct stat info1;
+  struct stat info2;
+  off_t size;
+  int result;
+  md5_state_t state;
 
-  fseek(file1, 0, SEEK_SET);
-  fseek(file2, 0, SEEK_SET);
+  if (fstat(fd1, &info1) != 0 || fstat(fd2, &info2) != 0)
+    return 0;
 
-  do {
-    if (got_sigint) {
-      fclose(file1);
-      fclose(file2);
-      exit(0);
-    }
+  if (info1.st_size != info2.st_size) return 0; /* file lengths are different */
+
+  size = info1.st_size;
+
+#ifdef HAVE_PTHREAD
+  if (digest == 0 && threads > 1 && size > CONFIRM_RANGE_SIZE)
+  {
+    if (threads > (size + CONFIRM_RANGE_SIZE - 1) / CONFIRM_RANGE_SIZE)
+      threads = (size + CONFIRM_RANGE_SIZE - 1) / CONFIRM_RANGE_SIZE;
+
+    result = confirmmatch__parallel(fd1, fd2, size, threads);
+  }
+  else
+#endif
+  {
+    if (digest)
+      md5_init(&state);
+
+    result = confirmmatch__range(fd1, fd2, 0, size, c1, c2, sizeof(c1), digest ? &state : 0, 0);
 
-    r1 = fread(c1, sizeof(unsigned char), sizeof(c1), file1);
-    r2 = fread(c2, sizeof(unsigned char), sizeof(c2), file2);
+    if (result == CONFIRM_SAME && digest)
+      md5_finish(&state, digest);
+  }
 
-    if (r1 != r2) return 0; /* file lengths are different */
-    if (memcmp (c1, c2, r1)) return 0; /* file contents are different */
-  } while (r2);
+  if (got_sigint)
+    exit(0);
 
-  return 1;
+  return result == CONFIRM_SAME;
 }
@@ -22,8 +22,10 @@
 #ifndef CONFIRMMATCH_H
 #define CONFIRMMATCH_H
 
-#include <stdio.h>
+#include "md5/md5.h"
 
-int confirmmatch(FILE *file1, FILE *file2);
+#define CONFIRM_MAX_THREADS 64
+
+int confirmmatch(int fd1, int fd2, md5_byte_t *digest, int threads);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,290 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef HAVE_FIDEDUPERANGE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#include "dedupe.h"
+#include "errormsg.h"
+#include "sigint.h"
+
+#ifdef HAVE_FIDEDUPERANGE
+
+/* the kernel may share less than asked for in a single call (btrfs, for
+   one, stops at 16 MiB), so ranges are submitted in chunks of this size */
+#define DEDUPE_CHUNK_SIZE (16 * 1024 * 1024)
+
+/* a request, with all of its destinations, must fit in a 4 KiB page */
+#define DEDUPE_MAX_DESTINATIONS \
+  ((int) ((4096 - sizeof(struct file_dedupe_range)) / sizeof(struct file_dedupe_range_info)))
+
+/* Share the rest of a range that the kernel only partly shared, one call
+   at a time. Returns the status of the last call, counting bytes shared
+   in *shared. */
+static int dedupe_rest(int source, int destination, off_t offset, off_t length, off_t *shared, int *error)
+{
+  struct {
+    struct file_dedupe_range range;
+    struct file_dedupe_range_info info;
+  } request;
+
+  while (length > 0)
+  {
+    memset(&request, 0, sizeof(request));
+    request.range.src_offset = offset;
+    request.range.src_length = length;
+    request.range.dest_count = 1;
+    request.info.dest_fd = destination;
+    request.info.dest_offset = offset;
+
+    if (ioctl(source, FIDEDUPERANGE, &request.range) == -1)
+    {
+      *error = errno;
+      return DEDUPE_ERROR;
+    }
+
+    if (request.info.status < 0)
+    {
+      *error = -request.info.status;
+      return DEDUPE_ERROR;
+    }
+
+    if (request.info.status == FILE_DEDUPE_RANGE_DIFFERS)
+      return DEDUPE_DIFFERS;
+
+    if (request.info.bytes_deduped == 0)
+      return DEDUPE_INCOMPLETE;
+
+    *shared += request.info.bytes_deduped;
+    offset += request.info.bytes_deduped;
+    length -= request.info.bytes_deduped;
+  }
+
+  return DEDUPE_SHARED;
+}
+
+/* Open a file whose extents are to be replaced. The kernel accepts files
+   open for reading only from their owner, so those are tried as well. */
+static int dedupe_opendestination(const char *path)
+{
+  int fd;
+
+  fd = open(path, O_RDWR);
+  if (fd == -1 && (errno == EACCES || errno == EPERM || errno == EROFS || errno == ETXTBSY))
+    fd = open(path, O_RDONLY);
+
+  return fd;
+}
+
+int dedupe_supported()
+{
+  return 1;
+}
+
+/* Ask the kernel to share the extents of keeper with each of members,
+   recording the outcome for each member in results. The kernel compares
+   the data itself, stopping for each member at the first range that
+   differs, so members need not have been confirmed beforehand. */
+void dedupe_group(const file_t *keeper, file_t **members, int count, struct dedupe_result *results)
+{
+  struct file_dedupe_range *range;
+  int *fds;
+  int *pending;
+  int pendingcount;
+  int source;
+  off_t offset;
+  off_t length;
+  int first;
+  int batch;
+  int x;
+
+  for (x = 0; x < count; ++x)
+  {
+    results[x].shared = 0;
+    results[x].status = DEDUPE_SHARED;
+    results[x].error = 0;
+  }
+
+  source = open(keeper->d_name, O_RDONLY);
+  if (source == -1)
+  {
+    for (x = 0; x < count; ++x)
+    {
+      results[x].status = DEDUPE_ERROR;
+      results[x].error = errno;
+    }
+
+    return;
+  }
+
+  fds = malloc(sizeof(int) * count);
+  pending = malloc(sizeof(int) * count);
+  range = malloc(sizeof(struct file_dedupe_range) + DEDUPE_MAX_DESTINATIONS * sizeof(struct file_dedupe_range_info));
+  if (fds == 0 || pending == 0 || range == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  pendingcount = 0;
+  for (x = 0; x < count; ++x)
+  {
+    fds[x] = -1;
+
+    if (members[x]->device == keeper->device && members[x]->inode == keeper->inode)
+    {
+      results[x].status = DEDUPE_SAMEFILE;
+      continue;
+    }
+
+    /* found by findsharedextents() to share every extent already */
+    if (members[x]->sharedwith != 0 && members[x]->sharedwith == keeper->sharedwith)
+    {
+      results[x].status = DEDUPE_ALREADYSHARED;
+      continue;
+    }
+
+    fds[x] = dedupe_opendestination(members[x]->d_name);
+    if (fds[x] == -1)
+    {
+      results[x].status = DEDUPE_ERROR;
+      results[x].error = errno;
+      continue;
+    }
+
+    pending[pendingcount++] = x;
+  }
+
+  /* members drop out of pending as soon as they stop matching */
+  for (offset = 0; offset < keeper->size && pendingcount > 0; offset += length)
+  {
+    if (got_sigint)
+      break;
+
+    length = keeper->size - offset;
+    if (length > DEDUPE_CHUNK_SIZE)
+      length = DEDUPE_CHUNK_SIZE;
+
+    for (first = 0; first < pendingcount; first += batch)
+    {
+      batch = pendingcount - first;
+      if (batch > DEDUPE_MAX_DESTINATIONS)
+        batch = DEDUPE_MAX_DESTINATIONS;
+
+      memset(range, 0, sizeof(struct file_dedupe_range) + batch * sizeof(struct file_dedupe_range_info));
+      range->src_offset = offset;
+      range->src_length = length;
+      range->dest_count = batch;
+
+      for (x = 0; x < batch; ++x)
+      {
+        range->info[x].dest_fd = fds[pending[first + x]];
+        range->info[x].dest_offset = offset;
+      }
+
+      if (ioctl(source, FIDEDUPERANGE, range) == -1)
+      {
+        for (x = 0; x < batch; ++x)
+        {
+          results[pending[first + x]].status = DEDUPE_ERROR;
+          results[pending[first + x]].error = errno;
+        }
+
+        continue;
+      }
+
+      for (x = 0; x < batch; ++x)
+      {
+        struct dedupe_result *result = &results[pending[first + x]];
+
+        if (range->info[x].status < 0)
+        {
+          result->status = DEDUPE_ERROR;
+          result->error = -range->info[x].status;
+        }
+        else if (range->info[x].status == FILE_DEDUPE_RANGE_DIFFERS)
+          result->status = DEDUPE_DIFFERS;
+        else
+        {
+          result->shared += range->info[x].bytes_deduped;
+
+          if ((off_t) range->info[x].bytes_deduped < length)
+            result->status = dedupe_rest(source, fds[pending[first + x]],
+                offset + range->info[x].bytes_deduped,
+                length - range->info[x].bytes_deduped,
+                &result->shared, &result->error);
+        }
+      }
+    }
+
+    /* keep only the members that matched throughout */
+    batch = 0;
+    for (x = 0; x < pendingcount; ++x)
+      if (results[pending[x]].status == DEDUPE_SHARED)
+        pending[batch++] = pending[x];
+
+    pendingcount = batch;
+  }
+
+  /* interrupted before the end */
+  if (offset < keeper->size)
+    for (x = 0; x < pendingcount; ++x)
+      results[pending[x]].status = DEDUPE_INCOMPLETE;
+
+  for (x = 0; x < count; ++x)
+    if (fds[x] != -1)
+      close(fds[x]);
+
+  close(source);
+
+  free(range);
+  free(pending);
+  free(fds);
+}
+
+#else
+
+int dedupe_supported()
+{
+  return 0;
+}
+
+void dedupe_group(const file_t *keeper, file_t **members, int count, struct dedupe_result *results)
+{
+  int x;
+
+  for (x = 0; x < count; ++x)
+  {
+    results[x].shared = 0;
+    results[x].status = DEDUPE_ERROR;
+    results[x].error = EOPNOTSUPP;
+  }
+}
+
+#endif
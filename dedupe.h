@@ -0,0 +1,45 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef DEDUPE_H
+#define DEDUPE_H
+
+#include "fdupes.h"
+
+/* outcome of sharing the extents of a file with those of its keeper */
+#define DEDUPE_SHARED         0
+#define DEDUPE_DIFFERS        1
+#define DEDUPE_SAMEFILE       2
+#define DEDUPE_INCOMPLETE     3
+#define DEDUPE_ALREADYSHARED  4
+#define DEDUPE_ERROR         -1
+
+struct dedupe_result
+{
+  off_t shared; /* bytes the kernel reported as shared */
+  int status;
+  int error; /* errno value, if status is DEDUPE_ERROR */
+};
+
+int dedupe_supported();
+void dedupe_group(const file_t *keeper, file_t **members, int count, struct dedupe_result *results);
+
+#endif
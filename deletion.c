@@ -0,0 +1,673 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include "deletion.h"
+#include "removeifnotchanged.h"
+#include "errormsg.h"
+#include "flags.h"
+#ifndef NO_SQLITE
+#include "hashdb.h"
+#include "getrealpath.h"
+#endif
+
+/* Files are deleted, or replaced by hard links, relative to their parent
+   directory, which is opened once and kept open while further files in
+   it are handled, so that neither the stat() check nor the unlink() has
+   to resolve the full path again, and so that the directory cannot be
+   swapped for another between the two. Cache entries for deleted files
+   are forgotten in batches, each in a single transaction, looking up
+   every directory once per batch. */
+
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_UNLINKAT) && \
+    defined(HAVE_LINKAT) && defined(HAVE_RENAMEAT)
+#define DELETION_AT_FUNCTIONS
+#endif
+
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define DELETION_DIRECTORY_SLOTS 32
+#define DELETION_QUEUE_LIMIT 16384
+
+#ifndef NO_SQLITE
+extern sqlite3 *db;
+#endif
+
+struct deletion_directory
+{
+  char *path;
+  int fd;
+};
+
+struct deletion_directories
+{
+  struct deletion_directory slots[DELETION_DIRECTORY_SLOTS];
+};
+
+static struct deletion_directories directories;
+
+#ifndef NO_SQLITE
+static char **forgotten = 0;
+static size_t forgottencount = 0;
+static size_t forgottenallocated = 0;
+#endif
+
+/* Find the length of the parent directory part of name, setting base to
+   its last component. A name without a directory part has length 0. */
+static size_t deletion__directorylength(const char *name, const char **base)
+{
+  const char *slash;
+
+  slash = strrchr(name, '/');
+  if (slash == 0)
+  {
+    *base = name;
+    return 0;
+  }
+
+  *base = slash + 1;
+
+  return slash == name ? 1 : slash - name;
+}
+
+static unsigned long deletion__hash(const char *name, size_t length)
+{
+  unsigned long hash = 5381;
+  size_t x;
+
+  for (x = 0; x < length; ++x)
+    hash = hash * 33 + (unsigned char) name[x];
+
+  return hash;
+}
+
+#ifdef DELETION_AT_FUNCTIONS
+/* Return a descriptor for the parent directory of name, opening it if
+   it isn't open already, or -1 if it cannot be opened. */
+static int deletion__opendirectory(struct deletion_directories *cache, const char *name, const char **base)
+{
+  struct deletion_directory *slot;
+  size_t length;
+  char *path;
+
+  length = deletion__directorylength(name, base);
+
+  slot = &cache->slots[deletion__hash(name, length) % DELETION_DIRECTORY_SLOTS];
+
+  if (slot->path != 0 && strncmp(slot->path, name, length) == 0 && slot->path[length] == '\0')
+    return slot->fd;
+
+  path = (char*) malloc(length + 2);
+  if (path == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  if (length == 0)
+    strcpy(path, ".");
+  else
+  {
+    memcpy(path, name, length);
+    path[length] = '\0';
+  }
+
+  if (slot->path != 0)
+  {
+    close(slot->fd);
+    free(slot->path);
+    slot->path = 0;
+  }
+
+  slot->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (slot->fd == -1)
+  {
+    free(path);
+    return -1;
+  }
+
+  /* remember the directory under the name it is looked up by */
+  path[length] = '\0';
+  slot->path = path;
+
+  return slot->fd;
+}
+#endif
+
+static void deletion__closedirectories(struct deletion_directories *cache)
+{
+  int x;
+
+  for (x = 0; x < DELETION_DIRECTORY_SLOTS; ++x)
+  {
+    if (cache->slots[x].path != 0)
+    {
+      close(cache->slots[x].fd);
+      free(cache->slots[x].path);
+      cache->slots[x].path = 0;
+    }
+  }
+}
+
+/* Wrappers for calls on name relative to the directory open as fd, or,
+   if fd is -1, on name as a path of its own. */
+static int deletion__stat(int fd, const char *name, struct stat *st)
+{
+#ifdef DELETION_AT_FUNCTIONS
+  if (fd != -1)
+    return fstatat(fd, name, st, 0);
+#endif
+
+  return stat(name, st);
+}
+
+static int deletion__unlink(int fd, const char *name)
+{
+#ifdef DELETION_AT_FUNCTIONS
+  if (fd != -1)
+    return unlinkat(fd, name, 0);
+#endif
+
+  return unlink(name);
+}
+
+/* Link name to target, or to the file it points to if target is a
+   symbolic link, as files are followed through symlinks with -s. */
+static int deletion__link(const char *target, int fd, const char *name)
+{
+#ifdef DELETION_AT_FUNCTIONS
+  return linkat(AT_FDCWD, target, fd != -1 ? fd : AT_FDCWD, name, AT_SYMLINK_FOLLOW);
+#else
+  return link(target, name);
+#endif
+}
+
+static int deletion__rename(int fd, const char *from, const char *to)
+{
+#ifdef DELETION_AT_FUNCTIONS
+  if (fd != -1)
+    return renameat(fd, from, fd, to);
+#endif
+
+  return rename(from, to);
+}
+
+/* Find the name to use for file with the wrappers above, along with the
+   descriptor for its parent directory, or -1 to use its full path. */
+static int deletion__locate(struct deletion_directories *cache, const file_t *file, const char **name)
+{
+#ifdef DELETION_AT_FUNCTIONS
+  int fd;
+
+  fd = deletion__opendirectory(cache, file->d_name, name);
+  if (fd != -1)
+    return fd;
+#endif
+
+  *name = file->d_name;
+
+  return -1;
+}
+
+/* Delete file unless it has changed, returning 0 on success,
+   DELETION_CHANGED if it has changed, or -1 with error set if it could
+   not be deleted. */
+static int deletion__remove(struct deletion_directories *cache, const file_t *file, int *error)
+{
+  struct stat st;
+  const char *name;
+  int fd;
+
+  fd = deletion__locate(cache, file, &name);
+
+  if (deletion__stat(fd, name, &st) != 0 || statchanged(file, &st))
+    return DELETION_CHANGED;
+
+  if (deletion__unlink(fd, name) != 0)
+  {
+    *error = errno;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Tell whether target has changed since it was found. Its status change
+   time is not compared, since every link made to it changes that. */
+static int deletion__targetchanged(const file_t *target)
+{
+  struct stat st;
+
+  if (stat(target->d_name, &st) != 0)
+    return 1;
+
+  return st.st_dev != target->device ||
+      st.st_ino != target->inode ||
+      st.st_mtime != target->mtime ||
+#ifdef HAVE_NSEC_TIMES
+      st.st_mtim.tv_nsec != target->mtime_nsec ||
+#endif
+      st.st_size != target->size;
+}
+
+/* Create a hard link to target named temporary, relative to fd, and make
+   sure it is the file we expected. */
+static int deletion__relink(const file_t *target, int fd, const char *temporary, int *error)
+{
+  struct stat st;
+
+  if (deletion__link(target->d_name, fd, temporary) != 0)
+  {
+    *error = errno;
+    return -1;
+  }
+
+  if (deletion__stat(fd, temporary, &st) != 0 || st.st_dev != target->device || st.st_ino != target->inode)
+  {
+    deletion__unlink(fd, temporary);
+    return DELETION_TARGET_CHANGED;
+  }
+
+  return 0;
+}
+
+/* Replace file with a hard link to target unless either has changed,
+   returning 0 on success or an error as deletion__remove() does. The
+   link is made under a temporary name, then renamed over file, so that
+   file's name never goes missing. */
+static int deletion__replace(struct deletion_directories *cache, const file_t *file, const file_t *target, int *error)
+{
+  struct stat st;
+  const char *name;
+  const char *slash;
+  char *temporary;
+  size_t length;
+  int attempt;
+  int result;
+  int fd;
+
+  if (file->device != target->device)
+    return DELETION_OTHER_DEVICE;
+
+  fd = deletion__locate(cache, file, &name);
+
+  if (deletion__stat(fd, name, &st) != 0 || statchanged(file, &st))
+    return DELETION_CHANGED;
+
+  /* nothing to do if file is a link to target already */
+  if (file->inode == target->inode)
+    return 0;
+
+  if (deletion__targetchanged(target))
+    return DELETION_TARGET_CHANGED;
+
+  /* the temporary name goes in the same directory as file */
+  slash = strrchr(name, '/');
+  length = slash != 0 ? slash - name + 1 : 0;
+
+  temporary = (char*) malloc(length + 64);
+  if (temporary == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  attempt = 0;
+  do
+  {
+    memcpy(temporary, name, length);
+    sprintf(temporary + length, ".fdupes-link-%ld-%d", (long) getpid(), attempt);
+
+    result = deletion__relink(target, fd, temporary, error);
+  } while (result == -1 && *error == EEXIST && ++attempt < 100);
+
+  if (result != 0)
+  {
+    free(temporary);
+    return result;
+  }
+
+  /* check once more, as late as possible, that file is as it was */
+  if (deletion__stat(fd, name, &st) != 0 || statchanged(file, &st))
+    result = DELETION_CHANGED;
+  else if (deletion__rename(fd, temporary, name) != 0)
+  {
+    *error = errno;
+    result = -1;
+  }
+
+  if (result != 0)
+    deletion__unlink(fd, temporary);
+
+  free(temporary);
+
+  return result;
+}
+
+/* Carry out request, replacing its file by a link if it has a target. */
+static int deletion__carryout(struct deletion_directories *cache, struct deletion_request *request)
+{
+  if (request->target != 0)
+    return deletion__replace(cache, request->file, request->target, &request->error);
+
+  return deletion__remove(cache, request->file, &request->error);
+}
+
+#ifndef NO_SQLITE
+static int deletion__comparedirectories(const void *a, const void *b)
+{
+  const char *name1 = *(char * const *) a;
+  const char *name2 = *(char * const *) b;
+  const char *base;
+  size_t length1;
+  size_t length2;
+
+  length1 = deletion__directorylength(name1, &base);
+  length2 = deletion__directorylength(name2, &base);
+
+  if (length1 != length2)
+    return length1 < length2 ? -1 : 1;
+
+  return memcmp(name1, name2, length1);
+}
+
+/* Forget cache entries for the files deleted so far. */
+static void deletion__flushcache()
+{
+  sqlite3_int64 directoryid = 0;
+  const char *base;
+  const char *previous = 0;
+  size_t previouslength = 0;
+  char *directory;
+  char *realdirectory;
+  size_t length;
+  size_t x;
+  int known = 0;
+  int transaction;
+
+  if (forgottencount == 0)
+    return;
+
+  qsort(forgotten, forgottencount, sizeof(char*), deletion__comparedirectories);
+
+  transaction = sqlite3_get_autocommit(db);
+  if (transaction)
+    hashdb_begintransaction(db);
+
+  for (x = 0; x < forgottencount; ++x)
+  {
+    length = deletion__directorylength(forgotten[x], &base);
+
+    if (previous == 0 || length != previouslength || memcmp(previous, forgotten[x], length) != 0)
+    {
+      directory = (char*) malloc(length + 2);
+      if (directory == 0)
+      {
+        errormsg("out of memory\n");
+        exit(1);
+      }
+
+      if (length == 0)
+        strcpy(directory, ".");
+      else
+      {
+        memcpy(directory, forgotten[x], length);
+        directory[length] = '\0';
+      }
+
+      realdirectory = getrealpath(directory, 0);
+
+      known = realdirectory != 0 && hashdb_getdirectoryid(db, realdirectory, &directoryid);
+
+      free(realdirectory);
+      free(directory);
+
+      previous = forgotten[x];
+      previouslength = length;
+    }
+
+    if (known)
+      hashdb_deletehash(db, directoryid, base);
+  }
+
+  if (transaction)
+    hashdb_committransaction(db);
+
+  for (x = 0; x < forgottencount; ++x)
+    free(forgotten[x]);
+
+  forgottencount = 0;
+}
+#endif
+
+/* Queue the cache entry for a deleted file to be forgotten. */
+static void deletion__forget(const char *name)
+{
+#ifndef NO_SQLITE
+  char **newforgotten;
+
+  if (db == 0 || ISFLAG(flags, F_READONLYCACHE))
+    return;
+
+  if (forgottencount == forgottenallocated)
+  {
+    forgottenallocated = forgottenallocated == 0 ? 1024 : forgottenallocated * 2;
+
+    newforgotten = (char**) realloc(forgotten, forgottenallocated * sizeof(char*));
+    if (newforgotten == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    forgotten = newforgotten;
+  }
+
+  forgotten[forgottencount] = strdup(name);
+  if (forgotten[forgottencount] == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  ++forgottencount;
+
+  if (forgottencount >= DELETION_QUEUE_LIMIT)
+    deletion__flushcache();
+#endif
+}
+
+/* Delete file unless it has changed since it was found, as
+   removeifnotchanged() does, forgetting its cache entry once deleted. */
+int deletion_remove(const file_t *file, char **errorstring)
+{
+  return deletion_replace(file, 0, errorstring);
+}
+
+/* Replace file with a hard link to target, as deletion_remove() would
+   delete it, or simply delete it if target is 0. */
+int deletion_replace(const file_t *file, const file_t *target, char **errorstring)
+{
+  struct deletion_request request;
+
+  request.file = file;
+  request.target = target;
+  request.error = 0;
+  request.result = deletion__carryout(&directories, &request);
+
+  if (request.result == 0)
+    deletion__forget(file->d_name);
+  else if (errorstring != 0)
+    *errorstring = deletion_errorstring(&request);
+
+  return request.result;
+}
+
+char *deletion_errorstring(const struct deletion_request *request)
+{
+  static char *filechanged = "File contents changed during processing";
+  static char *targetchanged = "File kept changed during processing";
+  static char *otherdevice = "File kept is on another device";
+  static char *unknownerror = "Unknown error";
+  char *errorstring;
+
+  if (request->result == DELETION_CHANGED)
+    return filechanged;
+
+  if (request->result == DELETION_TARGET_CHANGED)
+    return targetchanged;
+
+  if (request->result == DELETION_OTHER_DEVICE)
+    return otherdevice;
+
+  errorstring = strerror(request->error);
+
+  return errorstring != 0 ? errorstring : unknownerror;
+}
+
+#ifdef HAVE_PTHREAD
+struct deletion_worker
+{
+  struct deletion_request *requests;
+  const int *owners;
+  size_t count;
+  int index;
+  pthread_t thread;
+};
+
+/* Delete the files in directories assigned to this worker, so that each
+   directory is opened, and written to, by one worker only. */
+static void *deletion__work(void *argument)
+{
+  struct deletion_worker *worker = argument;
+  struct deletion_directories cache;
+  size_t x;
+
+  memset(&cache, 0, sizeof(cache));
+
+  for (x = 0; x < worker->count; ++x)
+    if (worker->owners[x] == worker->index)
+      worker->requests[x].result = deletion__carryout(&cache, &worker->requests[x]);
+
+  deletion__closedirectories(&cache);
+
+  return 0;
+}
+#endif
+
+/* Carry out every request in requests, deleting its file or replacing
+   it with a link to its target, across the given number of worker
+   threads where supported, filling in each request's result. */
+void deletion_removeall(struct deletion_request *requests, size_t count, int threads)
+{
+#ifdef HAVE_PTHREAD
+  struct deletion_worker *workers;
+  const char *base;
+  int *owners;
+  size_t length;
+  int *started;
+  int thread;
+#endif
+  size_t x;
+
+  for (x = 0; x < count; ++x)
+    requests[x].error = 0;
+
+#ifdef HAVE_PTHREAD
+  if (threads > 1 && count > 1)
+  {
+    workers = (struct deletion_worker*) malloc(threads * sizeof(struct deletion_worker));
+    owners = (int*) malloc(count * sizeof(int));
+    started = (int*) malloc(threads * sizeof(int));
+    if (workers == 0 || owners == 0 || started == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    for (x = 0; x < count; ++x)
+    {
+      length = deletion__directorylength(requests[x].file->d_name, &base);
+      owners[x] = deletion__hash(requests[x].file->d_name, length) % threads;
+    }
+
+    for (thread = 0; thread < threads; ++thread)
+    {
+      workers[thread].requests = requests;
+      workers[thread].owners = owners;
+      workers[thread].count = count;
+      workers[thread].index = thread;
+
+      started[thread] = pthread_create(&workers[thread].thread, 0, deletion__work, &workers[thread]) == 0;
+    }
+
+    /* do the work of any thread that could not be started here */
+    for (thread = 0; thread < threads; ++thread)
+    {
+      if (started[thread])
+        pthread_join(workers[thread].thread, 0);
+      else
+        deletion__work(&workers[thread]);
+    }
+
+    free(started);
+    free(owners);
+    free(workers);
+  }
+  else
+#endif
+  {
+    for (x = 0; x < count; ++x)
+      requests[x].result = deletion__carryout(&directories, &requests[x]);
+  }
+
+  for (x = 0; x < count; ++x)
+    if (requests[x].result == 0)
+      deletion__forget(requests[x].file->d_name);
+}
+
+/* Forget cache entries for deleted files and close directories. */
+void deletion_finish()
+{
+#ifndef NO_SQLITE
+  if (db != 0)
+    deletion__flushcache();
+#endif
+
+  deletion__closedirectories(&directories);
+}
@@ -0,0 +1,48 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef DELETION_H
+#define DELETION_H
+
+#include "fdupes.h"
+
+#define DELETION_MAX_THREADS 64
+
+/* results other than 0 (success) and -1 (failure, with errno) */
+#define DELETION_CHANGED        -2
+#define DELETION_TARGET_CHANGED -3
+#define DELETION_OTHER_DEVICE   -4
+
+struct deletion_request
+{
+  const file_t *file;
+  const file_t *target; /* file to link to instead of deleting, or 0 */
+  int result;
+  int error; /* errno value, if result is -1 */
+};
+
+int deletion_remove(const file_t *file, char **errorstring);
+int deletion_replace(const file_t *file, const file_t *target, char **errorstring);
+void deletion_removeall(struct deletion_request *requests, size_t count, int threads);
+char *deletion_errorstring(const struct deletion_request *request);
+void deletion_finish();
+
+#endif
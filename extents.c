@@ -0,0 +1,187 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#if defined(HAVE_LINUX_FS_H) && defined(HAVE_LINUX_FIEMAP_H)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+#include "extents.h"
+#include "errormsg.h"
+
+struct extent
+{
+  uint64_t logical;
+  uint64_t physical;
+  uint64_t length;
+};
+
+struct extentmap
+{
+  struct extent *extents;
+  size_t count;
+};
+
+#ifdef FS_IOC_FIEMAP
+
+/* number of extents to ask for per call */
+#define EXTENTS_PER_CALL 64
+
+/* extents whose physical location says nothing certain about the data
+   they hold, or that may be shared only in part */
+#define EXTENTS_UNSUITABLE (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | \
+  FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED | \
+  FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_UNWRITTEN)
+
+/* Read the map of extents holding the data of a file open for reading
+   as fd. Returns 0 if the map cannot be read, or if the location of its
+   extents cannot be taken to identify the data they hold. */
+struct extentmap *extents_load(int fd)
+{
+  struct fiemap *request;
+  struct extentmap *map;
+  struct extent *grown;
+  size_t capacity;
+  uint32_t x;
+  int last;
+
+  request = (struct fiemap*) malloc(sizeof(struct fiemap) + EXTENTS_PER_CALL * sizeof(struct fiemap_extent));
+  map = (struct extentmap*) malloc(sizeof(struct extentmap));
+  if (request == 0 || map == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  map->extents = 0;
+  map->count = 0;
+  capacity = 0;
+
+  last = 0;
+  while (!last)
+  {
+    memset(request, 0, sizeof(struct fiemap));
+    request->fm_start = map->count > 0 ?
+      map->extents[map->count - 1].logical + map->extents[map->count - 1].length : 0;
+    request->fm_length = FIEMAP_MAX_OFFSET - request->fm_start;
+    request->fm_extent_count = EXTENTS_PER_CALL;
+    request->fm_flags = FIEMAP_FLAG_SYNC; /* flush data written lately, so it is mapped */
+
+    if (ioctl(fd, FS_IOC_FIEMAP, request) == -1 || request->fm_mapped_extents == 0)
+      break;
+
+    if (map->count + request->fm_mapped_extents > capacity)
+    {
+      capacity = capacity == 0 ? EXTENTS_PER_CALL : capacity * 2;
+      grown = (struct extent*) realloc(map->extents, sizeof(struct extent) * capacity);
+      if (grown == 0)
+      {
+        errormsg("out of memory\n");
+        exit(1);
+      }
+
+      map->extents = grown;
+    }
+
+    for (x = 0; x < request->fm_mapped_extents; ++x)
+    {
+      if (request->fm_extents[x].fe_flags & EXTENTS_UNSUITABLE)
+        break;
+
+      map->extents[map->count].logical = request->fm_extents[x].fe_logical;
+      map->extents[map->count].physical = request->fm_extents[x].fe_physical;
+      map->extents[map->count].length = request->fm_extents[x].fe_length;
+      ++map->count;
+
+      if (request->fm_extents[x].fe_flags & FIEMAP_EXTENT_LAST)
+      {
+        last = 1;
+        break;
+      }
+    }
+
+    if (!last && x < request->fm_mapped_extents)
+      break;
+  }
+
+  free(request);
+
+  /* an incomplete map, or an empty one, identifies nothing */
+  if (!last || map->count == 0)
+  {
+    extents_free(map);
+    return 0;
+  }
+
+  return map;
+}
+
+#else
+
+struct extentmap *extents_load(int fd)
+{
+  return 0;
+}
+
+#endif
+
+/* Order maps so that identical maps sort together. Files with identical
+   maps share every extent, and therefore every byte, with each other. */
+int extents_compare(const struct extentmap *map1, const struct extentmap *map2)
+{
+  const struct extent *extent1;
+  const struct extent *extent2;
+  size_t x;
+
+  for (x = 0; x < map1->count && x < map2->count; ++x)
+  {
+    extent1 = &map1->extents[x];
+    extent2 = &map2->extents[x];
+
+    if (extent1->physical != extent2->physical)
+      return extent1->physical < extent2->physical ? -1 : 1;
+
+    if (extent1->logical != extent2->logical)
+      return extent1->logical < extent2->logical ? -1 : 1;
+
+    if (extent1->length != extent2->length)
+      return extent1->length < extent2->length ? -1 : 1;
+  }
+
+  if (map1->count != map2->count)
+    return map1->count < map2->count ? -1 : 1;
+
+  return 0;
+}
+
+void extents_free(struct extentmap *map)
+{
+  if (map == 0)
+    return;
+
+  free(map->extents);
+  free(map);
+}
@@ -0,0 +1,255 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "fdcache.h"
+#include "errormsg.h"
+
+/* The descriptor cache keeps files open between the stages that read
+   them (partial, full and sample signatures, and match confirmation), so
+   that each file is opened once rather than once per stage, which on
+   network filesystems saves a round trip each time. Descriptors are
+   kept for the least recently used files until the cache is full. It
+   holds at most half as many descriptors as the process may have open,
+   and no more than FD_CACHE_MAX.
+
+   A descriptor returned by fdcache_open() stays valid until passed to
+   fdcache_release(). Each file record remembers the slot its descriptor
+   is kept in, so finding it takes no search. */
+
+struct fdcache_slot
+{
+  file_t *file;
+  int fd;
+  int pinned; /* number of callers yet to release the descriptor */
+  struct fdcache_slot *newer;
+  struct fdcache_slot *older;
+};
+
+static struct fdcache_slot *fdcache_slots = 0;
+static int fdcache_capacity = 0;
+static int fdcache_used = 0;
+static struct fdcache_slot *fdcache_newest = 0;
+static struct fdcache_slot *fdcache_oldest = 0;
+static struct fdcache_slot *fdcache_unused = 0; /* slots given back, chained by older */
+
+void fdcache_init()
+{
+  struct rlimit limit;
+  rlim_t capacity = FD_CACHE_MAX;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur / 2 < capacity)
+    capacity = limit.rlim_cur / 2;
+
+  /* confirming a match takes two descriptors at once */
+  if (capacity < 2)
+    capacity = 2;
+
+  fdcache_slots = (struct fdcache_slot*) malloc(capacity * sizeof(struct fdcache_slot));
+  if (fdcache_slots == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  fdcache_capacity = (int) capacity;
+  fdcache_used = 0;
+  fdcache_newest = 0;
+  fdcache_oldest = 0;
+  fdcache_unused = 0;
+}
+
+static struct fdcache_slot *fdcache__find(const file_t *file)
+{
+  if (file->fdslot < 0 || file->fdslot >= fdcache_used || fdcache_slots[file->fdslot].file != file)
+    return 0;
+
+  return &fdcache_slots[file->fdslot];
+}
+
+static void fdcache__unlink(struct fdcache_slot *slot)
+{
+  if (slot->newer != 0)
+    slot->newer->older = slot->older;
+  else
+    fdcache_newest = slot->older;
+
+  if (slot->older != 0)
+    slot->older->newer = slot->newer;
+  else
+    fdcache_oldest = slot->newer;
+}
+
+static void fdcache__link(struct fdcache_slot *slot)
+{
+  slot->newer = 0;
+  slot->older = fdcache_newest;
+
+  if (fdcache_newest != 0)
+    fdcache_newest->newer = slot;
+  else
+    fdcache_oldest = slot;
+
+  fdcache_newest = slot;
+}
+
+/* Find a slot to keep a new descriptor in, closing the descriptor of the
+   least recently used file not in use if the cache is full. */
+static struct fdcache_slot *fdcache__claim()
+{
+  struct fdcache_slot *slot;
+
+  if (fdcache_unused != 0)
+  {
+    slot = fdcache_unused;
+    fdcache_unused = slot->older;
+    return slot;
+  }
+
+  if (fdcache_used < fdcache_capacity)
+    return &fdcache_slots[fdcache_used++];
+
+  for (slot = fdcache_oldest; slot != 0; slot = slot->newer)
+  {
+    if (slot->pinned == 0)
+    {
+      fdcache__unlink(slot);
+      close(slot->fd);
+      slot->file->fdslot = -1;
+      return slot;
+    }
+  }
+
+  return 0;
+}
+
+/* Open a file for reading, or find its descriptor already open. A file
+   opened for the first time must still be the one it was listed as, or
+   it is not opened at all. Returns -1 on failure. */
+int fdcache_open(file_t *file)
+{
+  struct fdcache_slot *slot;
+  struct stat info;
+  int fd;
+
+  slot = fdcache__find(file);
+  if (slot != 0)
+  {
+    ++slot->pinned;
+    fdcache__unlink(slot);
+    fdcache__link(slot);
+    return slot->fd;
+  }
+
+  fd = open(file->d_name, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  if ((file->device != 0 || file->inode != 0) &&
+      (fstat(fd, &info) != 0 || info.st_dev != file->device || info.st_ino != file->inode))
+  {
+    errormsg("file %s was replaced since it was listed\n", file->d_name);
+    close(fd);
+    return -1;
+  }
+
+  if (fdcache_capacity == 0)
+    return fd;
+
+  slot = fdcache__claim();
+  if (slot == 0)
+    return fd;
+
+  slot->file = file;
+  slot->fd = fd;
+  slot->pinned = 1;
+  fdcache__link(slot);
+
+  file->fdslot = (int) (slot - fdcache_slots);
+
+  return fd;
+}
+
+/* Give back a descriptor returned by fdcache_open(). */
+void fdcache_release(file_t *file, int fd)
+{
+  struct fdcache_slot *slot;
+
+  slot = fdcache__find(file);
+  if (slot == 0 || slot->fd != fd)
+  {
+    close(fd);
+    return;
+  }
+
+  --slot->pinned;
+}
+
+/* Close a file's descriptor, if kept and no longer in use, such as
+   before the file is deleted. */
+void fdcache_forget(file_t *file)
+{
+  struct fdcache_slot *slot;
+
+  slot = fdcache__find(file);
+  if (slot == 0 || slot->pinned > 0)
+    return;
+
+  fdcache__unlink(slot);
+  close(slot->fd);
+
+  file->fdslot = -1;
+
+  slot->file = 0;
+  slot->older = fdcache_unused;
+  fdcache_unused = slot;
+}
+
+/* Close every descriptor kept and keep no more, for when files are
+   about to be deleted or replaced. */
+void fdcache_stop()
+{
+  struct fdcache_slot *slot;
+
+  for (slot = fdcache_oldest; slot != 0; slot = slot->newer)
+  {
+    if (slot->pinned == 0)
+    {
+      close(slot->fd);
+      slot->file->fdslot = -1;
+    }
+  }
+
+  free(fdcache_slots);
+
+  fdcache_slots = 0;
+  fdcache_capacity = 0;
+  fdcache_used = 0;
+  fdcache_newest = 0;
+  fdcache_oldest = 0;
+  fdcache_unused = 0;
+}
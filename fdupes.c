@@ -51,18 +51,32 @@
 #include "sigint.h"
 #include "flags.h"
 #include "removeifnotchanged.h"
+#include "deletion.h"
+#include "dedupe.h"
+#include "extents.h"
+#include "sparse.h"
+#include "treehash.h"
+#include "sample.h"
+#include "arena.h"
+#include "fdcache.h"
+#include "residency.h"
+#include "filequeue.h"
+#include "xattrcache.h"
+#include "catalog.h"
+#include "snapshot.h"
+#include "output.h"
+#include "results.h"
+#include "plan.h"
+#include "fileaction.h"
 #ifndef NO_SQLITE
 #define FDUPES_DATABASE_DIRECTORY FDUPES_CACHE_DIRECTORY "/" FDUPES_HASH_DATABASE_NAME
   #include "hashdb.h"
   #include "getrealpath.h"
   #include "xdgbase.h"
+  #include "blockhash.h"
+  #include "manifest.h"
 #endif
 
-#define ONE_MB ((off_t)1048576)
-#define HEURISTIC_BLOCK ONE_MB
-#define HEURISTIC_LIMIT (3 * ONE_MB)
-#define HEURISTIC_INTERVAL (50 * ONE_MB)
-
 #ifdef __APPLE__
 #include <mach/mach_time.h>
 #endif
@@ -86,45 +100,84 @@ typedef enum {
 
 ordertype_t ordertype = ORDER_MTIME;
 
-#define MD5_DIGEST_LENGTH 16
+/* names of the sets roots are assigned to with --set, numbered from 1 */
+char **setnames = 0;
+int setcount = 0;
 
-typedef struct _filetree {
-  file_t *file; 
-  struct _filetree *left;
-  struct _filetree *right;
-} filetree_t;
+/* set that files found by grokdir() are assigned to */
+int scanset = 0;
 
-void escapefilename(char *escape_list, char **filename_ptr)
-{
-  int x;
-  int tx;
-  char *tmp;
-  char *filename;
+/* queue grokdir() passes files found to with --pipeline, or 0 */
+struct filequeue *traversalqueue = 0;
 
-  filename = *filename_ptr;
+/* set restricted to by --delete-set, or 0 */
+int deleteset = 0;
 
-  tmp = (char*) malloc(strlen(filename) * 2 + 1);
-  if (tmp == NULL) {
-    errormsg("out of memory!\n");
-    exit(1);
-  }
+/* plan that deletefiles() records its decisions in, for --plan-out */
+struct plan *planout = 0;
 
-  for (x = 0, tx = 0; x < strlen(filename); x++) {
-    if (strchr(escape_list, filename[x]) != NULL) tmp[tx++] = '\\';
-    tmp[tx++] = filename[x];
-  }
+/* whether deletefiles() is carrying out the actions of a plan */
+int applyingplan = 0;
 
-  tmp[tx] = '\0';
+/* number of threads deletefiles() deletes files with in --noprompt mode */
+int deletethreads = 1;
 
-  if (x != tx) {
-    *filename_ptr = realloc(*filename_ptr, strlen(tmp) + 1);
-    if (*filename_ptr == NULL) {
-      errormsg("out of memory!\n");
-      exit(1);
-    }
-    strcpy(*filename_ptr, tmp);
-  }
-}
+/* number of threads hashing chunks of large files with --tree-hash, or 0 */
+int treehashthreads = 0;
+
+/* number of threads comparing ranges of large files to confirm a match */
+int confirmthreads = 1;
+
+/* sizes of the prefixes compared between the partial and full signatures,
+   in increasing order, as given by --prefix-stages */
+#define PREFIX_MAX_STAGES 8
+off_t prefixstages[PREFIX_MAX_STAGES];
+int prefixstagecount = 0;
+
+/* whether to compare sample signatures before full signatures */
+int samplesignatures = 0;
+
+/* contents of files no larger than PARTIAL_MD5_SIZE, kept so that they
+   can be confirmed without reading them again */
+struct arena smallfiles;
+
+#define MD5_DIGEST_LENGTH 16
+
+/* identifiers for long options that have no single-letter equivalent */
+enum {
+  OPTION_CACHE_PATH = 256,
+  OPTION_XATTR_CACHE,
+  OPTION_EXPORT_MANIFEST,
+  OPTION_IMPORT_MANIFEST,
+  OPTION_MERGE_MANIFEST,
+  OPTION_ROOT,
+  OPTION_CATALOG,
+  OPTION_SET,
+  OPTION_DELETE_SET,
+  OPTION_SAVE_SNAPSHOT,
+  OPTION_SINCE,
+  OPTION_FORMAT,
+  OPTION_STREAM,
+  OPTION_SAVE_RESULTS,
+  OPTION_LOAD_RESULTS,
+  OPTION_PLAN_OUT,
+  OPTION_APPLY_PLAN,
+  OPTION_DELETE_THREADS,
+  OPTION_LINK,
+  OPTION_DEDUPE_EXTENTS,
+  OPTION_TREE_HASH,
+  OPTION_CONFIRM_THREADS,
+  OPTION_PREFIX_STAGES,
+  OPTION_SAMPLE,
+  OPTION_RESIDENT_FIRST,
+  OPTION_PIPELINE
+};
+
+typedef struct _filetree {
+  file_t *file; 
+  struct _filetree *left;
+  struct _filetree *right;
+} filetree_t;
 
 dev_t getdevice(char *filename) {
   struct stat s;
@@ -240,6 +293,55 @@ int nonoptafter(char *option, int argc, char **oldargv,
   return x;
 }
 
+/* Return the number of the set with the given name, or 0 if none. */
+int findset(const char *name)
+{
+  int x;
+
+  for (x = 0; x < setcount; ++x)
+    if (strcmp(setnames[x], name) == 0)
+      return x + 1;
+
+  return 0;
+}
+
+/* Find the set each directory in newargv belongs to, which is the one
+   named by the last --set option before it in oldargv. */
+int *assignsets(int argc, char **oldargv, char **newargv, int optind)
+{
+  int *sets;
+  int x;
+  int i;
+  int position;
+  int startat = 1;
+
+  sets = (int*) malloc(sizeof(int) * argc);
+  if (sets == NULL) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  for (x = optind; x < argc; x++) {
+    position = findarg(newargv[x], startat, argc, oldargv);
+
+    /* a directory named like a set is not the set's name */
+    while (position < argc && position > 1 && strcmp(oldargv[position - 1], "--set") == 0)
+      position = findarg(newargv[x], position + 1, argc, oldargv);
+
+    sets[x] = 0;
+    for (i = 1; i < position; i++) {
+      if (strcmp(oldargv[i], "--set") == 0 && i + 1 < position)
+        sets[x] = findset(oldargv[++i]);
+      else if (strncmp(oldargv[i], "--set=", 6) == 0)
+        sets[x] = findset(oldargv[i] + 6);
+    }
+
+    startat = position + 1;
+  }
+
+  return sets;
+}
+
 void getfilestats(file_t *file, struct stat *info, struct stat *linfo)
 {
   file->size = info->st_size;;
@@ -297,11 +399,66 @@ int delist_directory_if_missing(const sqlite3_int64 directoryid, const char *nam
 }
 #endif
 
+/* Read the names of all entries of directory cd but . and .., setting
+   count to their number. */
+char **readentries(DIR *cd, int *count)
+{
+  struct dirent *dirinfo;
+  char **entries = 0;
+  char **grown;
+  int capacity = 0;
+
+  *count = 0;
+
+  while ((dirinfo = readdir(cd)) != NULL) {
+    if (!strcmp(dirinfo->d_name, ".") || !strcmp(dirinfo->d_name, ".."))
+      continue;
+
+    if (*count == capacity) {
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      grown = (char**) realloc(entries, sizeof(char*) * capacity);
+      if (grown == 0) {
+        errormsg("out of memory!\n");
+        exit(1);
+      }
+
+      entries = grown;
+    }
+
+    entries[*count] = strdup(dirinfo->d_name);
+    if (entries[*count] == 0) {
+      errormsg("out of memory!\n");
+      exit(1);
+    }
+
+    ++*count;
+  }
+
+  return entries;
+}
+
+void freeentries(char **entries, int count)
+{
+  int x;
+
+  for (x = 0; x < count; x++)
+    free(entries[x]);
+
+  free(entries);
+}
+
+/* With --pipeline, the entries of each directory are gone through
+   backwards, so that files are passed to traversalqueue in the order
+   the list built otherwise would have them in, last found first. */
 int grokdir(char *dir, file_t **filelistp, struct stat *logfile_status)
 {
   DIR *cd;
   file_t *newfile;
   struct dirent *dirinfo;
+  char *entry;
+  char **entries = 0;
+  int entrycount = 0;
+  int next = 0;
   int lastchar;
   int filecount = 0;
   int filesadded;
@@ -325,27 +482,44 @@ int grokdir(char *dir, file_t **filelistp, struct stat *logfile_status)
   }
 
 #ifndef NO_SQLITE
-  if (db != 0) {
+  /* cache maintenance is left out while matching goes on alongside */
+  if (db != 0 && traversalqueue == 0) {
     fullpath = getrealpath(dir, 0);
 
     if (fullpath && !ISFLAG(flags, F_READONLYCACHE)) {
       if (hashdb_getdirectoryid(db, fullpath, &pathid)) {
+        hashdb_begintransaction(db);
         hashdb_foreachdirectory(db, &pathid, delist_directory_if_missing);
         hashdb_foreachhash(db, &pathid, delist_hash_if_orphaned);
+        hashdb_committransaction(db);
       }
     }
   }
 #endif
 
-  while ((dirinfo = readdir(cd)) != NULL) {
+  if (traversalqueue != 0) {
+    entries = readentries(cd, &entrycount);
+    next = entrycount;
+  }
+
+  while (traversalqueue != 0 ? next > 0 : (dirinfo = readdir(cd)) != NULL) {
+    entry = traversalqueue != 0 ? entries[--next] : dirinfo->d_name;
+
     if (got_sigint) {
       closedir(cd);
+
+      /* the main thread stops once traversal returns */
+      if (traversalqueue != 0) {
+        freeentries(entries, entrycount);
+        return filecount;
+      }
+
       printf("\n");
       exit(0);
     }
 
-    if (strcmp(dirinfo->d_name, ".") && strcmp(dirinfo->d_name, "..")) {
-      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    if (strcmp(entry, ".") && strcmp(entry, "..")) {
+      if (!ISFLAG(flags, F_HIDEPROGRESS) && traversalqueue == 0) {
         now = now64();
         if ( now - last_progress > FDUPES_PROGRESS_REFRESH_MS ) {
           fprintf(stderr, "\rBuilding file list %c ", indicator[progress % 4]);
@@ -366,10 +540,17 @@ int grokdir(char *dir, file_t **filelistp, struct stat *logfile_status)
       newfile->inode = 0;
       newfile->crcsignature = NULL;
       newfile->crcpartial = NULL;
+      newfile->crcstages = NULL;
+      newfile->crcsample = NULL;
+      newfile->content = NULL;
+      newfile->fdslot = -1;
       newfile->duplicates = NULL;
       newfile->hasdupes = 0;
+      newfile->set = scanset;
+      newfile->action = FILEACTION_UNRESOLVED;
+      newfile->sharedwith = NULL;
 
-      newfile->d_name = (char*)malloc(strlen(dir)+strlen(dirinfo->d_name)+2);
+      newfile->d_name = (char*)malloc(strlen(dir)+strlen(entry)+2);
 
       if (!newfile->d_name) {
 	errormsg("out of memory!\n");
@@ -382,7 +563,7 @@ int grokdir(char *dir, file_t **filelistp, struct stat *logfile_status)
       lastchar = strlen(dir) - 1;
       if (lastchar >= 0 && dir[lastchar] != '/')
 	strcat(newfile->d_name, "/");
-      strcat(newfile->d_name, dirinfo->d_name);
+      strcat(newfile->d_name, entry);
       
       if (ISFLAG(flags, F_EXCLUDEHIDDEN)) {
 	fullname = strdup(newfile->d_name);
@@ -436,7 +617,7 @@ int grokdir(char *dir, file_t **filelistp, struct stat *logfile_status)
           filecount += filesadded;
 
 #ifndef NO_SQLITE
-          if (db != 0 && pathid == 0 && !ISFLAG(flags, F_READONLYCACHE) && filesadded > 0)
+          if (db != 0 && traversalqueue == 0 && pathid == 0 && !ISFLAG(flags, F_READONLYCACHE) && filesadded > 0)
               hashdb_savedirectory(db, fullpath);
 #endif
         }
@@ -445,7 +626,10 @@ int grokdir(char *dir, file_t **filelistp, struct stat *logfile_status)
       } else {
 	if (S_ISREG(linfo.st_mode) || (S_ISLNK(linfo.st_mode) && ISFLAG(flags, F_FOLLOWLINKS))) {
 	  getfilestats(newfile, &info, &linfo);
-	  *filelistp = newfile;
+	  if (traversalqueue != 0)
+	    filequeue_push(traversalqueue, newfile);
+	  else
+	    *filelistp = newfile;
 	  filecount++;
 	} else {
 	  free(newfile->d_name);
@@ -458,18 +642,62 @@ int grokdir(char *dir, file_t **filelistp, struct stat *logfile_status)
   if (fullpath)
     free(fullpath);
 
+  if (entries != 0)
+    freeentries(entries, entrycount);
+
   closedir(cd);
 
   return filecount;
 }
 
-md5_byte_t *getcrcsignatureuntil(char *filename, off_t fsize, off_t max_read)
+/* directories listed by traverse() */
+struct traversal
+{
+  char **dirs;
+  int count;
+  struct stat *logfile_status;
+};
+
+/* List the directories in t while their files are being matched, for
+   --pipeline, passing each file found to queue. Directories are listed
+   last to first, for files to come in the order grokdir() would
+   otherwise list them in. */
+void traverse(struct filequeue *queue, void *t)
+{
+  struct traversal *traversal = (struct traversal*) t;
+  file_t *unlisted = 0;
+  int x;
+
+  traversalqueue = queue;
+
+  for (x = traversal->count - 1; x >= 0 && !got_sigint; x--)
+    grokdir(traversal->dirs[x], &unlisted, traversal->logfile_status);
+}
+
+/* Take the next file found by traverse(), listing it after previous if
+   there is one, or return 0 once traversal is complete. */
+file_t *nextqueuedfile(struct filequeue *queue, file_t *previous)
+{
+  file_t *file;
+
+  file = filequeue_pop(queue);
+  if (file != 0 && previous != 0)
+    previous->next = file;
+
+  return file;
+}
+
+md5_byte_t *getcrcsignatureuntil(file_t *file, off_t max_read)
 {
+  off_t fsize;
   off_t toread;
+  off_t offset;
+  off_t data = 0;
+  off_t hole = 0;
   md5_state_t state;
   md5_byte_t *digest;
   static md5_byte_t chunk[CHUNK_SIZE];
-  FILE *file;
+  int fd;
 
   digest = (md5_byte_t*) malloc(MD5_DIGEST_LENGTH * sizeof(md5_byte_t));
   if (digest == NULL) {
@@ -479,62 +707,147 @@ md5_byte_t *getcrcsignatureuntil(char *filename, off_t fsize, off_t max_read)
 
   md5_init(&state);
 
+  fsize = file->size;
   if (max_read != 0 && fsize > max_read)
     fsize = max_read;
 
-  file = fopen(filename, "rb");
-  if (file == NULL) {
-    errormsg("error opening file %s\n", filename);
+  fd = fdcache_open(file);
+  if (fd == -1) {
+    errormsg("error opening file %s\n", file->d_name);
+    free(digest);
     return NULL;
   }
 
-  while (fsize > 0) {
+  /* holes are hashed as the zeros they read as, without reading them */
+  for (offset = 0; offset < fsize; offset += toread) {
     if (got_sigint) {
-      fclose(file);
       printf("\n");
       exit(0);
     }
 
-    toread = (fsize >= CHUNK_SIZE) ? CHUNK_SIZE : fsize;
-    if (fread(chunk, toread, 1, file) != 1) {
-      errormsg("error reading from file %s\n", filename);
-      fclose(file);
+    if (offset >= hole)
+      sparse_region(fd, offset, fsize, &data, &hole);
+
+    if (offset < data) {
+      toread = (data - offset >= CHUNK_SIZE) ? CHUNK_SIZE : data - offset;
+      sparse_appendzeros(&state, toread);
+      continue;
+    }
+
+    toread = (hole - offset >= CHUNK_SIZE) ? CHUNK_SIZE : hole - offset;
+    if (pread(fd, chunk, toread, offset) != toread) {
+      errormsg("error reading from file %s\n", file->d_name);
+      fdcache_release(file, fd);
+      free(digest);
       return NULL;
     }
     md5_append(&state, chunk, toread);
-    fsize -= toread;
   }
 
   md5_finish(&state, digest);
 
-  fclose(file);
+  fdcache_release(file, fd);
 
   return digest;
 }
 
-md5_byte_t *getheuristicsignature(char *filename, off_t fsize);
+md5_byte_t *getheuristicsignature(file_t *file);
+
+md5_byte_t *getcrcsignature(file_t *file)
+{
+  if (ISFLAG(flags, F_HEURISTIC) && file->size > HEURISTIC_LIMIT)
+    return getheuristicsignature(file);
+  return getcrcsignatureuntil(file, 0);
+}
+
+int isheuristic(const file_t *file)
+{
+  return ISFLAG(flags, F_HEURISTIC) && file->size > HEURISTIC_LIMIT;
+}
+
+/* Files of a single chunk get the same signature either way. */
+int istreehash(const file_t *file)
+{
+  return treehashthreads > 0 && file->size > TREE_HASH_CHUNK_SIZE;
+}
+
+#ifndef NO_SQLITE
+/* hash function the full signature of file is calculated with */
+int hashfunction(const file_t *file)
+{
+  return istreehash(file) ? HASH_FUNCTION_MD5_TREE : HASH_FUNCTION_MD5;
+}
+#endif
+
+/* kind of extended attribute the full signature of file is kept in */
+int signaturekind(const file_t *file)
+{
+  return isheuristic(file) ? XATTR_HASH_HEURISTIC :
+         istreehash(file)  ? XATTR_HASH_TREE :
+                             XATTR_HASH_FULL;
+}
+
+md5_byte_t *getfullsignature(file_t *file)
+{
+  md5_byte_t *signature;
+  int fd;
+
+  if (istreehash(file))
+  {
+    fd = fdcache_open(file);
+    if (fd == -1) {
+      errormsg("error opening file %s\n", file->d_name);
+      return NULL;
+    }
+
+    signature = treehash_signature(fd, file->d_name, file->size, treehashthreads);
 
-md5_byte_t *getcrcsignature(char *filename, off_t fsize)
+    fdcache_release(file, fd);
+
+    return signature;
+  }
+
+#ifndef NO_SQLITE
+  if (ISFLAG(flags, F_BLOCKHASHES) && !ISFLAG(flags, F_HEURISTIC) && file->size >= BLOCK_HASH_SIZE)
+    return getblocksignature(db, file);
+#endif
+  return getcrcsignature(file);
+}
+
+md5_byte_t *getcrcpartialsignature(file_t *file)
 {
-  if (ISFLAG(flags, F_HEURISTIC) && fsize > HEURISTIC_LIMIT)
-    return getheuristicsignature(filename, fsize);
-  return getcrcsignatureuntil(filename, fsize, 0);
+  return getcrcsignatureuntil(file, PARTIAL_MD5_SIZE);
 }
 
-md5_byte_t *getcrcpartialsignature(char *filename, off_t fsize)
+/* Add length bytes of a file, starting at offset, to a digest. */
+int appendheuristicblock(int fd, off_t offset, off_t length, md5_state_t *state)
 {
-  return getcrcsignatureuntil(filename, fsize, PARTIAL_MD5_SIZE);
+  static md5_byte_t chunk[CHUNK_SIZE];
+  size_t toread;
+
+  while (length > 0) {
+    if (got_sigint) {
+      printf("\n");
+      exit(0);
+    }
+    toread = length >= CHUNK_SIZE ? CHUNK_SIZE : length;
+    if (pread(fd, chunk, toread, offset) != (ssize_t) toread)
+      return 0;
+    md5_append(state, chunk, toread);
+    offset += toread;
+    length -= toread;
+  }
+
+  return 1;
 }
 
-md5_byte_t *getheuristicsignature(char *filename, off_t fsize)
+md5_byte_t *getheuristicsignature(file_t *file)
 {
   off_t offset;
-  off_t remaining;
+  off_t fsize;
   md5_state_t state;
   md5_byte_t *digest;
-  static md5_byte_t chunk[CHUNK_SIZE];
-  FILE *file;
-  size_t toread;
+  int fd;
 
   digest = (md5_byte_t*)malloc(MD5_DIGEST_LENGTH * sizeof(md5_byte_t));
   if (digest == NULL) {
@@ -544,94 +857,120 @@ md5_byte_t *getheuristicsignature(char *filename, off_t fsize)
 
   md5_init(&state);
 
-  file = fopen(filename, "rb");
-  if (file == NULL) {
-    errormsg("error opening file %s\n", filename);
+  fd = fdcache_open(file);
+  if (fd == -1) {
+    errormsg("error opening file %s\n", file->d_name);
+    free(digest);
     return NULL;
   }
 
+  fsize = file->size;
+
   /* first block */
-  remaining = HEURISTIC_BLOCK;
-  if (remaining > fsize)
-    remaining = fsize;
-  offset = 0;
-  if (fseeko(file, offset, SEEK_SET) != 0) {
-    errormsg("error seeking in file %s\n", filename);
-    fclose(file);
+  if (!appendheuristicblock(fd, 0, fsize < HEURISTIC_BLOCK ? fsize : HEURISTIC_BLOCK, &state)) {
+    errormsg("error reading from file %s\n", file->d_name);
+    fdcache_release(file, fd);
+    free(digest);
     return NULL;
   }
-  while (remaining > 0) {
-    if (got_sigint) {
-      fclose(file);
-      printf("\n");
-      exit(0);
-    }
-    toread = remaining >= CHUNK_SIZE ? CHUNK_SIZE : remaining;
-    if (fread(chunk, toread, 1, file) != 1) {
-      errormsg("error reading from file %s\n", filename);
-      fclose(file);
-      return NULL;
-    }
-    md5_append(&state, chunk, toread);
-    remaining -= toread;
-  }
 
   /* blocks every HEURISTIC_INTERVAL */
   for (offset = HEURISTIC_INTERVAL; offset + HEURISTIC_BLOCK < fsize; offset += HEURISTIC_INTERVAL) {
-    remaining = HEURISTIC_BLOCK;
-    if (fseeko(file, offset, SEEK_SET) != 0) {
-      errormsg("error seeking in file %s\n", filename);
-      fclose(file);
+    if (!appendheuristicblock(fd, offset, HEURISTIC_BLOCK, &state)) {
+      errormsg("error reading from file %s\n", file->d_name);
+      fdcache_release(file, fd);
+      free(digest);
       return NULL;
     }
-    while (remaining > 0) {
-      if (got_sigint) {
-        fclose(file);
-        printf("\n");
-        exit(0);
-      }
-      toread = remaining >= CHUNK_SIZE ? CHUNK_SIZE : remaining;
-      if (fread(chunk, toread, 1, file) != 1) {
-        errormsg("error reading from file %s\n", filename);
-        fclose(file);
-        return NULL;
-      }
-      md5_append(&state, chunk, toread);
-      remaining -= toread;
-    }
   }
 
   /* last block */
   if (fsize > HEURISTIC_BLOCK) {
-    offset = fsize - HEURISTIC_BLOCK;
-    remaining = HEURISTIC_BLOCK;
-    if (fseeko(file, offset, SEEK_SET) != 0) {
-      errormsg("error seeking in file %s\n", filename);
-      fclose(file);
+    if (!appendheuristicblock(fd, fsize - HEURISTIC_BLOCK, HEURISTIC_BLOCK, &state)) {
+      errormsg("error reading from file %s\n", file->d_name);
+      fdcache_release(file, fd);
+      free(digest);
       return NULL;
     }
-    while (remaining > 0) {
-      if (got_sigint) {
-        fclose(file);
-        printf("\n");
-        exit(0);
-      }
-      toread = remaining >= CHUNK_SIZE ? CHUNK_SIZE : remaining;
-      if (fread(chunk, toread, 1, file) != 1) {
-        errormsg("error reading from file %s\n", filename);
-        fclose(file);
-        return NULL;
-      }
-      md5_append(&state, chunk, toread);
-      remaining -= toread;
-    }
   }
 
   md5_finish(&state, digest);
-  fclose(file);
+  fdcache_release(file, fd);
   return digest;
 }
 
+/* Load a file's signatures from the enabled caches, extended attributes
+   first as they are cheapest to read. Files subject to heuristic hashing
+   use their cached heuristic signature in place of a full hash. */
+void loadcachedsignatures(file_t *file)
+{
+  if (ISFLAG(flags, F_XATTRCACHE))
+  {
+    xattr_loadhash(file, XATTR_HASH_PARTIAL, &file->crcpartial);
+    xattr_loadhash(file, signaturekind(file), &file->crcsignature);
+
+    if (file->crcpartial != NULL && file->crcsignature != NULL)
+      return;
+  }
+
+#ifndef NO_SQLITE
+  if (ISFLAG(flags, F_CACHESIGNATURES))
+  {
+    md5_byte_t *partial = NULL;
+    md5_byte_t *signature = NULL;
+
+    hashdb_loadhash(db, file, hashfunction(file), &partial, &signature);
+
+    if (isheuristic(file))
+    {
+      free(signature);
+      hashdb_loadheuristichash(db, file, HEURISTIC_BLOCK, HEURISTIC_INTERVAL, &signature);
+    }
+
+    if (file->crcpartial == NULL)
+      file->crcpartial = partial;
+    else
+      free(partial);
+
+    if (file->crcsignature == NULL)
+      file->crcsignature = signature;
+    else
+      free(signature);
+  }
+#endif
+}
+
+/* Extended attributes are written first, since doing so changes the
+   file's ctime and the database must record the updated value. */
+void savecachedpartial(file_t *file)
+{
+  if (ISFLAG(flags, F_XATTRCACHE))
+    xattr_savehash(file, XATTR_HASH_PARTIAL, file->crcpartial);
+
+#ifndef NO_SQLITE
+  if (ISFLAG(flags, F_CACHESIGNATURES))
+    hashdb_savehash(db, file, hashfunction(file), file->crcpartial, isheuristic(file) ? 0 : file->crcsignature);
+#endif
+}
+
+/* Heuristic signatures are stored apart from full hashes, so that runs
+   without --heuristic never take one for the other. */
+void savecachedsignature(file_t *file)
+{
+  if (ISFLAG(flags, F_XATTRCACHE))
+    xattr_savehash(file, signaturekind(file), file->crcsignature);
+
+#ifndef NO_SQLITE
+  if (ISFLAG(flags, F_CACHESIGNATURES))
+  {
+    if (isheuristic(file))
+      hashdb_saveheuristichash(db, file, HEURISTIC_BLOCK, HEURISTIC_INTERVAL, file->crcsignature);
+    else
+      hashdb_savehash(db, file, hashfunction(file), file->crcpartial, file->crcsignature);
+  }
+#endif
+}
+
 int md5cmp(const md5_byte_t *a, const md5_byte_t *b)
 {
   int x;
@@ -810,102 +1149,394 @@ int has_same_file(filetree_t *checktree, file_t *file)
   return 0;
 }
 
-file_t **checkmatch(filetree_t **root, filetree_t *checktree, file_t *file)
+/* Whether two files are known to share all of their extents, and so to
+   be identical, without reading either of them.
+*/
+int sharesextents(file_t *file1, file_t *file2)
 {
-  int cmpresult;
-  char *fullpath;
+  return file1->sharedwith != NULL && file1->sharedwith == file2->sharedwith;
+}
 
-  if (ISFLAG(flags, F_CONSIDERHARDLINKS))
-  {
-    /* If node already contains file, we don't want to add it again.
-    */
-    if (has_same_file(checktree, file))
-      return NULL;
-  }
-  else
-  {
-    /* If device and inode fields are equal one of the files is a
-       hard link to the other or the files have been listed twice
-       unintentionally. We don't want to flag these files as
-       duplicates unless the user specifies otherwise.
-    */
-    if (is_hardlink(checktree, file))
-      return NULL;
-  }
+/* Whether file shares all of its extents with a member of the set of
+   matches headed by head.
+*/
+int sharesextentswithset(file_t *file, file_t *head)
+{
+  if (file->sharedwith == NULL)
+    return 0;
 
-  if (file->size < checktree->file->size)
-    cmpresult = -1;
-  else
-    if (file->size > checktree->file->size) cmpresult = 1;
-  else
-    if (ISFLAG(flags, F_PERMISSIONS) &&
-        !same_permissions(file->d_name, checktree->file->d_name))
-        cmpresult = -1;
-  else {
-    if (checktree->file->crcpartial == NULL) {
-#ifndef NO_SQLITE
-      if (ISFLAG(flags, F_CACHESIGNATURES))
-        hashdb_loadhash(db, checktree->file, &checktree->file->crcpartial, &checktree->file->crcsignature);
-#endif
+  for (; head != NULL; head = head->duplicates)
+    if (sharesextents(file, head))
+      return 1;
 
-      if (checktree->file->crcpartial == NULL)
-      {
-        checktree->file->crcpartial = getcrcpartialsignature(checktree->file->d_name, checktree->file->size);
-        if (checktree->file->crcpartial == NULL) {
-          errormsg ("cannot read file %s\n", checktree->file->d_name);
-          return NULL;
-        }
+  return 0;
+}
 
-#ifndef NO_SQLITE
-        if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
-          hashdb_savehash(db, checktree->file, checktree->file->crcpartial, checktree->file->crcsignature);
-#endif
-      }
-    }
+md5_byte_t *copysignature(const md5_byte_t *signature)
+{
+  md5_byte_t *copy;
 
-    if (file->crcpartial == NULL) {
-#ifndef NO_SQLITE
-      if (ISFLAG(flags, F_CACHESIGNATURES))
-        hashdb_loadhash(db, file, &file->crcpartial, &file->crcsignature);
-#endif
+  copy = (md5_byte_t*) malloc(MD5_DIGEST_LENGTH * sizeof(md5_byte_t));
+  if (copy == NULL) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
 
-      if (file->crcpartial == NULL)
-      {
-        file->crcpartial = getcrcpartialsignature(file->d_name, file->size);
-        if (file->crcpartial == NULL) {
-          errormsg ("cannot read file %s\n", file->d_name);
-          return NULL;
-        }
+  memcpy(copy, signature, MD5_DIGEST_LENGTH * sizeof(md5_byte_t));
+
+  return copy;
+}
+
+/* Signature of zero-length files, which need not be opened to know it. */
+md5_byte_t *getemptysignature()
+{
+  static md5_byte_t empty[MD5_DIGEST_LENGTH];
+  static int known = 0;
+  md5_state_t state;
+
+  if (!known)
+  {
+    md5_init(&state);
+    md5_finish(&state, empty);
+    known = 1;
+  }
+
+  return copysignature(empty);
+}
+
+/* Read a small file into the memory set aside for its contents, where
+   they are kept for confirmfiles(), and return the signature of its
+   contents, which is both its partial and its full signature.
+*/
+md5_byte_t *getsmallsignature(file_t *file)
+{
+  md5_state_t state;
+  md5_byte_t *digest;
+  int fd;
+
+  fd = fdcache_open(file);
+  if (fd == -1) {
+    errormsg("error opening file %s\n", file->d_name);
+    return NULL;
+  }
+
+  if (pread(fd, file->content, file->size, 0) != file->size) {
+    errormsg("error reading from file %s\n", file->d_name);
+    fdcache_release(file, fd);
+    return NULL;
+  }
+
+  fdcache_release(file, fd);
+
+  digest = (md5_byte_t*) malloc(MD5_DIGEST_LENGTH * sizeof(md5_byte_t));
+  if (digest == NULL) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  md5_init(&state);
+  md5_append(&state, file->content, file->size);
+  md5_finish(&state, digest);
+
+  return digest;
+}
+
+/* Give file its partial signature, taking it from the first file it
+   shares its extents with, if any, rather than reading it again.
+   Returns 0 if the file cannot be read.
+*/
+int needpartialsignature(file_t *file)
+{
+  file_t *shared;
+
+  if (file->crcpartial != NULL)
+    return 1;
+
+  if (file->size == 0)
+  {
+    file->crcpartial = getemptysignature();
+    return 1;
+  }
+
+  shared = file->sharedwith != file ? file->sharedwith : NULL;
+
+  if (shared != NULL && shared->crcpartial != NULL)
+  {
+    file->crcpartial = copysignature(shared->crcpartial);
+    return 1;
+  }
+
+  if (ISFLAG(flags, F_CACHESIGNATURES) || ISFLAG(flags, F_XATTRCACHE))
+    loadcachedsignatures(file);
+
+  if (file->crcpartial != NULL)
+    return 1;
+
+  if (shared != NULL && needpartialsignature(shared))
+    file->crcpartial = copysignature(shared->crcpartial);
+  else
+  {
+    /* small files are kept in memory while there is room for them */
+    if (file->size <= PARTIAL_MD5_SIZE)
+      file->content = (unsigned char*) arena_alloc(&smallfiles, file->size);
+
+    file->crcpartial = file->content != NULL ? getsmallsignature(file) : getcrcpartialsignature(file);
+    if (file->crcpartial == NULL) {
+      file->content = NULL;
+      errormsg ("cannot read file %s\n", file->d_name);
+      return 0;
+    }
+  }
+
+  if ((ISFLAG(flags, F_CACHESIGNATURES) || ISFLAG(flags, F_XATTRCACHE)) && !ISFLAG(flags, F_READONLYCACHE))
+    savecachedpartial(file);
+
+  return 1;
+}
+
+/* Give file its full signature, as needpartialsignature() does. */
+int needfullsignature(file_t *file)
+{
+  file_t *shared;
+
+  if (file->crcsignature != NULL)
+    return 1;
+
+  if (file->size == 0)
+  {
+    file->crcsignature = getemptysignature();
+    return 1;
+  }
+
+  shared = file->sharedwith != file ? file->sharedwith : NULL;
+
+  /* the partial signature of a small file covers all of it */
+  if (file->size <= PARTIAL_MD5_SIZE && file->crcpartial != NULL)
+    file->crcsignature = copysignature(file->crcpartial);
+  else if (shared != NULL && needfullsignature(shared))
+    file->crcsignature = copysignature(shared->crcsignature);
+  else
+  {
+    file->crcsignature = getfullsignature(file);
+    if (file->crcsignature == NULL)
+      return 0;
+  }
+
+  if ((ISFLAG(flags, F_CACHESIGNATURES) || ISFLAG(flags, F_XATTRCACHE)) && !ISFLAG(flags, F_READONLYCACHE))
+    savecachedsignature(file);
+
+  return 1;
+}
+
+/* Give every set of matches in files a full signature. Sets matched
+   by their shared extents are never hashed, yet snapshots identify
+   sets by signature, so hash the first member of each such set. */
+void signsets(file_t *files)
+{
+  file_t *tmpfile;
+
+  for (; files != NULL; files = files->next)
+  {
+    if (!files->hasdupes)
+      continue;
+
+    for (tmpfile = files; tmpfile != NULL; tmpfile = tmpfile->duplicates)
+      if (tmpfile->crcsignature != NULL)
+        break;
+
+    if (tmpfile == NULL)
+      needfullsignature(files);
+  }
+}
+
+/* Give file the signature of the first prefixstages[stage] bytes of its
+   contents, as needpartialsignature() does. Prefix signatures are cached
+   in the database only.
+*/
+int needprefixsignature(file_t *file, int stage)
+{
+  file_t *shared;
+
+  if (file->crcstages == NULL)
+  {
+    file->crcstages = (md5_byte_t**) calloc(prefixstagecount, sizeof(md5_byte_t*));
+    if (file->crcstages == NULL) {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+  }
+
+  if (file->crcstages[stage] != NULL)
+    return 1;
+
+  shared = file->sharedwith != file ? file->sharedwith : NULL;
+
+  if (shared != NULL && shared->crcstages != NULL && shared->crcstages[stage] != NULL)
+  {
+    file->crcstages[stage] = copysignature(shared->crcstages[stage]);
+    return 1;
+  }
 
 #ifndef NO_SQLITE
-        if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
-          hashdb_savehash(db, file, file->crcpartial, file->crcsignature);
+  if (ISFLAG(flags, F_CACHESIGNATURES))
+    hashdb_loadprefixhash(db, file, prefixstages[stage], &file->crcstages[stage]);
+
+  if (file->crcstages[stage] != NULL)
+    return 1;
 #endif
-      }
+
+  if (shared != NULL && needprefixsignature(shared, stage))
+    file->crcstages[stage] = copysignature(shared->crcstages[stage]);
+  else
+  {
+    file->crcstages[stage] = getcrcsignatureuntil(file, prefixstages[stage]);
+    if (file->crcstages[stage] == NULL) {
+      errormsg ("cannot read file %s\n", file->d_name);
+      return 0;
     }
+  }
 
-    cmpresult = md5cmp(file->crcpartial, checktree->file->crcpartial);
+#ifndef NO_SQLITE
+  if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
+    hashdb_saveprefixhash(db, file, prefixstages[stage], file->crcstages[stage]);
+#endif
+
+  return 1;
+}
+
+/* Whether files of the same size as file are compared by their sample
+   signatures before their full signatures. */
+int issampled(const file_t *file)
+{
+  return samplesignatures && file->size >= SAMPLE_MIN_SIZE;
+}
+
+/* Give file its sample signature, as needprefixsignature() does. */
+int needsamplesignature(file_t *file)
+{
+  file_t *shared;
+  int fd;
+
+  if (file->crcsample != NULL)
+    return 1;
+
+  shared = file->sharedwith != file ? file->sharedwith : NULL;
+
+  if (shared != NULL && shared->crcsample != NULL)
+  {
+    file->crcsample = copysignature(shared->crcsample);
+    return 1;
+  }
 
-    if (cmpresult == 0) {
-      if (checktree->file->crcsignature == NULL) {
-        checktree->file->crcsignature = getcrcsignature(checktree->file->d_name, checktree->file->size);
-        if (checktree->file->crcsignature == NULL)
-          return NULL;
 #ifndef NO_SQLITE
-        if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
-          hashdb_savehash(db, checktree->file, checktree->file->crcpartial, checktree->file->crcsignature);
+  if (ISFLAG(flags, F_CACHESIGNATURES))
+    hashdb_loadsamplehash(db, file, SAMPLE_BLOCK_SIZE, SAMPLE_BLOCK_COUNT, &file->crcsample);
+
+  if (file->crcsample != NULL)
+    return 1;
 #endif
-      }
 
-      if (file->crcsignature == NULL) {
-        file->crcsignature = getcrcsignature(file->d_name, file->size);
-        if (file->crcsignature == NULL)
-          return NULL;
+  if (shared != NULL && needsamplesignature(shared))
+    file->crcsample = copysignature(shared->crcsample);
+  else
+  {
+    fd = fdcache_open(file);
+    if (fd == -1) {
+      errormsg("error opening file %s\n", file->d_name);
+      return 0;
+    }
+
+    file->crcsample = sample_signature(fd, file->d_name, file->size);
+
+    fdcache_release(file, fd);
+
+    if (file->crcsample == NULL) {
+      errormsg ("cannot read file %s\n", file->d_name);
+      return 0;
+    }
+  }
+
 #ifndef NO_SQLITE
-        if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
-          hashdb_savehash(db, file, file->crcpartial, file->crcsignature);
+  if (ISFLAG(flags, F_CACHESIGNATURES) && !ISFLAG(flags, F_READONLYCACHE))
+    hashdb_savesamplehash(db, file, SAMPLE_BLOCK_SIZE, SAMPLE_BLOCK_COUNT, file->crcsample);
 #endif
-      }
+
+  return 1;
+}
+
+void freeprefixsignatures(file_t *file)
+{
+  int stage;
+
+  if (file->crcstages == NULL)
+    return;
+
+  for (stage = 0; stage < prefixstagecount; ++stage)
+    free(file->crcstages[stage]);
+
+  free(file->crcstages);
+}
+
+file_t **checkmatch(filetree_t **root, filetree_t *checktree, file_t *file)
+{
+  int cmpresult;
+  int stage;
+  char *fullpath;
+
+  if (ISFLAG(flags, F_CONSIDERHARDLINKS))
+  {
+    /* If node already contains file, we don't want to add it again.
+    */
+    if (has_same_file(checktree, file))
+      return NULL;
+  }
+  else
+  {
+    /* If device and inode fields are equal one of the files is a
+       hard link to the other or the files have been listed twice
+       unintentionally. We don't want to flag these files as
+       duplicates unless the user specifies otherwise.
+    */
+    if (is_hardlink(checktree, file))
+      return NULL;
+  }
+
+  if (file->size < checktree->file->size)
+    cmpresult = -1;
+  else
+    if (file->size > checktree->file->size) cmpresult = 1;
+  else
+    if (ISFLAG(flags, F_PERMISSIONS) &&
+        !same_permissions(file->d_name, checktree->file->d_name))
+        cmpresult = -1;
+  else
+    if (sharesextents(file, checktree->file))
+        cmpresult = 0;
+  else {
+    if (!needpartialsignature(checktree->file) || !needpartialsignature(file))
+      return NULL;
+
+    cmpresult = md5cmp(file->crcpartial, checktree->file->crcpartial);
+
+    /* read ever longer prefixes of files still alike, short of their size */
+    for (stage = 0; cmpresult == 0 && stage < prefixstagecount && prefixstages[stage] < file->size; ++stage) {
+      if (!needprefixsignature(checktree->file, stage) || !needprefixsignature(file, stage))
+        return NULL;
+
+      cmpresult = md5cmp(file->crcstages[stage], checktree->file->crcstages[stage]);
+    }
+
+    /* rule out files alike at the start but not further in */
+    if (cmpresult == 0 && issampled(file)) {
+      if (!needsamplesignature(checktree->file) || !needsamplesignature(file))
+        return NULL;
+
+      cmpresult = md5cmp(file->crcsample, checktree->file->crcsample);
+    }
+
+    if (cmpresult == 0) {
+      if (!needfullsignature(checktree->file) || !needfullsignature(file))
+        return NULL;
 
       cmpresult = md5cmp(file->crcsignature, checktree->file->crcsignature);
     }
@@ -931,129 +1562,1009 @@ file_t **checkmatch(filetree_t **root, filetree_t *checktree, file_t *file)
   }
 }
 
-void summarizematches(file_t *files)
+void summarizematches(file_t *files)
+{
+  int numsets = 0;
+  double numbytes = 0.0;
+  int numfiles = 0;
+  file_t *tmpfile;
+
+  while (files != NULL)
+  {
+    if (files->hasdupes)
+    {
+      numsets++;
+
+      tmpfile = files->duplicates;
+      while (tmpfile != NULL)
+      {
+	numfiles++;
+	numbytes += files->size;
+	tmpfile = tmpfile->duplicates;
+      }
+    }
+
+    files = files->next;
+  }
+
+  if (numsets == 0)
+    printf("No duplicates found.\n\n");
+  else
+  {
+    if (numbytes < 1024.0)
+      printf("%s%d duplicate files (in %d sets), occupying %.0f bytes.\n\n", ISFLAG(flags, F_QUICKSUMMARY) ? "approximately " : "", numfiles, numsets, numbytes);
+    else if (numbytes <= (1000.0 * 1000.0))
+      printf("%s%d duplicate files (in %d sets), occupying %.1f kilobytes\n\n", ISFLAG(flags, F_QUICKSUMMARY) ? "approximately " : "", numfiles, numsets, numbytes / 1000.0);
+    else
+      printf("%s%d duplicate files (in %d sets), occupying %.1f megabytes\n\n", ISFLAG(flags, F_QUICKSUMMARY) ? "approximately " : "", numfiles, numsets, numbytes / (1000.0 * 1000.0));
+  }
+}
+
+void printmatches(file_t *files)
+{
+  while (files != NULL) {
+    if (files->hasdupes)
+      output_group(files);
+
+    files = files->next;
+  }
+}
+
+/* Share the extents of the first file of each set of matches with those
+   of the other files in the set, reporting how many bytes each shares. */
+void dedupefiles(file_t *files)
+{
+  file_t **members;
+  struct dedupe_result *results;
+  file_t *curfile;
+  file_t *member;
+  off_t totalshared = 0;
+  int totalfiles = 0;
+  int count;
+  int max = 0;
+  int x;
+
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+  {
+    if (curfile->hasdupes)
+    {
+      count = 0;
+      for (member = curfile->duplicates; member != NULL; member = member->duplicates)
+        ++count;
+
+      if (count > max)
+        max = count;
+    }
+  }
+
+  members = malloc(sizeof(file_t *) * (max + 1));
+  results = malloc(sizeof(struct dedupe_result) * (max + 1));
+  if (members == 0 || results == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+  {
+    if (!curfile->hasdupes)
+      continue;
+
+    count = 0;
+    for (member = curfile->duplicates; member != NULL; member = member->duplicates)
+      members[count++] = member;
+
+    dedupe_group(curfile, members, count, results);
+
+    printf("   [+] %s\n", curfile->d_name);
+
+    for (x = 0; x < count; ++x)
+    {
+      totalshared += results[x].shared;
+      if (results[x].shared > 0)
+        ++totalfiles;
+
+      switch (results[x].status)
+      {
+      case DEDUPE_SHARED:
+        printf("   [=] %s (%lld bytes shared)\n", members[x]->d_name, (long long int)results[x].shared);
+        break;
+      case DEDUPE_SAMEFILE:
+        printf("   [=] %s (same file)\n", members[x]->d_name);
+        break;
+      case DEDUPE_ALREADYSHARED:
+        printf("   [=] %s (already deduplicated)\n", members[x]->d_name);
+        break;
+      case DEDUPE_DIFFERS:
+        printf("   [!] %s -- contents differ after %lld bytes shared!\n", members[x]->d_name, (long long int)results[x].shared);
+        break;
+      case DEDUPE_INCOMPLETE:
+        printf("   [!] %s -- only %lld bytes shared!\n", members[x]->d_name, (long long int)results[x].shared);
+        break;
+      default:
+        printf("   [!] %s -- unable to share extents: %s!\n", members[x]->d_name, strerror(results[x].error));
+        break;
+      }
+    }
+
+    printf("\n");
+
+    if (got_sigint)
+      break;
+  }
+
+  printf("%lld bytes shared by %d files.\n", (long long int)totalshared, totalfiles);
+
+  free(results);
+  free(members);
+}
+
+/*
+#define REVISE_APPEND "_tmp"
+char *revisefilename(char *path, int seq)
+{
+  int digits;
+  char *newpath;
+  char *scratch;
+  char *dot;
+
+  digits = numdigits(seq);
+  newpath = malloc(strlen(path) + strlen(REVISE_APPEND) + digits + 1);
+  if (!newpath) return newpath;
+
+  scratch = malloc(strlen(path) + 1);
+  if (!scratch) return newpath;
+
+  strcpy(scratch, path);
+  dot = strrchr(scratch, '.');
+  if (dot) 
+  {
+    *dot = 0;
+    sprintf(newpath, "%s%s%d.%s", scratch, REVISE_APPEND, seq, dot + 1);
+  }
+
+  else
+  {
+    sprintf(newpath, "%s%s%d", path, REVISE_APPEND, seq);
+  }
+
+  free(scratch);
+
+  return newpath;
+} */
+
+/* Attach file to the reference standing for the cataloged file it
+   matches, if any. As with checkmatch(), only files whose size appears
+   in the catalog are read, and then only as far as necessary. */
+void matchcatalog(file_t *file)
+{
+  file_t *reference;
+  file_t *last;
+  int candidates;
+
+  candidates = catalog_candidates(file->size);
+  if (candidates == CATALOG_NONE)
+    return;
+
+  if (ISFLAG(flags, F_CACHESIGNATURES) || ISFLAG(flags, F_XATTRCACHE))
+    loadcachedsignatures(file);
+
+  if (candidates == CATALOG_PARTIAL)
+  {
+    if (file->crcpartial == NULL)
+    {
+      file->crcpartial = getcrcpartialsignature(file);
+      if (file->crcpartial == NULL) {
+        errormsg ("cannot read file %s\n", file->d_name);
+        return;
+      }
+
+      if ((ISFLAG(flags, F_CACHESIGNATURES) || ISFLAG(flags, F_XATTRCACHE)) && !ISFLAG(flags, F_READONLYCACHE))
+        savecachedpartial(file);
+    }
+
+    if (!catalog_matchespartial(file->size, file->crcpartial))
+      return;
+  }
+
+  if (file->crcsignature == NULL)
+  {
+    file->crcsignature = getfullsignature(file);
+    if (file->crcsignature == NULL)
+      return;
+
+    if ((ISFLAG(flags, F_CACHESIGNATURES) || ISFLAG(flags, F_XATTRCACHE)) && !ISFLAG(flags, F_READONLYCACHE))
+      savecachedsignature(file);
+  }
+
+  reference = catalog_find(file->size, file->crcsignature);
+  if (reference == NULL)
+    return;
+
+  if (reference->duplicates == NULL)
+  {
+    reference->duplicates = file;
+  }
+  else
+  {
+    for (last = reference->duplicates; last->duplicates != NULL; last = last->duplicates)
+      ;
+
+    last->duplicates = file;
+  }
+
+  reference->hasdupes = 1;
+}
+
+/* a file under consideration by crosssetcandidates() */
+struct candidate
+{
+  file_t *file;
+  size_t position;
+};
+
+int sort_candidates_by_size(const void *a, const void *b)
+{
+  const struct candidate *candidate1 = a;
+  const struct candidate *candidate2 = b;
+
+  if (candidate1->file->size != candidate2->file->size)
+    return candidate1->file->size < candidate2->file->size ? -1 : 1;
+
+  return 0;
+}
+
+int sort_candidates_by_partial(const void *a, const void *b)
+{
+  const struct candidate *candidate1 = a;
+  const struct candidate *candidate2 = b;
+
+  return md5cmp(candidate1->file->crcpartial, candidate2->file->crcpartial);
+}
+
+/* nonzero if the given candidates do not all belong to the same set */
+int candidatesspansets(const struct candidate *candidates, size_t count)
+{
+  size_t x;
+
+  for (x = 1; x < count; ++x)
+    if (candidates[x].file->set != candidates[0].file->set)
+      return 1;
+
+  return 0;
+}
+
+/* Drop from the file list every file that cannot have a duplicate in
+   another set: first those whose size is found in one set only, then
+   those whose partial signature is. The remaining files keep their
+   original order. */
+file_t *crosssetcandidates(file_t *files, int *filecount)
+{
+  struct candidate *candidates;
+  file_t *curfile;
+  file_t *nextfile;
+  file_t *kept;
+  file_t *lastkept;
+  char *keep;
+  size_t count;
+  size_t first;
+  size_t last;
+  size_t readable;
+  size_t x;
+  size_t y;
+
+  count = 0;
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+    ++count;
+
+  if (count == 0)
+    return files;
+
+  candidates = (struct candidate*) malloc(sizeof(struct candidate) * count);
+  keep = (char*) calloc(count, 1);
+  if (candidates == NULL || keep == NULL) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  x = 0;
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+  {
+    candidates[x].file = curfile;
+    candidates[x].position = x;
+    ++x;
+  }
+
+  qsort(candidates, count, sizeof(struct candidate), sort_candidates_by_size);
+
+  for (first = 0; first < count; first = last)
+  {
+    for (last = first + 1; last < count && candidates[last].file->size == candidates[first].file->size; ++last)
+      ;
+
+    if (!candidatesspansets(candidates + first, last - first))
+      continue;
+
+    /* move files whose partial signature is readable to the front */
+    readable = first;
+    for (x = first; x < last; ++x)
+    {
+      curfile = candidates[x].file;
+
+      if (got_sigint) {
+        printf("\n");
+        exit(0);
+      }
+
+      if (curfile->crcpartial == NULL && (ISFLAG(flags, F_CACHESIGNATURES) || ISFLAG(flags, F_XATTRCACHE)))
+        loadcachedsignatures(curfile);
+
+      if (curfile->crcpartial == NULL)
+      {
+        curfile->crcpartial = getcrcpartialsignature(curfile);
+        if (curfile->crcpartial == NULL) {
+          errormsg ("cannot read file %s\n", curfile->d_name);
+          continue;
+        }
+
+        if ((ISFLAG(flags, F_CACHESIGNATURES) || ISFLAG(flags, F_XATTRCACHE)) && !ISFLAG(flags, F_READONLYCACHE))
+          savecachedpartial(curfile);
+      }
+
+      candidates[readable++] = candidates[x];
+    }
+
+    qsort(candidates + first, readable - first, sizeof(struct candidate), sort_candidates_by_partial);
+
+    for (x = first; x < readable; x = y)
+    {
+      for (y = x + 1; y < readable && md5cmp(candidates[y].file->crcpartial, candidates[x].file->crcpartial) == 0; ++y)
+        ;
+
+      if (candidatesspansets(candidates + x, y - x))
+        for (; x < y; ++x)
+          keep[candidates[x].position] = 1;
+    }
+  }
+
+  free(candidates);
+
+  kept = NULL;
+  lastkept = NULL;
+  *filecount = 0;
+
+  for (x = 0, curfile = files; curfile != NULL; ++x, curfile = nextfile)
+  {
+    nextfile = curfile->next;
+
+    if (keep[x])
+    {
+      curfile->next = NULL;
+
+      if (lastkept != NULL)
+        lastkept->next = curfile;
+      else
+        kept = curfile;
+
+      lastkept = curfile;
+      ++*filecount;
+    }
+    else
+    {
+      fdcache_forget(curfile);
+      free(curfile->d_name);
+      free(curfile->crcpartial);
+      free(curfile->crcsignature);
+      freeprefixsignatures(curfile);
+      free(curfile->crcsample);
+      free(curfile);
+    }
+  }
+
+  free(keep);
+
+  return kept;
+}
+
+struct mappedfile
+{
+  file_t *file;
+  struct extentmap *map;
+};
+
+int sort_mapped_by_size(const void *a, const void *b)
+{
+  const struct mappedfile *mapped1 = a;
+  const struct mappedfile *mapped2 = b;
+
+  if (mapped1->file->size != mapped2->file->size)
+    return mapped1->file->size < mapped2->file->size ? -1 : 1;
+
+  if (mapped1->file->device != mapped2->file->device)
+    return mapped1->file->device < mapped2->file->device ? -1 : 1;
+
+  return 0;
+}
+
+int sort_mapped_by_extents(const void *a, const void *b)
+{
+  const struct mappedfile *mapped1 = a;
+  const struct mappedfile *mapped2 = b;
+
+  if (mapped1->map == NULL || mapped2->map == NULL)
+    return (mapped1->map == NULL) - (mapped2->map == NULL);
+
+  return extents_compare(mapped1->map, mapped2->map);
+}
+
+/* Find files of the same size on the same device that share all of their
+   extents, as after a reflink copy or an earlier --dedupe-extents, and
+   point each to the first of them, so that none need be read to be
+   matched with the others. Files small enough to be read in a single
+   call are left alone. */
+void findsharedextents(file_t *files)
+{
+  struct mappedfile *mapped;
+  file_t *curfile;
+  size_t count;
+  size_t first;
+  size_t last;
+  size_t same;
+  size_t x;
+  int fd;
+
+  count = 0;
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+    if (curfile->size > PARTIAL_MD5_SIZE)
+      ++count;
+
+  if (count < 2)
+    return;
+
+  mapped = (struct mappedfile*) malloc(sizeof(struct mappedfile) * count);
+  if (mapped == NULL) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  x = 0;
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+  {
+    if (curfile->size > PARTIAL_MD5_SIZE)
+    {
+      mapped[x].file = curfile;
+      mapped[x].map = NULL;
+      ++x;
+    }
+  }
+
+  qsort(mapped, count, sizeof(struct mappedfile), sort_mapped_by_size);
+
+  for (first = 0; first < count; first = last)
+  {
+    for (last = first + 1; last < count && sort_mapped_by_size(&mapped[first], &mapped[last]) == 0; ++last)
+      ;
+
+    if (last - first < 2)
+      continue;
+
+    for (x = first; x < last; ++x)
+    {
+      if (got_sigint) {
+        printf("\n");
+        exit(0);
+      }
+
+      fd = fdcache_open(mapped[x].file);
+      if (fd == -1)
+        continue;
+
+      mapped[x].map = extents_load(fd);
+
+      fdcache_release(mapped[x].file, fd);
+    }
+
+    /* identical maps end up next to each other */
+    qsort(mapped + first, last - first, sizeof(struct mappedfile), sort_mapped_by_extents);
+
+    for (x = first; x < last && mapped[x].map != NULL; x = same)
+    {
+      for (same = x + 1; same < last && mapped[same].map != NULL &&
+          extents_compare(mapped[x].map, mapped[same].map) == 0; ++same)
+        mapped[same].file->sharedwith = mapped[x].file;
+
+      if (same - x > 1)
+        mapped[x].file->sharedwith = mapped[x].file;
+    }
+
+    for (x = first; x < last; ++x)
+      extents_free(mapped[x].map);
+  }
+
+  free(mapped);
+}
+
+/* a file as scheduled by scheduleresidentfirst() */
+struct scheduledfile
+{
+  file_t *file;
+  size_t index;
+  int class;
+};
+
+#define SCHEDULE_RESIDENT 0
+#define SCHEDULE_COLD     1
+#define SCHEDULE_ALONE    2
+
+int sort_scheduled_by_size(const void *a, const void *b)
+{
+  const struct scheduledfile *scheduled1 = a;
+  const struct scheduledfile *scheduled2 = b;
+
+  if (scheduled1->file->size != scheduled2->file->size)
+    return scheduled1->file->size < scheduled2->file->size ? -1 : 1;
+
+  return scheduled1->index < scheduled2->index ? -1 : 1;
+}
+
+/* Resident files keep their order, cold files are read in the order of
+   their inodes, which tends to follow their location on disk. */
+int sort_scheduled_by_class(const void *a, const void *b)
+{
+  const struct scheduledfile *scheduled1 = a;
+  const struct scheduledfile *scheduled2 = b;
+
+  if (scheduled1->class != scheduled2->class)
+    return scheduled1->class < scheduled2->class ? -1 : 1;
+
+  if (scheduled1->class == SCHEDULE_COLD)
+  {
+    if (scheduled1->file->device != scheduled2->file->device)
+      return scheduled1->file->device < scheduled2->file->device ? -1 : 1;
+
+    if (scheduled1->file->inode != scheduled2->file->inode)
+      return scheduled1->file->inode < scheduled2->file->inode ? -1 : 1;
+  }
+
+  return scheduled1->index < scheduled2->index ? -1 : 1;
+}
+
+/* Reorder files so that those whose contents are already in the page
+   cache are matched first, followed by those that must be read from
+   disk. Files of a size no other file has, which are never read, come
+   last. Returns the new head of the list.
+*/
+file_t *scheduleresidentfirst(file_t *files)
+{
+  struct scheduledfile *scheduled;
+  file_t *curfile;
+  size_t count;
+  size_t first;
+  size_t last;
+  size_t x;
+  int fd;
+
+  count = 0;
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+    ++count;
+
+  if (count < 2)
+    return files;
+
+  scheduled = (struct scheduledfile*) malloc(sizeof(struct scheduledfile) * count);
+  if (scheduled == NULL) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  x = 0;
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+  {
+    scheduled[x].file = curfile;
+    scheduled[x].index = x;
+    scheduled[x].class = SCHEDULE_ALONE;
+    ++x;
+  }
+
+  qsort(scheduled, count, sizeof(struct scheduledfile), sort_scheduled_by_size);
+
+  for (first = 0; first < count; first = last)
+  {
+    for (last = first + 1; last < count && scheduled[last].file->size == scheduled[first].file->size; ++last)
+      ;
+
+    if (last - first < 2)
+      continue;
+
+    for (x = first; x < last; ++x)
+    {
+      if (got_sigint) {
+        printf("\n");
+        exit(0);
+      }
+
+      scheduled[x].class = SCHEDULE_COLD;
+
+      fd = fdcache_open(scheduled[x].file);
+      if (fd == -1)
+        continue;
+
+      if (residency_check(fd, scheduled[x].file->size) == RESIDENCY_RESIDENT)
+        scheduled[x].class = SCHEDULE_RESIDENT;
+
+      fdcache_release(scheduled[x].file, fd);
+    }
+  }
+
+  qsort(scheduled, count, sizeof(struct scheduledfile), sort_scheduled_by_class);
+
+  for (x = 0; x + 1 < count; ++x)
+    scheduled[x].file->next = scheduled[x + 1].file;
+
+  scheduled[count - 1].file->next = NULL;
+
+  files = scheduled[0].file;
+
+  free(scheduled);
+
+  return files;
+}
+
+/* nonzero if the set of matches headed by files spans two or more sets */
+int groupspanssets(file_t *files)
+{
+  file_t *tmpfile;
+
+  for (tmpfile = files->duplicates; tmpfile != NULL; tmpfile = tmpfile->duplicates)
+    if (tmpfile->set != files->set)
+      return 1;
+
+  return 0;
+}
+
+/* Clear sets of matches whose members all belong to the same set. */
+void dropsinglesetgroups(file_t *files)
+{
+  for (; files != NULL; files = files->next)
+    if (files->hasdupes && !groupspanssets(files))
+      files->hasdupes = 0;
+}
+
+/* a set of matches not yet known to be complete, for --stream */
+struct pendinggroup
+{
+  file_t **head;
+  struct pendinggroup *next;
+};
+
+/* files of one size still to be matched, for --stream */
+struct sizebucket
+{
+  off_t size;
+  size_t remaining;
+  struct pendinggroup *groups;
+};
+
+struct sizebucket *sizebuckets = 0;
+size_t sizebucketcount = 0;
+
+int sort_buckets_by_size(const void *a, const void *b)
+{
+  const struct sizebucket *bucket1 = a;
+  const struct sizebucket *bucket2 = b;
+
+  if (bucket1->size != bucket2->size)
+    return bucket1->size < bucket2->size ? -1 : 1;
+
+  return 0;
+}
+
+/* Count the files of each size, so that the sets of matches among
+   them can be written out as soon as the last one has been matched. */
+void trackbuckets(file_t *files)
+{
+  file_t *curfile;
+  size_t count;
+  size_t x;
+
+  count = 0;
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+    ++count;
+
+  sizebuckets = (struct sizebucket*) malloc(sizeof(struct sizebucket) * (count > 0 ? count : 1));
+  if (sizebuckets == NULL) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  x = 0;
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+  {
+    sizebuckets[x].size = curfile->size;
+    sizebuckets[x].remaining = 1;
+    sizebuckets[x].groups = NULL;
+    ++x;
+  }
+
+  qsort(sizebuckets, count, sizeof(struct sizebucket), sort_buckets_by_size);
+
+  sizebucketcount = 0;
+  for (x = 0; x < count; ++x)
+  {
+    if (sizebucketcount > 0 && sizebuckets[sizebucketcount - 1].size == sizebuckets[x].size)
+      ++sizebuckets[sizebucketcount - 1].remaining;
+    else
+      sizebuckets[sizebucketcount++] = sizebuckets[x];
+  }
+}
+
+struct sizebucket *findbucket(off_t size)
+{
+  struct sizebucket key;
+
+  key.size = size;
+
+  return bsearch(&key, sizebuckets, sizebucketcount, sizeof(struct sizebucket), sort_buckets_by_size);
+}
+
+/* Remember a new set of matches, whose head may change as it grows. */
+void trackgroup(file_t **head)
+{
+  struct sizebucket *bucket;
+  struct pendinggroup *group;
+
+  bucket = findbucket((*head)->size);
+  if (bucket == NULL)
+    return;
+
+  group = (struct pendinggroup*) malloc(sizeof(struct pendinggroup));
+  if (group == NULL) {
+    errormsg("out of memory!\n");
+    exit(1);
+  }
+
+  group->head = head;
+  group->next = bucket->groups;
+  bucket->groups = group;
+}
+
+/* Note that file has been matched. Once every file of its size has
+   been, write out the sets of matches among them and return nonzero. */
+int emitfinalgroups(file_t *file)
+{
+  struct sizebucket *bucket;
+  struct pendinggroup *group;
+  int emitted = 0;
+
+  bucket = findbucket(file->size);
+  if (bucket == NULL || --bucket->remaining > 0)
+    return 0;
+
+  while (bucket->groups != NULL)
+  {
+    group = bucket->groups;
+
+    if ((*group->head)->hasdupes && (setcount == 0 || groupspanssets(*group->head)))
+    {
+      output_group(*group->head);
+      emitted = 1;
+    }
+
+    bucket->groups = group->next;
+    free(group);
+  }
+
+  return emitted;
+}
+
+/* Whether file can be read. Files that cannot be read never match any
+   other, whatever else is known about them. Empty files are checked
+   without being opened, and small files kept in memory have been read. */
+int isreadable(file_t *file)
+{
+  int fd;
+
+  if (file->size == 0)
+    return access(file->d_name, R_OK) == 0;
+
+  if (file->content != NULL)
+    return 1;
+
+  fd = fdcache_open(file);
+  if (fd == -1)
+    return 0;
+
+  fdcache_release(file, fd);
+
+  return 1;
+}
+
+/* Confirm that two files are identical, byte for byte, unless the cache
+   already holds a confirmation made while both files were in their current
+   state. Returns 1 if files match, 0 if they differ, or -1 if either file
+   could not be opened. */
+int confirmfiles(file_t *file1, file_t *file2)
+{
+  int fd1;
+  int fd2;
+  int ismatch;
+  md5_byte_t digest[MD5_DIGEST_LENGTH];
+  int upgrade = 0;
+
+  if (!isreadable(file1) || !isreadable(file2))
+    return -1;
+
+  /* files about to be deleted or linked are compared all the same */
+  if (sharesextents(file1, file2) && !ISFLAG(flags, F_DELETEFILES))
+    return 1;
+
+  /* files of the same size are alike if they have no contents, and small
+     files may have had theirs kept in memory */
+  if (file1->size == 0)
+    return 1;
+
+  if (file1->content != NULL && file2->content != NULL)
+    return memcmp(file1->content, file2->content, file1->size) == 0;
+
+#ifndef NO_SQLITE
+  if (db != 0 && ISFLAG(flags, F_CACHECONFIRMATIONS) && hashdb_loadconfirmation(db, file1, file2))
+    return 1;
+
+  upgrade = db != 0;
+#endif
+
+  /* files with heuristic signatures get their full hash while we're at it */
+  upgrade = (upgrade || ISFLAG(flags, F_XATTRCACHE)) && !ISFLAG(flags, F_READONLYCACHE) &&
+    isheuristic(file1) && file1->crcpartial != NULL && file2->crcpartial != NULL;
+
+  fd1 = fdcache_open(file1);
+  if (fd1 == -1)
+    return -1;
+
+  fd2 = fdcache_open(file2);
+  if (fd2 == -1) {
+    fdcache_release(file1, fd1);
+    return -1;
+  }
+
+  ismatch = confirmmatch(fd1, fd2, upgrade ? digest : 0, confirmthreads);
+
+  fdcache_release(file2, fd2);
+  fdcache_release(file1, fd1);
+
+  if (ismatch && upgrade && ISFLAG(flags, F_XATTRCACHE)) {
+    xattr_savehash(file1, XATTR_HASH_FULL, digest);
+    xattr_savehash(file2, XATTR_HASH_FULL, digest);
+  }
+
+#ifndef NO_SQLITE
+  if (ismatch && upgrade && db != 0) {
+    hashdb_savehash(db, file1, HASH_FUNCTION_MD5, file1->crcpartial, digest);
+    hashdb_savehash(db, file2, HASH_FUNCTION_MD5, file2->crcpartial, digest);
+  }
+
+  if (ismatch && db != 0 && ISFLAG(flags, F_CACHECONFIRMATIONS) && !ISFLAG(flags, F_READONLYCACHE))
+    hashdb_saveconfirmation(db, file1, file2);
+#endif
+
+  return ismatch;
+}
+
+/* Without prompting, decide which of the files in dupelist[1 .. counter]
+   to preserve. */
+void choosepreserved(file_t **dupelist, int counter, int *preserve)
 {
-  int numsets = 0;
-  double numbytes = 0.0;
-  int numfiles = 0;
-  file_t *tmpfile;
+  int x;
 
-  while (files != NULL)
+  if (applyingplan) /* preserve files the plan keeps */
   {
-    if (files->hasdupes)
-    {
-      numsets++;
-
-      tmpfile = files->duplicates;
-      while (tmpfile != NULL)
-      {
-	numfiles++;
-	numbytes += files->size;
-	tmpfile = tmpfile->duplicates;
-      }
-    }
+    for (x = 1; x <= counter; x++) preserve[x] = dupelist[x]->action != FILEACTION_DELETE;
+  }
 
-    files = files->next;
+  else if (deleteset != 0) /* preserve files outside the set */
+  {
+    for (x = 1; x <= counter; x++) preserve[x] = dupelist[x]->set != deleteset;
   }
 
-  if (numsets == 0)
-    printf("No duplicates found.\n\n");
-  else
+  else /* preserve only the first file */
   {
-    if (numbytes < 1024.0)
-      printf("%s%d duplicate files (in %d sets), occupying %.0f bytes.\n\n", ISFLAG(flags, F_QUICKSUMMARY) ? "approximately " : "", numfiles, numsets, numbytes);
-    else if (numbytes <= (1000.0 * 1000.0))
-      printf("%s%d duplicate files (in %d sets), occupying %.1f kilobytes\n\n", ISFLAG(flags, F_QUICKSUMMARY) ? "approximately " : "", numfiles, numsets, numbytes / 1000.0);
-    else
-      printf("%s%d duplicate files (in %d sets), occupying %.1f megabytes\n\n", ISFLAG(flags, F_QUICKSUMMARY) ? "approximately " : "", numfiles, numsets, numbytes / (1000.0 * 1000.0));
+    preserve[1] = 1;
+    for (x = 2; x <= counter; x++) preserve[x] = 0;
   }
 }
 
-void printmatches(file_t *files)
+/* Find the first preserved file that deletions from the set may rely on,
+   or 0 if there is none: a plan's deletions rely on a file it keeps
+   being unchanged. */
+int firstintact(file_t **dupelist, int counter, const int *preserve)
 {
-  file_t *tmpfile;
+  int x;
 
-  while (files != NULL) {
-    if (files->hasdupes) {
-      if (!ISFLAG(flags, F_OMITFIRST)) {
-	if (ISFLAG(flags, F_SHOWSIZE)) printf("%lld byte%seach:\n", (long long int)files->size,
-	 (files->size != 1) ? "s " : " ");
-        if (ISFLAG(flags, F_SHOWTIME))
-          printf("%s ", fmttime(files->mtime));
-	if (ISFLAG(flags, F_DSAMELINE)) escapefilename("\\ ", &files->d_name);
-	printf("%s%c", files->d_name, ISFLAG(flags, F_DSAMELINE)?' ':'\n');
-      }
-      tmpfile = files->duplicates;
-      while (tmpfile != NULL) {
-        if (ISFLAG(flags, F_SHOWTIME))
-          printf("%s ", fmttime(tmpfile->mtime));
-	if (ISFLAG(flags, F_DSAMELINE)) escapefilename("\\ ", &tmpfile->d_name);
-	printf("%s%c", tmpfile->d_name, ISFLAG(flags, F_DSAMELINE)?' ':'\n');
-	tmpfile = tmpfile->duplicates;
-      }
-      printf("\n");
+  for (x = 1; x <= counter; x++)
+    if (preserve[x] && (!applyingplan || !haschanged(dupelist[x])))
+      return x;
 
-    }
-      
-    files = files->next;
-  }
+  return 0;
 }
 
-/*
-#define REVISE_APPEND "_tmp"
-char *revisefilename(char *path, int seq)
+/* With --link, find the file that dupelist[x] is to become a link to:
+   the first preserved file on the same device, or else fallback. */
+file_t *linktarget(file_t **dupelist, int counter, const int *preserve, int x, file_t *fallback)
 {
-  int digits;
-  char *newpath;
-  char *scratch;
-  char *dot;
+  int y;
 
-  digits = numdigits(seq);
-  newpath = malloc(strlen(path) + strlen(REVISE_APPEND) + digits + 1);
-  if (!newpath) return newpath;
+  if (!ISFLAG(flags, F_LINKFILES))
+    return 0;
 
-  scratch = malloc(strlen(path) + 1);
-  if (!scratch) return newpath;
+  for (y = 1; y <= counter; y++)
+    if (preserve[y] && dupelist[y]->device == dupelist[x]->device)
+      return dupelist[y];
 
-  strcpy(scratch, path);
-  dot = strrchr(scratch, '.');
-  if (dot) 
-  {
-    *dot = 0;
-    sprintf(newpath, "%s%s%d.%s", scratch, REVISE_APPEND, seq, dot + 1);
-  }
+  return fallback;
+}
 
-  else
+/* Delete (or link) every file that deletefiles() would delete without
+   prompting, across deletethreads threads, returning the outcomes in the order
+   deletefiles() will report them. The file found by firstintact() for each
+   set is recorded in kept, for deletefiles() to report the decision made
+   here rather than look again once files have been deleted. */
+struct deletion_request *deleteinparallel(file_t *files, file_t **dupelist, int *preserve, int *kept, size_t *count)
+{
+  struct deletion_request *requests = 0;
+  struct deletion_request *newrequests;
+  size_t allocated = 0;
+  file_t *tmpfile;
+  int keptintact;
+  int counter;
+  int group = 0;
+  int x;
+
+  *count = 0;
+
+  for (; files != 0; files = files->next)
   {
-    sprintf(newpath, "%s%s%d", path, REVISE_APPEND, seq);
-  }
+    if (!files->hasdupes)
+      continue;
 
-  free(scratch);
+    counter = 0;
+    for (tmpfile = files; tmpfile != 0; tmpfile = tmpfile->duplicates)
+      dupelist[++counter] = tmpfile;
 
-  return newpath;
-} */
+    choosepreserved(dupelist, counter, preserve);
 
-int relink(char *oldfile, char *newfile)
-{
-  dev_t od;
-  dev_t nd;
-  ino_t oi;
-  ino_t ni;
+    keptintact = firstintact(dupelist, counter, preserve);
+    kept[group++] = keptintact;
+    if (keptintact == 0)
+      continue;
 
-  od = getdevice(oldfile);
-  oi = getinode(oldfile);
+    for (x = 1; x <= counter; x++)
+    {
+      if (preserve[x])
+        continue;
 
-  if (link(oldfile, newfile) != 0)
-    return 0;
+      if (*count == allocated)
+      {
+        allocated = allocated == 0 ? 1024 : allocated * 2;
+
+        newrequests = (struct deletion_request*) realloc(requests, allocated * sizeof(struct deletion_request));
+        if (newrequests == 0)
+        {
+          errormsg("out of memory\n");
+          exit(1);
+        }
+
+        requests = newrequests;
+      }
 
-  /* make sure we're working with the right file (the one we created) */
-  nd = getdevice(newfile);
-  ni = getinode(newfile);
+      requests[*count].file = dupelist[x];
+      requests[*count].target = linktarget(dupelist, counter, preserve, x, dupelist[keptintact]);
+      ++*count;
+    }
+  }
 
-  if (nd != od || oi != ni)
-    return 0; /* file is not what we expected */
+  deletion_removeall(requests, *count, deletethreads);
 
-  return 1;
+  return requests;
 }
 
 void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
@@ -1065,7 +2576,13 @@ void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
   file_t *curfile;
   file_t **dupelist;
   int *preserve;
-  int firstpreserved;
+  int keptintact;
+  int *kept = 0;
+  file_t *target;
+  struct deletion_request *requests = 0;
+  size_t requestcount = 0;
+  size_t nextrequest = 0;
+  int result;
   char *preservestr;
   char *token;
   char *tstr;
@@ -1076,10 +2593,7 @@ void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
   int i;
   struct log_info *loginfo;
   int log_error;
-  FILE *file1;
-  FILE *file2;
   int ismatch;
-  char *deletepath;
   char *errorstring;
 
   curfile = files;
@@ -1116,10 +2630,19 @@ void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
   if (logfile != 0)
     loginfo = log_open(logfile, &log_error);
 
-#ifndef NO_SQLITE
-  if (!prompt)
-    hashdb_begintransaction(db);
-#endif
+  /* deletions that need no further confirmation can all be carried out
+     up front, across several threads */
+  if (!prompt && planout == 0 && deletethreads > 1 &&
+      (!ISFLAG(flags, F_DEFERCONFIRMATION) || ISFLAG(flags, F_NOCONFIRMATION)))
+  {
+    kept = (int*) malloc(sizeof(int) * (groups > 0 ? groups : 1));
+    if (!kept) {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    requests = deleteinparallel(files, dupelist, preserve, kept, &requestcount);
+  }
 
   while (files) {
     if (files->hasdupes) {
@@ -1151,11 +2674,8 @@ void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
 
       if (prompt) printf("\n");
 
-      if (!prompt) /* preserve only the first file */
-      {
-         preserve[1] = 1;
-	 for (x = 2; x <= counter; x++) preserve[x] = 0;
-      }
+      if (!prompt) /* decide without prompting */
+        choosepreserved(dupelist, counter, preserve);
 
       else /* prompt for files to preserve */
 
@@ -1233,14 +2753,30 @@ void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
 
       printf("\n");
 
+      /* record decisions in the plan instead of carrying them out */
+      if (planout != 0)
+      {
+        for (x = 1; x <= counter; x++)
+          printf("   [planned: %s] %s\n", preserve[x] ? "keep  " : "delete", dupelist[x]->d_name);
+
+        printf("\n");
+
+        if (!plan_writeset(planout, dupelist + 1, preserve + 1, counter))
+        {
+          errormsg("could not write deletion plan\n");
+          exit(1);
+        }
+
+        files = files->next;
+        continue;
+      }
+
+      /* files may have been deleted already, relying on the file found then */
+      keptintact = kept != 0 ? kept[curgroup - 1] : firstintact(dupelist, counter, preserve);
+
       if (loginfo)
         log_begin_set(loginfo);
 
-#ifndef NO_SQLITE
-      if (prompt)
-        hashdb_begintransaction(db);
-#endif
-
       for (x = 1; x <= counter; x++) { 
 	if (preserve[x])
         {
@@ -1250,31 +2786,15 @@ void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
             log_file_remaining(loginfo, dupelist[x]->d_name);
         }
 	else {
-    if (ISFLAG(flags, F_DEFERCONFIRMATION) && !ISFLAG(flags, F_NOCONFIRMATION))
-    {
-      firstpreserved = 0;
-      for (i = 1; i <= counter; ++i)
-      {
-        if (preserve[i])
-        {
-          firstpreserved = i;
-          break;
-        }
-      }
-
-      file1 = fopen(dupelist[x]->d_name, "rb");
-      file2 = fopen(dupelist[firstpreserved]->d_name, "rb");
-
-      if (file1 && file2)
-        ismatch = confirmmatch(file1, file2);
-      else
-        ismatch = 0;
+    target = keptintact != 0 ? linktarget(dupelist, counter, preserve, x, dupelist[keptintact]) : 0;
 
-      if (file2)
-        fclose(file2);
-
-      if (file1)
-        fclose(file1);
+    if (keptintact == 0)
+    {
+      ismatch = 0;
+    }
+    else if (ISFLAG(flags, F_DEFERCONFIRMATION) && !ISFLAG(flags, F_NOCONFIRMATION))
+    {
+      ismatch = confirmfiles(dupelist[x], target != 0 ? target : dupelist[keptintact]) == 1;
     }
     else
     {
@@ -1282,29 +2802,33 @@ void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
     }
 
     if (ismatch) {
-      if (removeifnotchanged(dupelist[x], &errorstring) == 0) {
-        printf("   [-] %s\n", dupelist[x]->d_name);
+      /* use the outcome of a deletion already carried out, if any */
+      if (nextrequest < requestcount && requests[nextrequest].file == dupelist[x])
+      {
+        result = requests[nextrequest].result;
+        if (result != 0)
+          errorstring = deletion_errorstring(&requests[nextrequest]);
 
-#ifndef NO_SQLITE
-        if (db)
-        {
-          deletepath = getrealpath(dupelist[x]->d_name, GETREALPATH_IGNORE_MISSING_BASENAME);
-          if (deletepath != 0)
-          {
-            if (!ISFLAG(flags, F_READONLYCACHE))
-              hashdb_deletehashforpath(db, deletepath);
+        ++nextrequest;
+      }
+      else
+        result = deletion_replace(dupelist[x], target, &errorstring);
 
-            free(deletepath);
-          }
-        }
-#endif
+      if (result == 0 && target != 0) {
+        printf("   [=] %s\n", dupelist[x]->d_name);
+
+        if (loginfo)
+          log_file_linked(loginfo, dupelist[x]->d_name);
+      }
+      else if (result == 0) {
+        printf("   [-] %s\n", dupelist[x]->d_name);
 
         if (loginfo)
           log_file_deleted(loginfo, dupelist[x]->d_name);
       }
       else {
         printf("   [!] %s ", dupelist[x]->d_name);
-        printf("-- unable to delete file: %s!\n", errorstring);
+        printf("-- unable to %s file: %s!\n", target != 0 ? "link" : "delete", errorstring);
 
         if (loginfo)
           log_file_remaining(loginfo, dupelist[x]->d_name);
@@ -1312,7 +2836,11 @@ void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
     }
     else {
       printf("   [!] %s\n", dupelist[x]->d_name);
-      printf(" -- unable to confirm match; file not deleted!\n");
+
+      if (keptintact == 0)
+        printf(" -- every file kept has changed; file not %s!\n", ISFLAG(flags, F_LINKFILES) ? "linked" : "deleted");
+      else
+        printf(" -- unable to confirm match; file not %s!\n", ISFLAG(flags, F_LINKFILES) ? "linked" : "deleted");
 
       if (loginfo)
         log_file_remaining(loginfo, dupelist[x]->d_name);
@@ -1323,26 +2851,20 @@ void deletefiles(file_t *files, int prompt, FILE *tty, char *logfile)
 
       if (loginfo)
         log_end_set(loginfo);
-
-#ifndef NO_SQLITE
-      if (prompt)
-        hashdb_committransaction(db);
-#endif
     }
     
     files = files->next;
   }
 
-#ifndef NO_SQLITE
-  if (!prompt)
-    hashdb_committransaction(db);
-#endif
+  deletion_finish();
 
   if (loginfo) {
     log_close(loginfo);
     loginfo = 0;
   }
 
+  free(requests);
+  free(kept);
   free(dupelist);
   free(preserve);
   free(preservestr);
@@ -1441,7 +2963,7 @@ void deletesuccessor(file_t **existing, file_t *duplicate, int matchconfirmed,
 {
   file_t *to_keep;
   file_t *to_delete;
-  char *deletepath;
+  file_t *target;
   char *errorstring;
 
   if (comparef(duplicate, *existing) >= 0)
@@ -1467,30 +2989,20 @@ void deletesuccessor(file_t **existing, file_t *duplicate, int matchconfirmed,
   if (loginfo)
     log_file_remaining(loginfo, to_keep->d_name);
 
+  target = ISFLAG(flags, F_LINKFILES) ? to_keep : 0;
+
   if (matchconfirmed)
   {
-    if (removeifnotchanged(to_delete, &errorstring) == 0) {
-      printf("   [-] %s\n", to_delete->d_name);
-
-#ifndef NO_SQLITE
-      if (db)
-      {
-        deletepath = getrealpath(to_delete->d_name, GETREALPATH_IGNORE_MISSING_BASENAME);
-        if (deletepath != 0)
-        {
-          if (!ISFLAG(flags, F_READONLYCACHE))
-            hashdb_deletehashforpath(db, deletepath);
+    if (deletion_replace(to_delete, target, &errorstring) == 0) {
+      printf("   [%c] %s\n", target != 0 ? '=' : '-', to_delete->d_name);
 
-          free(deletepath);
-        }
-      }
-#endif
-
-      if (loginfo)
+      if (loginfo && target != 0)
+        log_file_linked(loginfo, to_delete->d_name);
+      else if (loginfo)
         log_file_deleted(loginfo, to_delete->d_name);
     } else {
       printf("   [!] %s ", to_delete->d_name);
-      printf("-- unable to delete file: %s!\n", errorstring);
+      printf("-- unable to %s file: %s!\n", target != 0 ? "link" : "delete", errorstring);
 
       if (loginfo)
         log_file_remaining(loginfo, to_delete->d_name);
@@ -1499,7 +3011,7 @@ void deletesuccessor(file_t **existing, file_t *duplicate, int matchconfirmed,
   else
   {
     printf("   [!] %s\n", to_delete->d_name);
-    printf(" -- unable to confirm match; file not deleted!\n");
+    printf(" -- unable to confirm match; file not %s!\n", target != 0 ? "linked" : "deleted");
 
     if (loginfo)
       log_file_remaining(loginfo, to_delete->d_name);
@@ -1511,6 +3023,38 @@ void deletesuccessor(file_t **existing, file_t *duplicate, int matchconfirmed,
   printf("\n");
 }
 
+/* Parse a comma-separated list of prefix sizes, each larger than the
+   partial signature and than the size before it. */
+int parseprefixstages(const char *arg)
+{
+  const char *position;
+  char *endptr;
+  long long size;
+  off_t previous;
+
+  prefixstagecount = 0;
+  previous = PARTIAL_MD5_SIZE;
+
+  for (position = arg; ; position = endptr + 1)
+  {
+    if (*position < '0' || *position > '9')
+      return 0;
+
+    size = strtoll(position, &endptr, 10);
+    if (size <= previous || prefixstagecount == PREFIX_MAX_STAGES)
+      return 0;
+
+    prefixstages[prefixstagecount++] = size;
+    previous = size;
+
+    if (*endptr == '\0')
+      return 1;
+
+    if (*endptr != ',')
+      return 0;
+  }
+}
+
 void help_text()
 {
   printf("Usage: fdupes [options] DIRECTORY...\n\n");
@@ -1529,10 +3073,75 @@ void help_text()
   printf("                         option will change this behavior\n");
   printf(" -G --minsize=SIZE       consider only files greater than or equal to SIZE bytes\n");
   printf(" -L --maxsize=SIZE       consider only files less than or equal to SIZE bytes\n");
+  printf("    --catalog=FILE       instead of looking for duplicates among the files\n");
+  printf("                         given, look for files whose contents appear in FILE,\n");
+  printf("                         a list of MD5 digests such as md5sum produces or a\n");
+  printf("                         manifest exported by fdupes; each set of matches is\n");
+  printf("                         headed by the catalog entry (may be combined with\n");
+  printf("                         --delete only when --noprompt is also given)\n");
+  printf("    --set NAME           assign the directories that follow to set NAME, and\n");
+  printf("                         report only duplicates found in two or more sets;\n");
+  printf("                         files that cannot match a file in another set are\n");
+  printf("                         never read (every directory must follow a --set)\n");
+  printf("    --delete-set=NAME    with --delete and --noprompt, delete duplicates only\n");
+  printf("                         from set NAME, preserving all others\n");
+  printf("    --save-snapshot=FILE save the sets of matches found to FILE\n");
+  printf("    --since=FILE         instead of listing every set of matches, list those\n");
+  printf("                         that are new (+) or have gained files since snapshot\n");
+  printf("                         FILE was saved, and those that have disappeared (-)\n");
+  printf("    --format=FORMAT      list matches as FORMAT, one of text (the default),\n");
+  printf("                         jsonl (one JSON object per set) or nul (names ended\n");
+  printf("                         by NUL characters, and sets by an additional NUL)\n");
+  printf("    --stream             list each set of matches as soon as every file of\n");
+  printf("                         its size has been compared, rather than at the end\n");
+  printf("    --save-results=FILE  save the sets of matches found to FILE, along with\n");
+  printf("                         the actions chosen for their files when --delete\n");
+  printf("                         is used interactively\n");
+  printf("    --load-results=FILE  instead of searching directories, use the sets of\n");
+  printf("                         matches saved to FILE, leaving out files that have\n");
+  printf("                         changed since\n");
+  printf("    --plan-out=FILE      with --delete, record the files to keep and delete\n");
+  printf("                         in deletion plan FILE instead of deleting any\n");
+  printf("    --apply-plan=FILE    delete the files that deletion plan FILE marks for\n");
+  printf("                         deletion, unless they or all files kept alongside\n");
+  printf("                         them have changed since (with --deferconfirmation,\n");
+  printf("                         confirm each match byte-for-byte first)\n");
+  printf("    --link               with --delete or --apply-plan, replace duplicates\n");
+  printf("                         with hard links to the file preserved instead of\n");
+  printf("                         deleting them\n");
+#ifdef HAVE_FIDEDUPERANGE
+  printf("    --dedupe-extents     share the data of the first file in each set with\n");
+  printf("                         the other files in the set, on filesystems that\n");
+  printf("                         support it, instead of listing the set; the\n");
+  printf("                         kernel compares the files before sharing\n");
+#endif
+#ifdef HAVE_PTHREAD
+  printf("    --delete-threads=N   with --delete and --noprompt, delete files using N\n");
+  printf("                         threads, each handling its own directories\n");
+#endif
+#ifdef HAVE_SYS_XATTR_H
+  printf("    --xattr-cache        keep file signatures in extended attributes of the\n");
+  printf("                         files themselves, alone or alongside --cache; only\n");
+  printf("                         the readonly cache parameter applies to them\n");
+#endif
 #ifndef NO_SQLITE
   printf(" -c --cache              speed up file comparisons by keeping track of their\n");
   printf("                         signatures in a database; additional parameters may be\n");
   printf("                         provided using one or more cache parameters (as below)\n");
+  printf("    --cache-path=FILE    keep signatures in database FILE instead of the\n");
+  printf("                         default location; implies --cache\n");
+  printf("    --export-manifest=FILE\n");
+  printf("                         write the cached signatures of files below the\n");
+  printf("                         directory given by --root to FILE, by relative path\n");
+  printf("    --import-manifest=FILE\n");
+  printf("                         add signatures from manifest FILE to the cache for\n");
+  printf("                         files below --root whose size and modification time\n");
+  printf("                         match those recorded in the manifest\n");
+  printf("    --merge-manifest=FILE\n");
+  printf("                         with --export-manifest, combine this and any other\n");
+  printf("                         manifests given into a single manifest instead of\n");
+  printf("                         exporting from the cache (newest entries win)\n");
+  printf("    --root=DIR           directory manifest paths are relative to\n");
   printf(" -x cache.OPTION         supply an optional cache parameter, where OPTION is one\n");
   printf("                         of the keywords below and multiple options may be\n");
   printf("                         supplied via successive -x arguments:\n");
@@ -1540,6 +3149,11 @@ void help_text()
   printf("    prune                look through entire cache and delete orphaned entries\n");
   printf("    clear                clear all entries from cache\n");
   printf("    vacuum               reduce size of DB file, if possible\n");
+  printf("    confirmations        remember byte-for-byte match confirmations and\n");
+  printf("                         skip them for files that haven't changed since\n");
+  printf("    blocks               remember digests of large files block by block,\n");
+  printf("                         so files that grow are rehashed from where they\n");
+  printf("                         left off once their earlier blocks are checked\n");
   printf("                         (note that the options prune, clear, and vacuum may be\n");
   printf("                         employed without supplying a DIRECTORY argument, and\n");
   printf("                         will take effect even if readonly is also specified)\n");
@@ -1564,6 +3178,23 @@ void help_text()
   printf("                         of duplicates until just before file deletion;\n");
   printf("                         specify twice to skip confirmation entirely\n");
   printf(" -e --heuristic         use heuristic hashing for large files\n");
+  printf("    --tree-hash[=N]      hash files larger than 16 MiB in chunks, so that\n");
+  printf("                         chunks can be hashed by N threads at once\n");
+  printf("    --prefix-stages=SIZES\n");
+  printf("                         compare digests of the first SIZES bytes of\n");
+  printf("                         files (a comma-separated list, in increasing\n");
+  printf("                         order) before hashing them in full\n");
+  printf("    --sample             before hashing files of 512 KiB or more in full,\n");
+  printf("                         compare digests of small blocks read from their\n");
+  printf("                         middle, end, and other offsets given by their size\n");
+  printf("    --resident-first     match files already in the page cache first,\n");
+  printf("                         then the rest in the order of their inodes\n");
+#ifdef HAVE_PTHREAD
+  printf("    --confirm-threads=N  compare files larger than 16 MiB byte-for-byte\n");
+  printf("                         using N threads, each comparing its own ranges\n");
+  printf("    --pipeline           match files while directories are still being\n");
+  printf("                         listed, instead of listing all files first\n");
+#endif
 #ifndef NO_NCURSES
   printf(" -P --plain              with --delete, use line-based prompt (as with older\n");
   printf("                         versions of fdupes) instead of screen-mode interface\n");
@@ -1600,6 +3231,8 @@ void close_db_on_exit()
 {
   if (db != 0)
   {
+    deletion_finish();
+
     if (!sqlite3_get_autocommit(db))
       hashdb_committransaction(db);
 
@@ -1616,8 +3249,7 @@ void close_db_on_exit()
 int main(int argc, char **argv) {
   int x;
   int opt;
-  FILE *file1;
-  FILE *file2;
+  int ismatch;
   file_t *files = NULL;
   file_t *curfile;
   file_t **match = NULL;
@@ -1633,8 +3265,38 @@ int main(int argc, char **argv) {
   int log_error;
   struct stat logfile_status;
   char *endptr;
+#ifndef NO_SQLITE
   char *cachehome;
   char *cachepath;
+  char *cachefile = 0;
+#endif
+  char *exportmanifest = 0;
+  char *importmanifest = 0;
+  char **mergemanifests = 0;
+  int mergemanifestcount = 0;
+  char *manifestroot = 0;
+  char *catalogfile = 0;
+  char *deletesetname = 0;
+  int *dirsets = 0;
+  char *snapshotfile = 0;
+  char *sincefile = 0;
+  struct snapshot *snapshot;
+  struct snapshot *previoussnapshot;
+  int outputformat = OUTPUT_TEXT;
+  int streaming = 0;
+  char *saveresultsfile = 0;
+  char *loadresultsfile = 0;
+  char *planoutfile = 0;
+  char *applyplanfile = 0;
+  int dedupeextents = 0;
+  int residentfirst = 0;
+  int pipelined = 0;
+  struct filequeue *queue = 0;
+  struct traversal traversal;
+  int newgroup;
+  int unflushed = 0;
+  uint64_t last_flush = 0;
+  file_t *results;
 
 #ifdef HAVE_GETOPT_H
   static struct option long_options[] = 
@@ -1668,6 +3330,32 @@ int main(int argc, char **argv) {
     { "deferconfirmation", 0, 0, 'D' },
     { "heuristic", 0, 0, 'e' },
     { "cache", 0, 0, 'c' },
+    { "cache-path", 1, 0, OPTION_CACHE_PATH },
+    { "xattr-cache", 0, 0, OPTION_XATTR_CACHE },
+    { "export-manifest", 1, 0, OPTION_EXPORT_MANIFEST },
+    { "import-manifest", 1, 0, OPTION_IMPORT_MANIFEST },
+    { "merge-manifest", 1, 0, OPTION_MERGE_MANIFEST },
+    { "root", 1, 0, OPTION_ROOT },
+    { "catalog", 1, 0, OPTION_CATALOG },
+    { "set", 1, 0, OPTION_SET },
+    { "delete-set", 1, 0, OPTION_DELETE_SET },
+    { "save-snapshot", 1, 0, OPTION_SAVE_SNAPSHOT },
+    { "since", 1, 0, OPTION_SINCE },
+    { "format", 1, 0, OPTION_FORMAT },
+    { "stream", 0, 0, OPTION_STREAM },
+    { "save-results", 1, 0, OPTION_SAVE_RESULTS },
+    { "load-results", 1, 0, OPTION_LOAD_RESULTS },
+    { "plan-out", 1, 0, OPTION_PLAN_OUT },
+    { "apply-plan", 1, 0, OPTION_APPLY_PLAN },
+    { "delete-threads", 1, 0, OPTION_DELETE_THREADS },
+    { "link", 0, 0, OPTION_LINK },
+    { "dedupe-extents", 0, 0, OPTION_DEDUPE_EXTENTS },
+    { "tree-hash", 2, 0, OPTION_TREE_HASH },
+    { "confirm-threads", 1, 0, OPTION_CONFIRM_THREADS },
+    { "prefix-stages", 1, 0, OPTION_PREFIX_STAGES },
+    { "sample", 0, 0, OPTION_SAMPLE },
+    { "resident-first", 0, 0, OPTION_RESIDENT_FIRST },
+    { "pipeline", 0, 0, OPTION_PIPELINE },
     { 0, 0, 0, 0 }
   };
 #define GETOPT getopt_long
@@ -1681,6 +3369,9 @@ int main(int argc, char **argv) {
 
   oldargv = cloneargs(argc, argv);
 
+  arena_init(&smallfiles, SMALL_FILE_MEMORY);
+  fdcache_init();
+
   while ((opt = GETOPT(argc, argv, "frRq1StsHG:L:nAdPvhNImMpo:il:Decx:"
 #ifdef HAVE_GETOPT_H
           , long_options, NULL
@@ -1791,8 +3482,138 @@ int main(int argc, char **argv) {
     case 'e':
       SETFLAG(flags, F_HEURISTIC);
       break;
-    case 'c':
-      SETFLAG(flags, F_CACHESIGNATURES);
+    case 'c':
+      SETFLAG(flags, F_CACHESIGNATURES);
+      break;
+    case OPTION_CACHE_PATH:
+      SETFLAG(flags, F_CACHESIGNATURES);
+#ifndef NO_SQLITE
+      cachefile = optarg;
+#endif
+      break;
+    case OPTION_XATTR_CACHE:
+      SETFLAG(flags, F_XATTRCACHE);
+      break;
+    case OPTION_EXPORT_MANIFEST:
+      exportmanifest = optarg;
+      break;
+    case OPTION_IMPORT_MANIFEST:
+      importmanifest = optarg;
+      break;
+    case OPTION_MERGE_MANIFEST:
+      mergemanifests = realloc(mergemanifests, sizeof(char*) * (mergemanifestcount + 1));
+      if (mergemanifests == 0)
+      {
+        errormsg("out of memory!\n");
+        exit(1);
+      }
+      mergemanifests[mergemanifestcount++] = optarg;
+      break;
+    case OPTION_ROOT:
+      manifestroot = optarg;
+      break;
+    case OPTION_CATALOG:
+      catalogfile = optarg;
+      break;
+    case OPTION_SET:
+      if (findset(optarg) == 0)
+      {
+        setnames = (char**) realloc(setnames, sizeof(char*) * (setcount + 1));
+        if (setnames == 0)
+        {
+          errormsg("out of memory!\n");
+          exit(1);
+        }
+        setnames[setcount++] = optarg;
+      }
+      break;
+    case OPTION_DELETE_SET:
+      deletesetname = optarg;
+      break;
+    case OPTION_SAVE_SNAPSHOT:
+      snapshotfile = optarg;
+      break;
+    case OPTION_SINCE:
+      sincefile = optarg;
+      break;
+    case OPTION_FORMAT:
+      if (!strcasecmp("text", optarg)) {
+        outputformat = OUTPUT_TEXT;
+      } else if (!strcasecmp("jsonl", optarg)) {
+        outputformat = OUTPUT_JSONL;
+      } else if (!strcasecmp("nul", optarg)) {
+        outputformat = OUTPUT_NUL;
+      } else {
+        errormsg("invalid value for --format: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPTION_STREAM:
+      streaming = 1;
+      break;
+    case OPTION_SAVE_RESULTS:
+      saveresultsfile = optarg;
+      break;
+    case OPTION_LOAD_RESULTS:
+      loadresultsfile = optarg;
+      break;
+    case OPTION_PLAN_OUT:
+      planoutfile = optarg;
+      break;
+    case OPTION_APPLY_PLAN:
+      applyplanfile = optarg;
+      break;
+    case OPTION_LINK:
+      SETFLAG(flags, F_LINKFILES);
+      break;
+    case OPTION_DEDUPE_EXTENTS:
+      dedupeextents = 1;
+      break;
+    case OPTION_TREE_HASH:
+      if (optarg == 0)
+      {
+        treehashthreads = treehash_defaultthreads();
+        break;
+      }
+
+      treehashthreads = strtol(optarg, &endptr, 10);
+      if (optarg[0] == '\0' || *endptr != '\0' || treehashthreads < 1 || treehashthreads > TREEHASH_MAX_THREADS)
+      {
+        errormsg("invalid value for --tree-hash: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPTION_CONFIRM_THREADS:
+      confirmthreads = strtol(optarg, &endptr, 10);
+      if (optarg[0] == '\0' || *endptr != '\0' || confirmthreads < 1 || confirmthreads > CONFIRM_MAX_THREADS)
+      {
+        errormsg("invalid value for --confirm-threads: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPTION_PREFIX_STAGES:
+      if (!parseprefixstages(optarg))
+      {
+        errormsg("invalid value for --prefix-stages: '%s'\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPTION_SAMPLE:
+      samplesignatures = 1;
+      break;
+    case OPTION_RESIDENT_FIRST:
+      residentfirst = 1;
+      break;
+    case OPTION_PIPELINE:
+      pipelined = 1;
+      break;
+    case OPTION_DELETE_THREADS:
+      deletethreads = strtol(optarg, &endptr, 10);
+      if (optarg[0] == '\0' || *endptr != '\0' || deletethreads < 1 || deletethreads > DELETION_MAX_THREADS)
+      {
+        errormsg("invalid value for --delete-threads: '%s'\n", optarg);
+        exit(1);
+      }
       break;
     case 'x':
       if (strcmp("cache.readonly", optarg) == 0)
@@ -1803,6 +3624,10 @@ int main(int argc, char **argv) {
         SETFLAG(flags, F_CLEARCACHE);
       else if (strcmp("cache.vacuum", optarg) == 0)
         SETFLAG(flags, F_VACUUMCACHE);
+      else if (strcmp("cache.confirmations", optarg) == 0)
+        SETFLAG(flags, F_CACHECONFIRMATIONS);
+      else if (strcmp("cache.blocks", optarg) == 0)
+        SETFLAG(flags, F_BLOCKHASHES);
       else {
         errormsg("unrecognized option '-x %s'\n", optarg);
         fprintf(stderr, "Try `fdupes --help' for more information.\n");
@@ -1815,18 +3640,147 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (optind >= argc && !(ISFLAG(flags, F_CLEARCACHE) || ISFLAG(flags, F_PRUNECACHE) || ISFLAG(flags, F_VACUUMCACHE))) {
+  if (optind >= argc && !(ISFLAG(flags, F_CLEARCACHE) || ISFLAG(flags, F_PRUNECACHE) || ISFLAG(flags, F_VACUUMCACHE) ||
+      exportmanifest != 0 || importmanifest != 0 || loadresultsfile != 0 || applyplanfile != 0)) {
     errormsg("no directories specified\n");
     exit(1);
   }
 
+  if (loadresultsfile != 0)
+  {
+    if (optind < argc) {
+      errormsg("directories may not be given with --load-results\n");
+      exit(1);
+    }
+
+    if (ISFLAG(flags, F_IMMEDIATE) || streaming || catalogfile != 0 || setcount > 0) {
+      errormsg("option --load-results is not compatible with --immediate, --stream, --catalog or --set\n");
+      exit(1);
+    }
+  }
+
+  if (saveresultsfile != 0 && (ISFLAG(flags, F_IMMEDIATE) || streaming)) {
+    errormsg("option --save-results is not compatible with --immediate or --stream\n");
+    exit(1);
+  }
+
+  if (applyplanfile != 0)
+  {
+    if (optind < argc) {
+      errormsg("directories may not be given with --apply-plan\n");
+      exit(1);
+    }
+
+    if (ISFLAG(flags, F_DELETEFILES) || planoutfile != 0 || loadresultsfile != 0 || saveresultsfile != 0 ||
+        catalogfile != 0 || setcount > 0) {
+      errormsg("option --apply-plan is not compatible with --delete, --plan-out, --load-results,\n"
+               "--save-results, --catalog or --set\n");
+      exit(1);
+    }
+
+    /* carry out the plan's decisions as --delete --noprompt would */
+    SETFLAG(flags, F_DELETEFILES);
+    SETFLAG(flags, F_NOPROMPT);
+  }
+
+  if (deletethreads > 1 && (!ISFLAG(flags, F_DELETEFILES) || !ISFLAG(flags, F_NOPROMPT) || ISFLAG(flags, F_IMMEDIATE))) {
+    errormsg("--delete-threads only works with --delete and --noprompt, without --immediate\n");
+    exit(1);
+  }
+
+  if (treehashthreads > 0 && (ISFLAG(flags, F_HEURISTIC) || ISFLAG(flags, F_BLOCKHASHES) || catalogfile != 0)) {
+    errormsg("option --tree-hash is not compatible with --heuristic, -xcache.blocks or --catalog\n");
+    exit(1);
+  }
+
+  if (pipelined && (ISFLAG(flags, F_RECURSEAFTER) || setcount > 0 || streaming || residentfirst || catalogfile != 0 ||
+      loadresultsfile != 0 || applyplanfile != 0)) {
+    errormsg("option --pipeline is not compatible with -R, --set, --stream, --resident-first,\n"
+             "--catalog, --load-results or --apply-plan\n");
+    exit(1);
+  }
+
+#ifndef HAVE_PTHREAD
+  if (deletethreads > 1 || treehashthreads > 1 || confirmthreads > 1 || pipelined) {
+    errormsg("threads are not supported in this fdupes build\n");
+    exit(1);
+  }
+#endif
+
+  if (ISFLAG(flags, F_LINKFILES) && (!ISFLAG(flags, F_DELETEFILES) || planoutfile != 0)) {
+    errormsg("--link only works with --delete or --apply-plan, without --plan-out\n");
+    exit(1);
+  }
+
+  if (dedupeextents)
+  {
+    if (ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_SUMMARIZEMATCHES) || streaming || outputformat != OUTPUT_TEXT ||
+        catalogfile != 0 || sincefile != 0) {
+      errormsg("option --dedupe-extents is not compatible with --delete, --apply-plan, --summarize,\n"
+               "--stream, --format, --catalog or --since\n");
+      exit(1);
+    }
+
+    if (!dedupe_supported()) {
+      errormsg("sharing extents is not supported in this fdupes build\n");
+      exit(1);
+    }
+  }
+
+  if (planoutfile != 0)
+  {
+    if (!ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_IMMEDIATE)) {
+      errormsg("--plan-out only works with --delete, without --immediate\n");
+      exit(1);
+    }
+
+    /* decisions made in screen mode are carried out as they are made */
+    if (!ISFLAG(flags, F_NOPROMPT))
+      SETFLAG(flags, F_PLAINPROMPT);
+  }
+
+#ifndef HAVE_SYS_XATTR_H
+  if (ISFLAG(flags, F_XATTRCACHE)) {
+    errormsg("extended attributes are not supported in this fdupes build\n");
+    exit(1);
+  }
+#endif
+
+  if (mergemanifestcount > 0 && exportmanifest == 0) {
+    errormsg("--merge-manifest must be accompanied by --export-manifest option\n");
+    exit(1);
+  }
+
+  /* merging manifests does not involve the cache, so needs no root */
+  if ((importmanifest != 0 || (exportmanifest != 0 && mergemanifestcount == 0)) && manifestroot == 0) {
+    errormsg("--import-manifest and --export-manifest require the --root option\n");
+    exit(1);
+  }
+
+  if (manifestroot != 0 && importmanifest == 0 && exportmanifest == 0) {
+    errormsg("--root must be accompanied by --import-manifest or --export-manifest option\n");
+    exit(1);
+  }
+
+  if (importmanifest != 0 && ISFLAG(flags, F_READONLYCACHE)) {
+    errormsg("--import-manifest cannot be used with a read-only cache\n");
+    exit(1);
+  }
+
+  if (importmanifest != 0 || (exportmanifest != 0 && mergemanifestcount == 0))
+    SETFLAG(flags, F_CACHESIGNATURES);
+
 #ifdef NO_SQLITE
   if (
+      exportmanifest != 0 ||
+      importmanifest != 0 ||
       ISFLAG(flags, F_CACHESIGNATURES) ||
       ISFLAG(flags, F_CLEARCACHE) ||
       ISFLAG(flags, F_PRUNECACHE) ||
-      ISFLAG(flags, F_READONLYCACHE) ||
-      ISFLAG(flags, F_VACUUMCACHE)
+      (ISFLAG(flags, F_READONLYCACHE) && !ISFLAG(flags, F_XATTRCACHE)) ||
+      ISFLAG(flags, F_VACUUMCACHE) ||
+      ISFLAG(flags, F_CACHECONFIRMATIONS) ||
+      ISFLAG(flags, F_BLOCKHASHES)
   ) {
     errormsg("file signature database is not supported in this fdupes build\n");
     exit(1);
@@ -1836,8 +3790,10 @@ int main(int argc, char **argv) {
     if (
       ISFLAG(flags, F_CLEARCACHE) ||
       ISFLAG(flags, F_PRUNECACHE) ||
-      ISFLAG(flags, F_READONLYCACHE) ||
-      ISFLAG(flags, F_VACUUMCACHE)
+      (ISFLAG(flags, F_READONLYCACHE) && !ISFLAG(flags, F_XATTRCACHE)) ||
+      ISFLAG(flags, F_VACUUMCACHE) ||
+      ISFLAG(flags, F_CACHECONFIRMATIONS) ||
+      ISFLAG(flags, F_BLOCKHASHES)
     ) {
       errormsg("-xcache parameters must be accompanied by --cache option\n");
       exit(1);
@@ -1855,13 +3811,86 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
-  if (ISFLAG(flags, F_DEFERCONFIRMATION) && (!ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_NOPROMPT)))
+  /* cataloged files cannot be read, so can be neither confirmed nor
+     offered for deletion, and must be compared by their exact digest */
+  if (catalogfile != 0)
+  {
+    if (ISFLAG(flags, F_DELETEFILES) && !ISFLAG(flags, F_NOPROMPT)) {
+      errormsg("--catalog only works with --delete when --noprompt is also given\n");
+      exit(1);
+    }
+
+    if (ISFLAG(flags, F_HEURISTIC)) {
+      errormsg("options --catalog and --heuristic are not compatible\n");
+      exit(1);
+    }
+  }
+
+  if (setcount > 0)
+  {
+    if (setcount < 2) {
+      errormsg("--set must be given at least twice, with different names\n");
+      exit(1);
+    }
+
+    if (catalogfile != 0) {
+      errormsg("options --set and --catalog are not compatible\n");
+      exit(1);
+    }
+
+    dirsets = assignsets(argc, oldargv, argv, optind);
+
+    for (x = optind; x < argc; x++)
+    {
+      if (dirsets[x] == 0) {
+        errormsg("directory %s does not follow a --set option\n", argv[x]);
+        exit(1);
+      }
+    }
+  }
+
+  if (deletesetname != 0)
+  {
+    deleteset = findset(deletesetname);
+    if (deleteset == 0) {
+      errormsg("--delete-set names no set given by --set: '%s'\n", deletesetname);
+      exit(1);
+    }
+
+    if (!ISFLAG(flags, F_DELETEFILES) || !ISFLAG(flags, F_NOPROMPT) || ISFLAG(flags, F_IMMEDIATE)) {
+      errormsg("--delete-set only works with --delete and --noprompt, without --immediate\n");
+      exit(1);
+    }
+  }
+
+  if ((outputformat != OUTPUT_TEXT || streaming) &&
+      (ISFLAG(flags, F_DELETEFILES) || ISFLAG(flags, F_SUMMARIZEMATCHES) || sincefile != 0)) {
+    errormsg("options --format and --stream only apply to plain lists of matches\n");
+    exit(1);
+  }
+
+  if (streaming && (catalogfile != 0 || snapshotfile != 0)) {
+    errormsg("option --stream is not compatible with --catalog or --save-snapshot\n");
+    exit(1);
+  }
+
+  if ((snapshotfile != 0 || sincefile != 0) && ISFLAG(flags, F_DELETEFILES)) {
+    errormsg("options --save-snapshot and --since are not compatible with --delete\n");
+    exit(1);
+  }
+
+  if (sincefile != 0 && ISFLAG(flags, F_SUMMARIZEMATCHES)) {
+    errormsg("options --since and --summarize are not compatible\n");
+    exit(1);
+  }
+
+  if (ISFLAG(flags, F_DEFERCONFIRMATION) && (!ISFLAG(flags, F_DELETEFILES) || (ISFLAG(flags, F_NOPROMPT) && applyplanfile == 0)))
   {
-    errormsg("--deferconfirmation only works with interactive deletion modes\n");
+    errormsg("--deferconfirmation only works with interactive deletion modes and --apply-plan\n");
     exit(1);
   }
 
-  if (!ISFLAG(flags, F_DELETEFILES)) {
+  if (!ISFLAG(flags, F_DELETEFILES) || planoutfile != 0) {
     logfile = 0;
     loginfo = 0;
   }
@@ -1890,43 +3919,61 @@ int main(int argc, char **argv) {
 
 #ifndef NO_SQLITE
   if (ISFLAG(flags, F_CACHESIGNATURES)) {
-    cachehome = getcachehome(1);
-    if (cachehome == 0)
-    {
-      errormsg("could not open cache directory.\n");
-      exit(1);
+    if (cachefile != 0) {
+      cachepath = strdup(cachefile);
+      if (cachepath == 0)
+      {
+        errormsg("out of memory!\n");
+        exit(1);
+      }
     }
+    else {
+      cachehome = getcachehome(1);
+      if (cachehome == 0)
+      {
+        errormsg("could not open cache directory.\n");
+        exit(1);
+      }
+
+      cachepath = malloc(strlen(cachehome) + strlen(FDUPES_DATABASE_DIRECTORY) + 2);
+      if (cachepath == 0)
+      {
+        free(cachehome);
+        errormsg("could not open cache directory.\n");
+        exit(1);
+      }
+
+      strcpy(cachepath, cachehome);
+      strcat(cachepath, "/");
+      strcat(cachepath, FDUPES_CACHE_DIRECTORY);
+
+      mkdir(cachepath, FDUPES_CACHE_DIRECTORY_PERMISSIONS);
+
+      strcpy(cachepath, cachehome);
+      strcat(cachepath, "/");
+      strcat(cachepath, FDUPES_DATABASE_DIRECTORY);
 
-    cachepath = malloc(strlen(cachehome) + strlen(FDUPES_DATABASE_DIRECTORY) + 2);
-    if (cachepath == 0)
-    {
       free(cachehome);
-      errormsg("could not open cache directory.\n");
-      exit(1);
     }
 
-    strcpy(cachepath, cachehome);
-    strcat(cachepath, "/");
-    strcat(cachepath, FDUPES_CACHE_DIRECTORY);
-
-    mkdir(cachepath, FDUPES_CACHE_DIRECTORY_PERMISSIONS);
+    /* runs that never write to the cache use a read-only connection
+       when possible, so that they never contend for write locks */
+    db = 0;
+    if (ISFLAG(flags, F_READONLYCACHE) && !ISFLAG(flags, F_CLEARCACHE) && !ISFLAG(flags, F_PRUNECACHE) && !ISFLAG(flags, F_VACUUMCACHE))
+      db = hashdb_open(cachepath, 1);
 
-    strcpy(cachepath, cachehome);
-    strcat(cachepath, "/");
-    strcat(cachepath, FDUPES_DATABASE_DIRECTORY);
+    if (db == 0)
+      db = hashdb_open(cachepath, 0);
 
-    db = hashdb_open(cachepath);
     if (db == 0)
     {
       errormsg("could not open hash database at %s\n", cachepath);
-      free(cachehome);
       free(cachepath);
       exit(1);
     }
 
     atexit(close_db_on_exit);
 
-    free(cachehome);
     free(cachepath);
   }
   else {
@@ -1943,12 +3990,66 @@ int main(int argc, char **argv) {
       hashdb_foreachdirectory(db, 0, delist_directory_if_missing);
       hashdb_foreachhash(db, 0, delist_hash_if_orphaned);
     }
+
+    /* keep write transactions short while scanning, so that other
+       processes sharing the cache aren't kept waiting */
+    hashdb_committransaction(db);
+
+    if (importmanifest != 0 && !manifest_import(db, manifestroot, importmanifest))
+    {
+      errormsg("could not import manifest %s\n", importmanifest);
+      exit(1);
+    }
+
+    if (exportmanifest != 0 && mergemanifestcount == 0 && !manifest_export(db, manifestroot, exportmanifest))
+    {
+      errormsg("could not export manifest to %s\n", exportmanifest);
+      exit(1);
+    }
+  }
+
+  if (mergemanifestcount > 0)
+  {
+    if (!manifest_merge(mergemanifests, mergemanifestcount, exportmanifest))
+    {
+      errormsg("could not export manifest to %s\n", exportmanifest);
+      exit(1);
+    }
+
+    free(mergemanifests);
   }
 #endif
 
+  if (catalogfile != 0 && !catalog_load(catalogfile))
+    exit(1);
+
+  if (loadresultsfile != 0 && !results_load(loadresultsfile, &files))
+  {
+    errormsg("could not read results file %s\n", loadresultsfile);
+    exit(1);
+  }
+
+  if (applyplanfile != 0)
+  {
+    if (!plan_load(applyplanfile, &files))
+      exit(1);
+
+    applyingplan = 1;
+  }
+
   register_sigint_handler();
 
-  if (ISFLAG(flags, F_RECURSEAFTER)) {
+  if (pipelined) {
+    traversal.dirs = argv + optind;
+    traversal.count = argc - optind;
+    traversal.logfile_status = logfile ? &logfile_status : 0;
+
+    queue = filequeue_start(traverse, &traversal, PIPELINE_QUEUE_SIZE);
+    if (queue == 0) {
+      errormsg("could not start listing files\n");
+      exit(1);
+    }
+  } else if (ISFLAG(flags, F_RECURSEAFTER)) {
     firstrecurse = nonoptafter("--recurse:", argc, oldargv, argv, optind, &foundoption);
 
     if (!foundoption)
@@ -1965,25 +4066,51 @@ int main(int argc, char **argv) {
     }
 
     /* F_RECURSE is not set for directories before --recurse: */
-    for (x = optind; x < firstrecurse; x++)
+    for (x = optind; x < firstrecurse; x++) {
+      scanset = dirsets != 0 ? dirsets[x] : 0;
       filecount += grokdir(argv[x], &files, logfile ? &logfile_status : 0);
+    }
 
     /* Set F_RECURSE for directories after --recurse: */
     SETFLAG(flags, F_RECURSE);
 
-    for (x = firstrecurse; x < argc; x++)
+    for (x = firstrecurse; x < argc; x++) {
+      scanset = dirsets != 0 ? dirsets[x] : 0;
       filecount += grokdir(argv[x], &files, logfile ? &logfile_status : 0);
+    }
   } else {
-    for (x = optind; x < argc; x++)
+    for (x = optind; x < argc; x++) {
+      scanset = dirsets != 0 ? dirsets[x] : 0;
       filecount += grokdir(argv[x], &files, logfile ? &logfile_status : 0);
+    }
   }
 
-  if (!files) {
+  /* with --set, only files that may match a file in another set matter */
+  if (setcount > 0)
+    files = crosssetcandidates(files, &filecount);
+
+  /* files sharing all their extents are matched without being read */
+  if (catalogfile == 0 && loadresultsfile == 0 && applyplanfile == 0 && !pipelined)
+    findsharedextents(files);
+
+  if (residentfirst && catalogfile == 0 && loadresultsfile == 0 && applyplanfile == 0)
+    files = scheduleresidentfirst(files);
+
+  if (!files && !pipelined) {
     if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%40s\r", " ");
     exit(0);
   }
 
-  curfile = files;
+  output_open(outputformat);
+
+  if (streaming)
+    trackbuckets(files);
+
+  /* loaded results and plans have been matched already */
+  if (pipelined)
+    files = curfile = nextqueuedfile(queue, 0);
+  else
+    curfile = loadresultsfile == 0 && applyplanfile == 0 ? files : NULL;
 
   while (curfile) {
     if (got_sigint) {
@@ -1991,48 +4118,66 @@ int main(int argc, char **argv) {
       exit(0);
     }
 
-    if (!checktree) 
+    if (catalogfile != 0)
+      matchcatalog(curfile);
+    else if (!checktree)
       registerfile(&checktree, curfile);
     else 
       match = checkmatch(&checktree, checktree, curfile);
 
     if (match != NULL) {
-      file1 = fopen(curfile->d_name, "rb");
-      if (!file1) {
-	curfile = curfile->next;
-	continue;
-      }
-      
-      file2 = fopen((*match)->d_name, "rb");
-      if (!file2) {
-	fclose(file1);
-	curfile = curfile->next;
-	continue;
-      }
-
       if (ISFLAG(flags, F_DELETEFILES) && ISFLAG(flags, F_IMMEDIATE))
       {
-          deletesuccessor(match, curfile, confirmmatch(file1, file2),
+        ismatch = confirmfiles(curfile, *match);
+
+        /* either file may be deleted, and should not be held open */
+        fdcache_forget(curfile);
+        fdcache_forget(*match);
+
+        if (ismatch != -1)
+          deletesuccessor(match, curfile, ismatch,
               ordertype == ORDER_MTIME ? sort_pairs_by_mtime :
               ordertype == ORDER_CTIME ? sort_pairs_by_ctime :
                                          sort_pairs_by_filename, loginfo );
       }
-      else if (ISFLAG(flags, F_DEFERCONFIRMATION) || ISFLAG(flags, F_QUICKSUMMARY) || confirmmatch(file1, file2))
+      else if (isreadable(curfile) && isreadable(*match) &&
+          (ISFLAG(flags, F_DEFERCONFIRMATION) || ISFLAG(flags, F_QUICKSUMMARY) || dedupeextents ||
+          (!ISFLAG(flags, F_DELETEFILES) && sharesextentswithset(curfile, *match)) || confirmfiles(curfile, *match) == 1))
+      {
+        newgroup = !(*match)->hasdupes;
+
         registerpair(match, curfile,
             ordertype == ORDER_MTIME ? sort_pairs_by_mtime :
             ordertype == ORDER_CTIME ? sort_pairs_by_ctime :
                                        sort_pairs_by_filename );
 
-      fclose(file1);
-      fclose(file2);
+        if (streaming && newgroup)
+          trackgroup(match);
+      }
+    }
+
+    /* write out complete sets of matches at most once in a while */
+    if (streaming)
+    {
+      if (emitfinalgroups(curfile))
+        unflushed = 1;
+
+      if (unflushed && now64() - last_flush > FDUPES_PROGRESS_REFRESH_MS)
+      {
+        output_flush();
+        last_flush = now64();
+        unflushed = 0;
+      }
     }
 
-    curfile = curfile->next;
+    curfile = pipelined ? nextqueuedfile(queue, curfile) : curfile->next;
 
     if (!ISFLAG(flags, F_HIDEPROGRESS)) {
       now = now64();
       if ( now - last_progress > FDUPES_PROGRESS_REFRESH_MS ) {
         last_progress = now;
+        if (pipelined)
+          filecount = filequeue_pushed(queue);
         fprintf(stderr, "\rProgress [%d/%d] %d%% ", progress, filecount,
          (int)((float) progress / (float) filecount * 100.0));
       }
@@ -2040,24 +4185,64 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (pipelined)
+  {
+    filecount = filequeue_pushed(queue);
+    filequeue_finish(queue);
+
+    /* traversal returns early once interrupted */
+    if (got_sigint) {
+      printf("\n");
+      exit(0);
+    }
+
+    if (!files) {
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%40s\r", " ");
+      exit(0);
+    }
+  }
+
+  /* files matched are about to be deleted, linked or deduplicated */
+  fdcache_stop();
+
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%40s\r", " ");
 
+  if (ISFLAG(flags, F_IMMEDIATE))
+    deletion_finish();
+
   if (loginfo != 0)
   {
     log_close(loginfo);
     loginfo = 0;
   }
 
-#ifndef NO_SQLITE
-  if (db != 0)
-    hashdb_committransaction(db);
-#endif
+  if (setcount > 0)
+    dropsinglesetgroups(files);
+
+  /* in catalog mode, each set of matches is headed by a cataloged file */
+  results = catalogfile != 0 ? catalog_references() : files;
+
+  if (saveresultsfile != 0 && !results_save(results, saveresultsfile))
+  {
+    errormsg("could not save results to %s\n", saveresultsfile);
+    exit(1);
+  }
+
+  if (planoutfile != 0)
+  {
+    planout = plan_create(planoutfile);
+    if (planout == 0)
+    {
+      errormsg("could not create deletion plan %s\n", planoutfile);
+      exit(1);
+    }
+  }
 
   if (ISFLAG(flags, F_DELETEFILES))
   {
     if (ISFLAG(flags, F_NOPROMPT) || ISFLAG(flags, F_IMMEDIATE))
     {
-      deletefiles(files, 0, 0, logfile);
+      deletefiles(results, 0, 0, logfile);
     }
     else
     {
@@ -2066,7 +4251,14 @@ int main(int argc, char **argv) {
       {
         if (newterm(getenv("TERM"), stdout, stdin) != 0)
         {
-          deletefiles_ncurses(files, logfile);
+          deletefiles_ncurses(results, logfile);
+
+          /* keep the actions chosen, for review to resume later */
+          if (saveresultsfile != 0 && !results_save(results, saveresultsfile))
+          {
+            errormsg("could not save results to %s\n", saveresultsfile);
+            exit(1);
+          }
         }
         else
         {
@@ -2083,7 +4275,7 @@ int main(int argc, char **argv) {
           exit(1);
         }
 
-        deletefiles(files, 1, stdin, logfile);
+        deletefiles(results, 1, stdin, logfile);
       }
 #else
       if (freopen("/dev/tty", "r", stdin) == NULL)
@@ -2092,25 +4284,72 @@ int main(int argc, char **argv) {
         exit(1);
       }
 
-      deletefiles(files, 1, stdin, logfile);
+      deletefiles(results, 1, stdin, logfile);
 #endif
     }
+
+    if (planout != 0 && !plan_finish(planout))
+    {
+      errormsg("could not write deletion plan %s\n", planoutfile);
+      exit(1);
+    }
+  }
+
+  else if (dedupeextents)
+    dedupefiles(results);
+
+  else if (snapshotfile != 0 || sincefile != 0)
+  {
+    signsets(results);
+    snapshot = snapshot_fromfiles(results);
+
+    if (sincefile != 0)
+    {
+      /* with no earlier snapshot, everything is new */
+      previoussnapshot = snapshot_load(sincefile);
+      if (previoussnapshot == 0 && access(sincefile, F_OK) == 0)
+      {
+        errormsg("could not read snapshot %s\n", sincefile);
+        exit(1);
+      }
+
+      if (previoussnapshot == 0)
+        previoussnapshot = snapshot_fromfiles(NULL);
+
+      snapshot_printdelta(previoussnapshot, snapshot);
+
+      snapshot_free(previoussnapshot);
+    }
+    else if (ISFLAG(flags, F_SUMMARIZEMATCHES))
+      summarizematches(results);
+    else
+      printmatches(results);
+
+    if (snapshotfile != 0 && !snapshot_save(snapshot, snapshotfile))
+    {
+      errormsg("could not save snapshot to %s\n", snapshotfile);
+      exit(1);
+    }
+
+    snapshot_free(snapshot);
   }
 
   else 
 
     if (ISFLAG(flags, F_SUMMARIZEMATCHES))
-      summarizematches(files);
+      summarizematches(results);
       
-    else
+    else if (!streaming)
 
-      printmatches(files);
+      printmatches(results);
 
   while (files) {
     curfile = files->next;
     free(files->d_name);
     free(files->crcsignature);
     free(files->crcpartial);
+    freeprefixsignatures(files);
+    free(files->crcsample);
     free(files);
     files = curfile;
   }
@@ -2118,9 +4357,15 @@ int main(int argc, char **argv) {
   for (x = 0; x < argc; x++)
     free(oldargv[x]);
 
+  arena_free(&smallfiles);
+
+  free(dirsets);
+  free(setnames);
+
   free(oldargv);
 
-  purgetree(checktree);
+  if (checktree != NULL)
+    purgetree(checktree);
 
   return 0;
 }
@@ -26,11 +26,20 @@
 #include <sys/stat.h>
 #include "md5/md5.h"
 
+#define ONE_MB ((off_t)1048576)
+#define HEURISTIC_BLOCK ONE_MB
+#define HEURISTIC_LIMIT (3 * ONE_MB)
+#define HEURISTIC_INTERVAL (50 * ONE_MB)
+
 typedef struct _file {
   char *d_name;
   off_t size;
   md5_byte_t *crcpartial;
   md5_byte_t *crcsignature;
+  md5_byte_t **crcstages; /* signatures of the prefixes given by --prefix-stages */
+  md5_byte_t *crcsample; /* signature of blocks sampled with --sample */
+  unsigned char *content; /* contents of a small file, if kept in memory */
+  int fdslot; /* slot of the file's descriptor in the descriptor cache */
   dev_t device;
   ino_t inode;
   time_t mtime;
@@ -38,6 +47,9 @@ typedef struct _file {
   long mtime_nsec;
   long ctime_nsec;
   int hasdupes; /* true only if file is first on duplicate chain */
+  int set; /* set of roots the file was found under, if --set is used */
+  int action; /* action chosen for the file in interactive mode */
+  struct _file *sharedwith; /* first of the files sharing all its extents, if any */
   struct _file *duplicates;
   struct _file *next;
 } file_t;
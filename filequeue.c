@@ -0,0 +1,192 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include "filequeue.h"
+#include "errormsg.h"
+
+/* A file queue carries file records from a producer, running in a
+   thread of its own, to the thread popping them, so that files found
+   while listing directories can be matched while listing goes on. The
+   queue holds at most capacity records; the producer waits for room
+   once it is full, so listing never runs far ahead of matching. */
+
+struct filequeue
+{
+  file_t **files; /* ring of files pushed but not yet popped */
+  int capacity;
+  int head;       /* next file to pop */
+  int count;      /* files waiting to be popped */
+  int pushed;     /* files pushed in all */
+  int closed;     /* set once the producer has returned */
+  void (*producer)(struct filequeue *queue, void *arg);
+  void *arg;
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t notfull;
+  pthread_cond_t notempty;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+static void *filequeue__produce(void *arg)
+{
+  struct filequeue *queue = (struct filequeue*) arg;
+
+  queue->producer(queue, queue->arg);
+
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_signal(&queue->notempty);
+  pthread_mutex_unlock(&queue->lock);
+
+  return 0;
+}
+#endif
+
+/* Start producer in a thread of its own, passing it arg and the queue
+   to push files to. Returns 0 if no thread could be started. */
+struct filequeue *filequeue_start(void (*producer)(struct filequeue *queue, void *arg), void *arg, int capacity)
+{
+#ifdef HAVE_PTHREAD
+  struct filequeue *queue;
+
+  queue = (struct filequeue*) malloc(sizeof(struct filequeue));
+  if (queue == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  queue->files = (file_t**) malloc(sizeof(file_t*) * capacity);
+  if (queue->files == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->count = 0;
+  queue->pushed = 0;
+  queue->closed = 0;
+  queue->producer = producer;
+  queue->arg = arg;
+
+  pthread_mutex_init(&queue->lock, 0);
+  pthread_cond_init(&queue->notfull, 0);
+  pthread_cond_init(&queue->notempty, 0);
+
+  if (pthread_create(&queue->thread, 0, filequeue__produce, queue) != 0)
+  {
+    pthread_cond_destroy(&queue->notempty);
+    pthread_cond_destroy(&queue->notfull);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->files);
+    free(queue);
+    return 0;
+  }
+
+  return queue;
+#else
+  return 0;
+#endif
+}
+
+/* Add file to the queue, waiting for room if the queue is full. */
+void filequeue_push(struct filequeue *queue, file_t *file)
+{
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&queue->lock);
+
+  while (queue->count == queue->capacity)
+    pthread_cond_wait(&queue->notfull, &queue->lock);
+
+  queue->files[(queue->head + queue->count) % queue->capacity] = file;
+  ++queue->count;
+  ++queue->pushed;
+
+  pthread_cond_signal(&queue->notempty);
+  pthread_mutex_unlock(&queue->lock);
+#endif
+}
+
+/* Take the oldest file from the queue, waiting for one to be pushed if
+   the queue is empty. Returns 0 once the producer has returned and all
+   files it pushed have been popped. */
+file_t *filequeue_pop(struct filequeue *queue)
+{
+  file_t *file = 0;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&queue->lock);
+
+  while (queue->count == 0 && !queue->closed)
+    pthread_cond_wait(&queue->notempty, &queue->lock);
+
+  if (queue->count > 0)
+  {
+    file = queue->files[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->count;
+
+    pthread_cond_signal(&queue->notfull);
+  }
+
+  pthread_mutex_unlock(&queue->lock);
+#endif
+
+  return file;
+}
+
+/* Return the number of files pushed so far. */
+int filequeue_pushed(struct filequeue *queue)
+{
+  int pushed = 0;
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&queue->lock);
+  pushed = queue->pushed;
+  pthread_mutex_unlock(&queue->lock);
+#endif
+
+  return pushed;
+}
+
+/* Wait for the producer to return, then free the queue. */
+void filequeue_finish(struct filequeue *queue)
+{
+#ifdef HAVE_PTHREAD
+  pthread_join(queue->thread, 0);
+
+  pthread_cond_destroy(&queue->notempty);
+  pthread_cond_destroy(&queue->notfull);
+  pthread_mutex_destroy(&queue->lock);
+#endif
+
+  free(queue->files);
+  free(queue);
+}
@@ -31,6 +31,10 @@
 #define F_QUICKSUMMARY     0x1000000
 #define F_HEURISTIC        0x2000000
 #define F_NOCONFIRMATION   0x4000000
+#define F_CACHECONFIRMATIONS 0x8000000
+#define F_BLOCKHASHES      0x10000000
+#define F_XATTRCACHE       0x20000000
+#define F_LINKFILES        0x40000000
 
 extern unsigned long flags;
 
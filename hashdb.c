@@ -25,24 +25,24 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <time.h>
 #include "hashdb.h"
 #include "getrealpath.h"
 #include "sbasename.h"
 #include "sdirname.h"
 #include "errormsg.h"
+#include "sigint.h"
 
-#define DATABASE_VERSION 1
-
-#define HASH_FUNCTION_MD5 1
-
-#define HASH_FUNCTION HASH_FUNCTION_MD5
-#define HASH_FUNCTION_OUTPUT_LENGTH 16
+#define DATABASE_VERSION 6
 
 void md5copy(md5_byte_t *to, const md5_byte_t *from);
 
+int hashdb__getdatabaseversion(sqlite3 *db, int *version);
+int hashdb__setdatabaseversion(sqlite3 *db, int version);
+
 #define PREPARE_STATEMENT(a, b) sqlite3_prepare_v2(db, a, -1, hashdb__newstatement(&b), 0)
 
-#define HASHDB_MAX_STATEMENTS 32
+#define HASHDB_MAX_STATEMENTS 48
 
 sqlite3_stmt **hashdb_statements[HASHDB_MAX_STATEMENTS];
 
@@ -64,6 +64,29 @@ sqlite3_stmt *query_deletehash = 0;
 sqlite3_stmt *query_deletehashforpath = 0;
 sqlite3_stmt *query_foreachhash = 0;
 sqlite3_stmt *query_foreachhashwithin = 0;
+sqlite3_stmt *query_foreachsignature = 0;
+sqlite3_stmt *query_loadconfirmation = 0;
+sqlite3_stmt *query_saveconfirmation = 0;
+sqlite3_stmt *query_newconfirmationgroup = 0;
+sqlite3_stmt *query_mergeconfirmationgroups = 0;
+sqlite3_stmt *query_deleteconfirmation = 0;
+sqlite3_stmt *query_deleteconfirmationforpath = 0;
+sqlite3_stmt *query_loadblocks = 0;
+sqlite3_stmt *query_saveblocks = 0;
+sqlite3_stmt *query_deleteblocks = 0;
+sqlite3_stmt *query_deleteblocksforpath = 0;
+sqlite3_stmt *query_loadheuristichash = 0;
+sqlite3_stmt *query_saveheuristichash = 0;
+sqlite3_stmt *query_deleteheuristichash = 0;
+sqlite3_stmt *query_deleteheuristichashforpath = 0;
+sqlite3_stmt *query_loadprefixhash = 0;
+sqlite3_stmt *query_saveprefixhash = 0;
+sqlite3_stmt *query_deleteprefixhashes = 0;
+sqlite3_stmt *query_deleteprefixhashesforpath = 0;
+sqlite3_stmt *query_loadsamplehash = 0;
+sqlite3_stmt *query_savesamplehash = 0;
+sqlite3_stmt *query_deletesamplehash = 0;
+sqlite3_stmt *query_deletesamplehashforpath = 0;
 
 sqlite3_stmt **hashdb__newstatement(sqlite3_stmt **statement)
 {
@@ -120,12 +143,176 @@ int hashdb__createtables(sqlite3 *db)
   return SQLITE_OK;
 }
 
+/* Bring a database created by an older version of fdupes up to date.
+   The version is read again once the database is locked for writing, in
+   case another process has upgraded it in the meantime. */
+int hashdb__upgradetables(sqlite3 *db)
+{
+  int result;
+  int version;
+  char query[128];
+
+  result = sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = hashdb__getdatabaseversion(db, &version);
+  if (result != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    return result;
+  }
+
+  if (version >= DATABASE_VERSION)
+    return sqlite3_exec(db, "COMMIT", 0, 0, 0);
+
+  if (version < 2) {
+    result = sqlite3_exec(db,
+      "CREATE TABLE IF NOT EXISTS confirmations ("
+      "  directory_id INTEGER REFERENCES directories(id) ON DELETE CASCADE,"
+      "  filename TEXT,"
+      "  device BLOB,"
+      "  inode BLOB,"
+      "  size INTEGER,"
+      "  ctime BLOB,"
+      "  mtime BLOB,"
+      "  ctime_nsec INTEGER,"
+      "  mtime_nsec INTEGER,"
+      "  group_id INTEGER,"
+      "  PRIMARY KEY (directory_id, filename)"
+      ")",
+      0, 0, 0);
+
+    if (result == SQLITE_OK)
+      result = sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS confirmations_group_id ON confirmations (group_id)", 0, 0, 0);
+
+    if (result != SQLITE_OK) {
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+      return result;
+    }
+  }
+
+  if (version < 3) {
+    result = sqlite3_exec(db,
+      "CREATE TABLE IF NOT EXISTS blocks ("
+      "  directory_id INTEGER REFERENCES directories(id) ON DELETE CASCADE,"
+      "  filename TEXT,"
+      "  inode BLOB,"
+      "  size INTEGER,"
+      "  ctime BLOB,"
+      "  mtime BLOB,"
+      "  ctime_nsec INTEGER,"
+      "  mtime_nsec INTEGER,"
+      "  block_size INTEGER,"
+      "  digests BLOB,"
+      "  root BLOB,"
+      "  state BLOB,"
+      "  hash_function INTEGER,"
+      "  PRIMARY KEY (directory_id, filename)"
+      ")",
+      0, 0, 0);
+
+    if (result != SQLITE_OK) {
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+      return result;
+    }
+  }
+
+  if (version < 4) {
+    result = sqlite3_exec(db,
+      "CREATE TABLE IF NOT EXISTS heuristic_hashes ("
+      "  directory_id INTEGER REFERENCES directories(id) ON DELETE CASCADE,"
+      "  filename TEXT,"
+      "  inode BLOB,"
+      "  size INTEGER,"
+      "  ctime BLOB,"
+      "  mtime BLOB,"
+      "  ctime_nsec INTEGER,"
+      "  mtime_nsec INTEGER,"
+      "  hash BLOB,"
+      "  hash_function INTEGER,"
+      "  sample_bytes INTEGER,"
+      "  sample_interval INTEGER,"
+      "  PRIMARY KEY (directory_id, filename)"
+      ")",
+      0, 0, 0);
+
+    /* earlier versions stored heuristic signatures as full hashes */
+    if (result == SQLITE_OK) {
+      snprintf(query, sizeof(query), "UPDATE hashes SET hash = NULL WHERE size > %lld", (long long) HEURISTIC_LIMIT);
+
+      result = sqlite3_exec(db, query, 0, 0, 0);
+    }
+
+    if (result != SQLITE_OK) {
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+      return result;
+    }
+  }
+
+  if (version < 5) {
+    result = sqlite3_exec(db,
+      "CREATE TABLE IF NOT EXISTS prefix_hashes ("
+      "  directory_id INTEGER REFERENCES directories(id) ON DELETE CASCADE,"
+      "  filename TEXT,"
+      "  inode BLOB,"
+      "  size INTEGER,"
+      "  ctime BLOB,"
+      "  mtime BLOB,"
+      "  ctime_nsec INTEGER,"
+      "  mtime_nsec INTEGER,"
+      "  prefix_bytes INTEGER,"
+      "  hash BLOB,"
+      "  hash_function INTEGER,"
+      "  PRIMARY KEY (directory_id, filename, prefix_bytes)"
+      ")",
+      0, 0, 0);
+
+    if (result != SQLITE_OK) {
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+      return result;
+    }
+  }
+
+  if (version < 6) {
+    result = sqlite3_exec(db,
+      "CREATE TABLE IF NOT EXISTS sample_hashes ("
+      "  directory_id INTEGER REFERENCES directories(id) ON DELETE CASCADE,"
+      "  filename TEXT,"
+      "  inode BLOB,"
+      "  size INTEGER,"
+      "  ctime BLOB,"
+      "  mtime BLOB,"
+      "  ctime_nsec INTEGER,"
+      "  mtime_nsec INTEGER,"
+      "  hash BLOB,"
+      "  hash_function INTEGER,"
+      "  sample_bytes INTEGER,"
+      "  sample_count INTEGER,"
+      "  PRIMARY KEY (directory_id, filename)"
+      ")",
+      0, 0, 0);
+
+    if (result != SQLITE_OK) {
+      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+      return result;
+    }
+  }
+
+  result = hashdb__setdatabaseversion(db, DATABASE_VERSION);
+  if (result != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    return result;
+  }
+
+  return sqlite3_exec(db, "COMMIT", 0, 0, 0);
+}
+
 int hashdb__preparestatements(sqlite3 *db)
 {
   int result;
 
   /* standard SQL commands */
-  result = PREPARE_STATEMENT("BEGIN", query_begintransaction);
+  result = PREPARE_STATEMENT("BEGIN IMMEDIATE", query_begintransaction);
   if (result != SQLITE_OK)
     return result;
 
@@ -191,6 +378,103 @@ int hashdb__preparestatements(sqlite3 *db)
   if (result != SQLITE_OK)
     return result;
 
+  result = PREPARE_STATEMENT("SELECT directories.full_path, hashes.filename, hashes.size, hashes.mtime, hashes.mtime_nsec, hashes.partial_hash, hashes.partial_hash_bytes, hashes.hash, hashes.hash_function FROM hashes INNER JOIN directories ON hashes.directory_id = directories.id WHERE directories.full_path = :root OR substr(directories.full_path, 1, length(:prefix)) = :prefix", query_foreachsignature);
+  if (result != SQLITE_OK)
+    return result;
+
+  /* confirmation operations */
+  result = PREPARE_STATEMENT("SELECT confirmations.group_id FROM confirmations INNER JOIN directories ON confirmations.directory_id = directories.id WHERE directories.full_path = ? AND confirmations.filename = ? AND confirmations.device = ? AND confirmations.inode = ? AND confirmations.size = ? AND confirmations.ctime = ? AND confirmations.mtime = ? AND confirmations.ctime_nsec = ? AND confirmations.mtime_nsec = ?", query_loadconfirmation);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("INSERT OR REPLACE INTO confirmations (directory_id, filename, device, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, group_id) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", query_saveconfirmation);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("SELECT IFNULL(MAX(group_id), 0) + 1 FROM confirmations", query_newconfirmationgroup);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("UPDATE confirmations SET group_id = ? WHERE group_id = ?", query_mergeconfirmationgroups);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM confirmations WHERE directory_id = ? AND filename = ?", query_deleteconfirmation);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM confirmations WHERE filename = ? AND directory_id IN (SELECT id FROM directories WHERE full_path = ?)", query_deleteconfirmationforpath);
+  if (result != SQLITE_OK)
+    return result;
+
+  /* block list operations */
+  result = PREPARE_STATEMENT("SELECT blocks.inode, blocks.size, blocks.ctime, blocks.mtime, blocks.ctime_nsec, blocks.mtime_nsec, blocks.digests, blocks.root, blocks.state FROM blocks INNER JOIN directories ON blocks.directory_id = directories.id WHERE directories.full_path = ? AND blocks.filename = ? AND blocks.block_size = ? AND blocks.hash_function = ?", query_loadblocks);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("INSERT OR REPLACE INTO blocks (directory_id, filename, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, block_size, digests, root, state, hash_function) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", query_saveblocks);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM blocks WHERE directory_id = ? AND filename = ?", query_deleteblocks);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM blocks WHERE filename = ? AND directory_id IN (SELECT id FROM directories WHERE full_path = ?)", query_deleteblocksforpath);
+  if (result != SQLITE_OK)
+    return result;
+
+  /* heuristic hash operations */
+  result = PREPARE_STATEMENT("SELECT heuristic_hashes.hash FROM heuristic_hashes INNER JOIN directories ON heuristic_hashes.directory_id = directories.id WHERE directories.full_path = ? AND heuristic_hashes.filename = ? AND heuristic_hashes.inode = ? AND heuristic_hashes.size = ? AND heuristic_hashes.ctime = ? AND heuristic_hashes.mtime = ? AND heuristic_hashes.ctime_nsec = ? AND heuristic_hashes.mtime_nsec = ? AND heuristic_hashes.hash_function = ? AND heuristic_hashes.sample_bytes = ? AND heuristic_hashes.sample_interval = ?", query_loadheuristichash);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("INSERT OR REPLACE INTO heuristic_hashes (directory_id, filename, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, hash, hash_function, sample_bytes, sample_interval) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", query_saveheuristichash);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM heuristic_hashes WHERE directory_id = ? AND filename = ?", query_deleteheuristichash);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM heuristic_hashes WHERE filename = ? AND directory_id IN (SELECT id FROM directories WHERE full_path = ?)", query_deleteheuristichashforpath);
+  if (result != SQLITE_OK)
+    return result;
+
+  /* prefix hash operations */
+  result = PREPARE_STATEMENT("SELECT prefix_hashes.hash FROM prefix_hashes INNER JOIN directories ON prefix_hashes.directory_id = directories.id WHERE directories.full_path = ? AND prefix_hashes.filename = ? AND prefix_hashes.inode = ? AND prefix_hashes.size = ? AND prefix_hashes.ctime = ? AND prefix_hashes.mtime = ? AND prefix_hashes.ctime_nsec = ? AND prefix_hashes.mtime_nsec = ? AND prefix_hashes.prefix_bytes = ? AND prefix_hashes.hash_function = ?", query_loadprefixhash);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("INSERT OR REPLACE INTO prefix_hashes (directory_id, filename, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, prefix_bytes, hash, hash_function) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", query_saveprefixhash);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM prefix_hashes WHERE directory_id = ? AND filename = ?", query_deleteprefixhashes);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM prefix_hashes WHERE filename = ? AND directory_id IN (SELECT id FROM directories WHERE full_path = ?)", query_deleteprefixhashesforpath);
+  if (result != SQLITE_OK)
+    return result;
+
+  /* sample hash operations */
+  result = PREPARE_STATEMENT("SELECT sample_hashes.hash FROM sample_hashes INNER JOIN directories ON sample_hashes.directory_id = directories.id WHERE directories.full_path = ? AND sample_hashes.filename = ? AND sample_hashes.inode = ? AND sample_hashes.size = ? AND sample_hashes.ctime = ? AND sample_hashes.mtime = ? AND sample_hashes.ctime_nsec = ? AND sample_hashes.mtime_nsec = ? AND sample_hashes.hash_function = ? AND sample_hashes.sample_bytes = ? AND sample_hashes.sample_count = ?", query_loadsamplehash);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("INSERT OR REPLACE INTO sample_hashes (directory_id, filename, inode, size, ctime, mtime, ctime_nsec, mtime_nsec, hash, hash_function, sample_bytes, sample_count) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", query_savesamplehash);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM sample_hashes WHERE directory_id = ? AND filename = ?", query_deletesamplehash);
+  if (result != SQLITE_OK)
+    return result;
+
+  result = PREPARE_STATEMENT("DELETE FROM sample_hashes WHERE filename = ? AND directory_id IN (SELECT id FROM directories WHERE full_path = ?)", query_deletesamplehashforpath);
+  if (result != SQLITE_OK)
+    return result;
+
   return SQLITE_OK;
 }
 
@@ -297,17 +581,63 @@ int hashdb__enable_write_ahead(sqlite3 *db)
   return sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, 0) == SQLITE_OK;
 }
 
-sqlite3 *hashdb_open(const char *path)
+/* In WAL mode, NORMAL synchronization keeps the database consistent while
+   making each commit cheap enough for short transactions. */
+int hashdb__enable_normal_synchronous(sqlite3 *db)
+{
+  return sqlite3_exec(db, "PRAGMA synchronous = NORMAL", 0, 0, 0) == SQLITE_OK;
+}
+
+/* Wait for other fdupes processes sharing the database to release their
+   locks, backing off exponentially up to FDUPES_CACHE_BUSY_MAX_DELAY_MS
+   between attempts and giving up after FDUPES_CACHE_BUSY_TIMEOUT_MS. */
+int hashdb__busyhandler(void *waited, int count)
+{
+  unsigned int delay;
+  struct timespec interval;
+
+  if (got_sigint)
+    return 0;
+
+  if (count == 0)
+    *(unsigned int*)waited = 0;
+
+  if (*(unsigned int*)waited >= FDUPES_CACHE_BUSY_TIMEOUT_MS)
+    return 0;
+
+  delay = count < 16 ? 1u << count : FDUPES_CACHE_BUSY_MAX_DELAY_MS;
+  if (delay > FDUPES_CACHE_BUSY_MAX_DELAY_MS)
+    delay = FDUPES_CACHE_BUSY_MAX_DELAY_MS;
+
+  interval.tv_sec = delay / 1000;
+  interval.tv_nsec = (delay % 1000) * 1000000L;
+
+  nanosleep(&interval, 0);
+
+  *(unsigned int*)waited += delay;
+
+  return 1;
+}
+
+sqlite3 *hashdb_open(const char *path, int readonly)
 {
+  static unsigned int busywaited;
   sqlite3 *db;
   int result;
   int version;
 
-  result = sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0);
+  result = sqlite3_open_v2(path, &db, readonly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0);
   if (result != SQLITE_OK)
     return 0;
 
-  if (!hashdb__enable_write_ahead(db)) {
+  sqlite3_busy_handler(db, hashdb__busyhandler, &busywaited);
+
+  if (!readonly && !hashdb__enable_write_ahead(db)) {
+    sqlite3_close_v2(db);
+    return 0;
+  }
+
+  if (!readonly && !hashdb__enable_normal_synchronous(db)) {
     sqlite3_close_v2(db);
     return 0;
   }
@@ -328,6 +658,12 @@ sqlite3 *hashdb_open(const char *path)
     return 0;
   }
 
+  /* a read-only connection can neither create nor upgrade the database */
+  if (readonly && version != DATABASE_VERSION) {
+    sqlite3_close_v2(db);
+    return 0;
+  }
+
   if (version == 0) /* this is a new database */ {
     result = hashdb__createtables(db);
     if (result != SQLITE_OK) {
@@ -335,7 +671,11 @@ sqlite3 *hashdb_open(const char *path)
       return 0;
     }
 
-    result = hashdb__setdatabaseversion(db, DATABASE_VERSION);
+    version = 1;
+  }
+
+  if (version < DATABASE_VERSION) {
+    result = hashdb__upgradetables(db);
     if (result != SQLITE_OK) {
       sqlite3_close_v2(db);
       return 0;
@@ -527,7 +867,7 @@ int hashdb_foreachdirectory(sqlite3 *db, const sqlite3_int64 *parent, int (*call
   return result == SQLITE_DONE;
 }
 
-int hashdb_loadhash(sqlite3 *db, const file_t *entry, md5_byte_t **partialhash, md5_byte_t **fullhash)
+int hashdb_loadhash(sqlite3 *db, const file_t *entry, int hashfunction, md5_byte_t **partialhash, md5_byte_t **fullhash)
 {
   int result;
   int hashsize;
@@ -558,7 +898,7 @@ int hashdb_loadhash(sqlite3 *db, const file_t *entry, md5_byte_t **partialhash,
   sqlite3_bind_int64(query_loadhash, 7, entry->ctime_nsec);
   sqlite3_bind_int64(query_loadhash, 8, entry->mtime_nsec);
   sqlite3_bind_int64(query_loadhash, 9, PARTIAL_MD5_SIZE);
-  sqlite3_bind_int(query_loadhash, 10, HASH_FUNCTION);
+  sqlite3_bind_int(query_loadhash, 10, hashfunction);
 
   result = sqlite3_step(query_loadhash);
 
@@ -610,7 +950,7 @@ int hashdb_loadhash(sqlite3 *db, const file_t *entry, md5_byte_t **partialhash,
   return *partialhash || *fullhash;
 }
 
-int hashdb_savehash(sqlite3 *db, const file_t *entry, md5_byte_t *partialhash, md5_byte_t *fullhash)
+int hashdb_savehash(sqlite3 *db, const file_t *entry, int hashfunction, md5_byte_t *partialhash, md5_byte_t *fullhash)
 {
   int result;
   char *realpath;
@@ -665,7 +1005,7 @@ int hashdb_savehash(sqlite3 *db, const file_t *entry, md5_byte_t *partialhash, m
   else
     sqlite3_bind_null(query_savehash, 11);
 
-  sqlite3_bind_int(query_savehash, 12, HASH_FUNCTION);
+  sqlite3_bind_int(query_savehash, 12, hashfunction);
 
   result = sqlite3_step(query_savehash);
 
@@ -712,41 +1052,799 @@ int hashdb_foreachhash(sqlite3 *db, sqlite3_int64 *directoryid, int (*callback)(
   return result == SQLITE_DONE;
 }
 
-int hashdb_deletehash(sqlite3 *db, sqlite3_int64 directoryid, const char *filename)
+int hashdb__deleteentry(sqlite3_stmt *query, sqlite3_int64 directoryid, const char *filename)
+{
+  int result;
+
+  sqlite3_bind_int64(query, 1, directoryid);
+  sqlite3_bind_text(query, 2, filename, strlen(filename), SQLITE_TRANSIENT);
+
+  result = sqlite3_step(query);
+
+  sqlite3_reset(query);
+
+  return result == SQLITE_DONE;
+}
+
+int hashdb__deleteentryforpath(sqlite3_stmt *query, const char *directory, const char *filename)
 {
   int result;
 
-  sqlite3_bind_int64(query_deletehash, 1, directoryid);
-  sqlite3_bind_text(query_deletehash, 2, filename, strlen(filename), SQLITE_TRANSIENT);
+  sqlite3_bind_text(query, 1, filename, strlen(filename), SQLITE_TRANSIENT);
+  sqlite3_bind_text(query, 2, directory, strlen(directory), SQLITE_TRANSIENT);
 
-  result = sqlite3_step(query_deletehash);
+  result = sqlite3_step(query);
 
-  sqlite3_reset(query_deletehash);
+  sqlite3_reset(query);
 
   return result == SQLITE_DONE;
 }
 
+int hashdb_deletehash(sqlite3 *db, sqlite3_int64 directoryid, const char *filename)
+{
+  int result;
+
+  result = hashdb__deleteentry(query_deletehash, directoryid, filename);
+
+  hashdb__deleteentry(query_deleteconfirmation, directoryid, filename);
+  hashdb__deleteentry(query_deleteblocks, directoryid, filename);
+  hashdb__deleteentry(query_deleteheuristichash, directoryid, filename);
+  hashdb__deleteentry(query_deleteprefixhashes, directoryid, filename);
+  hashdb__deleteentry(query_deletesamplehash, directoryid, filename);
+
+  return result;
+}
+
 int hashdb_deletehashforpath(sqlite3 *db, const char *path)
 {
   int result;
+  char *directory;
+  char *name;
+
+  directory = sdirname(0, path);
+  if (directory == 0)
+    return 0;
+
+  name = sbasename(0, path);
+  if (name == 0)
+  {
+    free(directory);
+    return 0;
+  }
+
+  result = hashdb__deleteentryforpath(query_deletehashforpath, directory, name);
+
+  hashdb__deleteentryforpath(query_deleteconfirmationforpath, directory, name);
+  hashdb__deleteentryforpath(query_deleteblocksforpath, directory, name);
+  hashdb__deleteentryforpath(query_deleteheuristichashforpath, directory, name);
+  hashdb__deleteentryforpath(query_deleteprefixhashesforpath, directory, name);
+  hashdb__deleteentryforpath(query_deletesamplehashforpath, directory, name);
+
+  free(name);
+  free(directory);
+
+  return result;
+}
+
+int hashdb__getorsavedirectoryid(sqlite3 *db, const char *path, sqlite3_int64 *directoryid)
+{
+  if (hashdb_getdirectoryid(db, path, directoryid))
+    return 1;
+
+  if (!hashdb_savedirectory(db, path))
+    return 0;
+
+  *directoryid = sqlite3_last_insert_rowid(db);
+
+  return 1;
+}
+
+int hashdb__loadconfirmationgroup(sqlite3 *db, const file_t *entry, sqlite3_int64 *group)
+{
+  int result;
+  char *realpath;
   char *name;
-  sqlite3_int64 pathid;
 
-  name = malloc(strlen(path) + 1);
+  realpath = getrealpath(entry->d_name, 0);
+  if (realpath == 0)
+    return 0;
+
+  name = malloc(strlen(realpath) + 1);
   if (name == 0)
+  {
+    free(realpath);
     return 0;
+  }
+
+  sdirname(name, realpath);
+  sqlite3_bind_text(query_loadconfirmation, 1, name, strlen(name), SQLITE_TRANSIENT);
+
+  sbasename(name, realpath);
+  sqlite3_bind_text(query_loadconfirmation, 2, name, strlen(name), SQLITE_TRANSIENT);
 
-  sbasename(name, path);
-  sqlite3_bind_text(query_deletehashforpath, 1, name, strlen(name), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_loadconfirmation, 3, &entry->device, sizeof(entry->device), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_loadconfirmation, 4, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_loadconfirmation, 5, entry->size);
+  sqlite3_bind_blob(query_loadconfirmation, 6, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_loadconfirmation, 7, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_loadconfirmation, 8, entry->ctime_nsec);
+  sqlite3_bind_int64(query_loadconfirmation, 9, entry->mtime_nsec);
 
-  sdirname(name, path);
-  sqlite3_bind_text(query_deletehashforpath, 2, name, strlen(name), SQLITE_TRANSIENT);
+  result = sqlite3_step(query_loadconfirmation);
 
   free(name);
+  free(realpath);
+
+  if (result == SQLITE_ROW)
+    *group = sqlite3_column_int64(query_loadconfirmation, 0);
+
+  sqlite3_reset(query_loadconfirmation);
+
+  return result == SQLITE_ROW;
+}
+
+int hashdb__saveconfirmationgroup(sqlite3 *db, const file_t *entry, sqlite3_int64 group)
+{
+  int result;
+  char *realpath;
+  char *name;
+  sqlite3_int64 directoryid;
+
+  realpath = getrealpath(entry->d_name, 0);
+  if (realpath == 0)
+    return 0;
+
+  name = malloc(strlen(realpath) + 1);
+  if (name == 0)
+  {
+    free(realpath);
+    return 0;
+  }
+
+  sdirname(name, realpath);
+
+  if (!hashdb__getorsavedirectoryid(db, name, &directoryid))
+  {
+    free(name);
+    free(realpath);
+    return 0;
+  }
 
-  result = sqlite3_step(query_deletehashforpath);
+  sbasename(name, realpath);
+
+  sqlite3_bind_int64(query_saveconfirmation, 1, directoryid);
+  sqlite3_bind_text(query_saveconfirmation, 2, name, strlen(name), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveconfirmation, 3, &entry->device, sizeof(entry->device), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveconfirmation, 4, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_saveconfirmation, 5, entry->size);
+  sqlite3_bind_blob(query_saveconfirmation, 6, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveconfirmation, 7, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_saveconfirmation, 8, entry->ctime_nsec);
+  sqlite3_bind_int64(query_saveconfirmation, 9, entry->mtime_nsec);
+  sqlite3_bind_int64(query_saveconfirmation, 10, group);
+
+  result = sqlite3_step(query_saveconfirmation);
+
+  free(name);
+  free(realpath);
 
-  sqlite3_reset(query_deletehashforpath);
+  sqlite3_reset(query_saveconfirmation);
 
   return result == SQLITE_DONE;
-}
\ No newline at end of file
+}
+
+/* Check whether two files were confirmed identical by an earlier run.
+   Confirmations are only trusted while both files keep the device,
+   inode, size and times recorded when the comparison took place. */
+int hashdb_loadconfirmation(sqlite3 *db, const file_t *entry1, const file_t *entry2)
+{
+  sqlite3_int64 group1;
+  sqlite3_int64 group2;
+
+  if (!hashdb__loadconfirmationgroup(db, entry1, &group1))
+    return 0;
+
+  if (!hashdb__loadconfirmationgroup(db, entry2, &group2))
+    return 0;
+
+  return group1 == group2;
+}
+
+/* Record that two files have been confirmed identical. Files confirmed
+   against a common file share a group, so a confirmation is implied for
+   every pair of files within a group. */
+int hashdb_saveconfirmation(sqlite3 *db, const file_t *entry1, const file_t *entry2)
+{
+  int result;
+  int found1;
+  int found2;
+  sqlite3_int64 group1;
+  sqlite3_int64 group2;
+
+  found1 = hashdb__loadconfirmationgroup(db, entry1, &group1);
+  found2 = hashdb__loadconfirmationgroup(db, entry2, &group2);
+
+  if (found1 && found2)
+  {
+    if (group1 == group2)
+      return 1;
+
+    sqlite3_bind_int64(query_mergeconfirmationgroups, 1, group1);
+    sqlite3_bind_int64(query_mergeconfirmationgroups, 2, group2);
+
+    result = sqlite3_step(query_mergeconfirmationgroups);
+
+    sqlite3_reset(query_mergeconfirmationgroups);
+
+    return result == SQLITE_DONE;
+  }
+
+  if (found1)
+    return hashdb__saveconfirmationgroup(db, entry2, group1);
+
+  if (found2)
+    return hashdb__saveconfirmationgroup(db, entry1, group2);
+
+  result = sqlite3_step(query_newconfirmationgroup);
+  if (result != SQLITE_ROW)
+  {
+    sqlite3_reset(query_newconfirmationgroup);
+    return 0;
+  }
+
+  group1 = sqlite3_column_int64(query_newconfirmationgroup, 0);
+
+  sqlite3_reset(query_newconfirmationgroup);
+
+  return hashdb__saveconfirmationgroup(db, entry1, group1) &&
+         hashdb__saveconfirmationgroup(db, entry2, group1);
+}
+
+/* Load the block list last saved for a file. Unlike hashdb_loadhash(),
+   the entry's stat information is not required to match; the caller
+   receives the recorded values and decides what may be reused. */
+int hashdb_loadblocks(sqlite3 *db, const file_t *entry, off_t blocksize, struct hashdb_blocklist *blocks)
+{
+  int result;
+  char *realpath;
+  char *name;
+  md5_state_t rootstate;
+  md5_byte_t root[HASH_FUNCTION_OUTPUT_LENGTH];
+  size_t digestbytes;
+
+  realpath = getrealpath(entry->d_name, 0);
+  if (realpath == 0)
+    return 0;
+
+  name = malloc(strlen(realpath) + 1);
+  if (name == 0)
+  {
+    free(realpath);
+    return 0;
+  }
+
+  sdirname(name, realpath);
+  sqlite3_bind_text(query_loadblocks, 1, name, strlen(name), SQLITE_TRANSIENT);
+
+  sbasename(name, realpath);
+  sqlite3_bind_text(query_loadblocks, 2, name, strlen(name), SQLITE_TRANSIENT);
+
+  sqlite3_bind_int64(query_loadblocks, 3, blocksize);
+  sqlite3_bind_int(query_loadblocks, 4, HASH_FUNCTION);
+
+  result = sqlite3_step(query_loadblocks);
+
+  free(name);
+  free(realpath);
+
+  if (result != SQLITE_ROW ||
+      sqlite3_column_bytes(query_loadblocks, 0) != sizeof(blocks->inode) ||
+      sqlite3_column_bytes(query_loadblocks, 2) != sizeof(blocks->ctime) ||
+      sqlite3_column_bytes(query_loadblocks, 3) != sizeof(blocks->mtime) ||
+      sqlite3_column_bytes(query_loadblocks, 6) % HASH_FUNCTION_OUTPUT_LENGTH != 0 ||
+      sqlite3_column_bytes(query_loadblocks, 7) != HASH_FUNCTION_OUTPUT_LENGTH ||
+      sqlite3_column_bytes(query_loadblocks, 8) != sizeof(blocks->state))
+  {
+    sqlite3_reset(query_loadblocks);
+    return 0;
+  }
+
+  memcpy(&blocks->inode, sqlite3_column_blob(query_loadblocks, 0), sizeof(blocks->inode));
+  blocks->size = sqlite3_column_int64(query_loadblocks, 1);
+  memcpy(&blocks->ctime, sqlite3_column_blob(query_loadblocks, 2), sizeof(blocks->ctime));
+  memcpy(&blocks->mtime, sqlite3_column_blob(query_loadblocks, 3), sizeof(blocks->mtime));
+  blocks->ctime_nsec = sqlite3_column_int64(query_loadblocks, 4);
+  blocks->mtime_nsec = sqlite3_column_int64(query_loadblocks, 5);
+  blocks->blocksize = blocksize;
+
+  digestbytes = sqlite3_column_bytes(query_loadblocks, 6);
+
+  blocks->blockcount = digestbytes / HASH_FUNCTION_OUTPUT_LENGTH;
+  blocks->digests = 0;
+
+  if (blocks->blockcount > 0)
+  {
+    blocks->digests = (md5_byte_t*) malloc(digestbytes);
+    if (blocks->digests == 0) {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    memcpy(blocks->digests, sqlite3_column_blob(query_loadblocks, 6), digestbytes);
+  }
+
+  memcpy(&blocks->state, sqlite3_column_blob(query_loadblocks, 8), sizeof(blocks->state));
+
+  /* make sure the digest list is the one the root was computed from */
+  md5_init(&rootstate);
+  md5_append(&rootstate, blocks->digests, digestbytes);
+  md5_finish(&rootstate, root);
+
+  result = memcmp(root, sqlite3_column_blob(query_loadblocks, 7), HASH_FUNCTION_OUTPUT_LENGTH);
+
+  sqlite3_reset(query_loadblocks);
+
+  if (result != 0 || blocks->blockcount != (size_t) (blocks->size / blocksize))
+  {
+    free(blocks->digests);
+    blocks->digests = 0;
+    return 0;
+  }
+
+  return 1;
+}
+
+int hashdb_saveblocks(sqlite3 *db, const file_t *entry, const struct hashdb_blocklist *blocks)
+{
+  int result;
+  char *realpath;
+  char *name;
+  sqlite3_int64 directoryid;
+  md5_state_t rootstate;
+  md5_byte_t root[HASH_FUNCTION_OUTPUT_LENGTH];
+
+  realpath = getrealpath(entry->d_name, 0);
+  if (realpath == 0)
+    return 0;
+
+  name = malloc(strlen(realpath) + 1);
+  if (name == 0)
+  {
+    free(realpath);
+    return 0;
+  }
+
+  sdirname(name, realpath);
+
+  if (!hashdb__getorsavedirectoryid(db, name, &directoryid))
+  {
+    free(name);
+    free(realpath);
+    return 0;
+  }
+
+  sbasename(name, realpath);
+
+  md5_init(&rootstate);
+  md5_append(&rootstate, blocks->digests, blocks->blockcount * HASH_FUNCTION_OUTPUT_LENGTH);
+  md5_finish(&rootstate, root);
+
+  sqlite3_bind_int64(query_saveblocks, 1, directoryid);
+  sqlite3_bind_text(query_saveblocks, 2, name, strlen(name), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveblocks, 3, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_saveblocks, 4, entry->size);
+  sqlite3_bind_blob(query_saveblocks, 5, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveblocks, 6, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_saveblocks, 7, entry->ctime_nsec);
+  sqlite3_bind_int64(query_saveblocks, 8, entry->mtime_nsec);
+  sqlite3_bind_int64(query_saveblocks, 9, blocks->blocksize);
+  sqlite3_bind_blob(query_saveblocks, 10, blocks->digests, blocks->blockcount * HASH_FUNCTION_OUTPUT_LENGTH, SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveblocks, 11, root, sizeof(root), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveblocks, 12, &blocks->state, sizeof(blocks->state), SQLITE_TRANSIENT);
+  sqlite3_bind_int(query_saveblocks, 13, HASH_FUNCTION);
+
+  result = sqlite3_step(query_saveblocks);
+
+  free(name);
+  free(realpath);
+
+  sqlite3_reset(query_saveblocks);
+
+  return result == SQLITE_DONE;
+}
+
+/* Heuristic signatures are kept apart from full hashes, so that they are
+   never mistaken for one another, and are only reused when sampled using
+   the same parameters. */
+int hashdb_loadheuristichash(sqlite3 *db, const file_t *entry, off_t samplebytes, off_t sampleinterval, md5_byte_t **hash)
+{
+  int result;
+  char *realpath;
+  char *name;
+
+  *hash = 0;
+
+  realpath = getrealpath(entry->d_name, 0);
+  if (realpath == 0)
+    return 0;
+
+  name = malloc(strlen(realpath) + 1);
+  if (name == 0)
+  {
+    free(realpath);
+    return 0;
+  }
+
+  sdirname(name, realpath);
+  sqlite3_bind_text(query_loadheuristichash, 1, name, strlen(name), SQLITE_TRANSIENT);
+
+  sbasename(name, realpath);
+  sqlite3_bind_text(query_loadheuristichash, 2, name, strlen(name), SQLITE_TRANSIENT);
+
+  sqlite3_bind_blob(query_loadheuristichash, 3, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_loadheuristichash, 4, entry->size);
+  sqlite3_bind_blob(query_loadheuristichash, 5, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_loadheuristichash, 6, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_loadheuristichash, 7, entry->ctime_nsec);
+  sqlite3_bind_int64(query_loadheuristichash, 8, entry->mtime_nsec);
+  sqlite3_bind_int(query_loadheuristichash, 9, HASH_FUNCTION);
+  sqlite3_bind_int64(query_loadheuristichash, 10, samplebytes);
+  sqlite3_bind_int64(query_loadheuristichash, 11, sampleinterval);
+
+  result = sqlite3_step(query_loadheuristichash);
+
+  free(name);
+  free(realpath);
+
+  if (result == SQLITE_ROW && sqlite3_column_bytes(query_loadheuristichash, 0) == HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t))
+  {
+    *hash = (md5_byte_t*) malloc(HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t));
+    if (*hash == NULL) {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    md5copy(*hash, sqlite3_column_blob(query_loadheuristichash, 0));
+  }
+
+  sqlite3_reset(query_loadheuristichash);
+
+  return *hash != 0;
+}
+
+int hashdb_saveheuristichash(sqlite3 *db, const file_t *entry, off_t samplebytes, off_t sampleinterval, md5_byte_t *hash)
+{
+  int result;
+  char *realpath;
+  char *name;
+  sqlite3_int64 directoryid;
+
+  realpath = getrealpath(entry->d_name, 0);
+  if (realpath == 0)
+    return 0;
+
+  name = malloc(strlen(realpath) + 1);
+  if (name == 0)
+  {
+    free(realpath);
+    return 0;
+  }
+
+  sdirname(name, realpath);
+
+  if (!hashdb__getorsavedirectoryid(db, name, &directoryid))
+  {
+    free(name);
+    free(realpath);
+    return 0;
+  }
+
+  sbasename(name, realpath);
+
+  sqlite3_bind_int64(query_saveheuristichash, 1, directoryid);
+  sqlite3_bind_text(query_saveheuristichash, 2, name, strlen(name), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveheuristichash, 3, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_saveheuristichash, 4, entry->size);
+  sqlite3_bind_blob(query_saveheuristichash, 5, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveheuristichash, 6, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_saveheuristichash, 7, entry->ctime_nsec);
+  sqlite3_bind_int64(query_saveheuristichash, 8, entry->mtime_nsec);
+  sqlite3_bind_blob(query_saveheuristichash, 9, hash, HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t), SQLITE_TRANSIENT);
+  sqlite3_bind_int(query_saveheuristichash, 10, HASH_FUNCTION);
+  sqlite3_bind_int64(query_saveheuristichash, 11, samplebytes);
+  sqlite3_bind_int64(query_saveheuristichash, 12, sampleinterval);
+
+  result = sqlite3_step(query_saveheuristichash);
+
+  free(name);
+  free(realpath);
+
+  sqlite3_reset(query_saveheuristichash);
+
+  return result == SQLITE_DONE;
+}
+
+/* Load the digest of the first prefixbytes bytes of a file. */
+int hashdb_loadprefixhash(sqlite3 *db, const file_t *entry, off_t prefixbytes, md5_byte_t **hash)
+{
+  int result;
+  char *realpath;
+  char *name;
+
+  *hash = 0;
+
+  realpath = getrealpath(entry->d_name, 0);
+  if (realpath == 0)
+    return 0;
+
+  name = malloc(strlen(realpath) + 1);
+  if (name == 0)
+  {
+    free(realpath);
+    return 0;
+  }
+
+  sdirname(name, realpath);
+  sqlite3_bind_text(query_loadprefixhash, 1, name, strlen(name), SQLITE_TRANSIENT);
+
+  sbasename(name, realpath);
+  sqlite3_bind_text(query_loadprefixhash, 2, name, strlen(name), SQLITE_TRANSIENT);
+
+  sqlite3_bind_blob(query_loadprefixhash, 3, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_loadprefixhash, 4, entry->size);
+  sqlite3_bind_blob(query_loadprefixhash, 5, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_loadprefixhash, 6, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_loadprefixhash, 7, entry->ctime_nsec);
+  sqlite3_bind_int64(query_loadprefixhash, 8, entry->mtime_nsec);
+  sqlite3_bind_int64(query_loadprefixhash, 9, prefixbytes);
+  sqlite3_bind_int(query_loadprefixhash, 10, HASH_FUNCTION);
+
+  result = sqlite3_step(query_loadprefixhash);
+
+  free(name);
+  free(realpath);
+
+  if (result == SQLITE_ROW && sqlite3_column_bytes(query_loadprefixhash, 0) == HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t))
+  {
+    *hash = (md5_byte_t*) malloc(HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t));
+    if (*hash == NULL) {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    md5copy(*hash, sqlite3_column_blob(query_loadprefixhash, 0));
+  }
+
+  sqlite3_reset(query_loadprefixhash);
+
+  return *hash != 0;
+}
+
+int hashdb_saveprefixhash(sqlite3 *db, const file_t *entry, off_t prefixbytes, md5_byte_t *hash)
+{
+  int result;
+  char *realpath;
+  char *name;
+  sqlite3_int64 directoryid;
+
+  realpath = getrealpath(entry->d_name, 0);
+  if (realpath == 0)
+    return 0;
+
+  name = malloc(strlen(realpath) + 1);
+  if (name == 0)
+  {
+    free(realpath);
+    return 0;
+  }
+
+  sdirname(name, realpath);
+
+  if (!hashdb__getorsavedirectoryid(db, name, &directoryid))
+  {
+    free(name);
+    free(realpath);
+    return 0;
+  }
+
+  sbasename(name, realpath);
+
+  sqlite3_bind_int64(query_saveprefixhash, 1, directoryid);
+  sqlite3_bind_text(query_saveprefixhash, 2, name, strlen(name), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveprefixhash, 3, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_saveprefixhash, 4, entry->size);
+  sqlite3_bind_blob(query_saveprefixhash, 5, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_saveprefixhash, 6, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_saveprefixhash, 7, entry->ctime_nsec);
+  sqlite3_bind_int64(query_saveprefixhash, 8, entry->mtime_nsec);
+  sqlite3_bind_int64(query_saveprefixhash, 9, prefixbytes);
+  sqlite3_bind_blob(query_saveprefixhash, 10, hash, HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t), SQLITE_TRANSIENT);
+  sqlite3_bind_int(query_saveprefixhash, 11, HASH_FUNCTION);
+
+  result = sqlite3_step(query_saveprefixhash);
+
+  free(name);
+  free(realpath);
+
+  sqlite3_reset(query_saveprefixhash);
+
+  return result == SQLITE_DONE;
+}
+
+/* Sample signatures are keyed by the size and number of blocks sampled. */
+int hashdb_loadsamplehash(sqlite3 *db, const file_t *entry, off_t samplebytes, int samplecount, md5_byte_t **hash)
+{
+  int result;
+  char *realpath;
+  char *name;
+
+  *hash = 0;
+
+  realpath = getrealpath(entry->d_name, 0);
+  if (realpath == 0)
+    return 0;
+
+  name = malloc(strlen(realpath) + 1);
+  if (name == 0)
+  {
+    free(realpath);
+    return 0;
+  }
+
+  sdirname(name, realpath);
+  sqlite3_bind_text(query_loadsamplehash, 1, name, strlen(name), SQLITE_TRANSIENT);
+
+  sbasename(name, realpath);
+  sqlite3_bind_text(query_loadsamplehash, 2, name, strlen(name), SQLITE_TRANSIENT);
+
+  sqlite3_bind_blob(query_loadsamplehash, 3, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_loadsamplehash, 4, entry->size);
+  sqlite3_bind_blob(query_loadsamplehash, 5, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_loadsamplehash, 6, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_loadsamplehash, 7, entry->ctime_nsec);
+  sqlite3_bind_int64(query_loadsamplehash, 8, entry->mtime_nsec);
+  sqlite3_bind_int(query_loadsamplehash, 9, HASH_FUNCTION);
+  sqlite3_bind_int64(query_loadsamplehash, 10, samplebytes);
+  sqlite3_bind_int(query_loadsamplehash, 11, samplecount);
+
+  result = sqlite3_step(query_loadsamplehash);
+
+  free(name);
+  free(realpath);
+
+  if (result == SQLITE_ROW && sqlite3_column_bytes(query_loadsamplehash, 0) == HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t))
+  {
+    *hash = (md5_byte_t*) malloc(HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t));
+    if (*hash == NULL) {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    md5copy(*hash, sqlite3_column_blob(query_loadsamplehash, 0));
+  }
+
+  sqlite3_reset(query_loadsamplehash);
+
+  return *hash != 0;
+}
+
+int hashdb_savesamplehash(sqlite3 *db, const file_t *entry, off_t samplebytes, int samplecount, md5_byte_t *hash)
+{
+  int result;
+  char *realpath;
+  char *name;
+  sqlite3_int64 directoryid;
+
+  realpath = getrealpath(entry->d_name, 0);
+  if (realpath == 0)
+    return 0;
+
+  name = malloc(strlen(realpath) + 1);
+  if (name == 0)
+  {
+    free(realpath);
+    return 0;
+  }
+
+  sdirname(name, realpath);
+
+  if (!hashdb__getorsavedirectoryid(db, name, &directoryid))
+  {
+    free(name);
+    free(realpath);
+    return 0;
+  }
+
+  sbasename(name, realpath);
+
+  sqlite3_bind_int64(query_savesamplehash, 1, directoryid);
+  sqlite3_bind_text(query_savesamplehash, 2, name, strlen(name), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_savesamplehash, 3, &entry->inode, sizeof(entry->inode), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_savesamplehash, 4, entry->size);
+  sqlite3_bind_blob(query_savesamplehash, 5, &entry->ctime, sizeof(entry->ctime), SQLITE_TRANSIENT);
+  sqlite3_bind_blob(query_savesamplehash, 6, &entry->mtime, sizeof(entry->mtime), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(query_savesamplehash, 7, entry->ctime_nsec);
+  sqlite3_bind_int64(query_savesamplehash, 8, entry->mtime_nsec);
+  sqlite3_bind_blob(query_savesamplehash, 9, hash, HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t), SQLITE_TRANSIENT);
+  sqlite3_bind_int(query_savesamplehash, 10, HASH_FUNCTION);
+  sqlite3_bind_int64(query_savesamplehash, 11, samplebytes);
+  sqlite3_bind_int(query_savesamplehash, 12, samplecount);
+
+  result = sqlite3_step(query_savesamplehash);
+
+  free(name);
+  free(realpath);
+
+  sqlite3_reset(query_savesamplehash);
+
+  return result == SQLITE_DONE;
+}
+
+/* Call callback for every file signature at or below directory root,
+   which must be given as a real path. */
+int hashdb_foreachsignature(sqlite3 *db, const char *root, int (*callback)(const char*, const char*, const struct hashdb_signature*))
+{
+  int result;
+  char *prefix;
+  size_t rootlength;
+  struct hashdb_signature signature;
+
+  rootlength = strlen(root);
+
+  prefix = malloc(rootlength + 2);
+  if (prefix == 0)
+    return 0;
+
+  strcpy(prefix, root);
+  if (rootlength == 0 || root[rootlength - 1] != '/')
+    strcat(prefix, "/");
+
+  sqlite3_bind_text(query_foreachsignature, 1, root, rootlength, SQLITE_TRANSIENT);
+  sqlite3_bind_text(query_foreachsignature, 2, prefix, strlen(prefix), SQLITE_TRANSIENT);
+
+  free(prefix);
+
+  result = sqlite3_step(query_foreachsignature);
+  while (result == SQLITE_ROW)
+  {
+    signature.size = sqlite3_column_int64(query_foreachsignature, 2);
+
+    if (sqlite3_column_bytes(query_foreachsignature, 3) == sizeof(signature.mtime))
+      memcpy(&signature.mtime, sqlite3_column_blob(query_foreachsignature, 3), sizeof(signature.mtime));
+    else
+      signature.mtime = 0;
+
+    signature.mtime_nsec = sqlite3_column_int64(query_foreachsignature, 4);
+
+    if (sqlite3_column_bytes(query_foreachsignature, 5) == HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t))
+      signature.partialhash = sqlite3_column_blob(query_foreachsignature, 5);
+    else
+      signature.partialhash = 0;
+
+    signature.partialbytes = sqlite3_column_int64(query_foreachsignature, 6);
+
+    if (sqlite3_column_bytes(query_foreachsignature, 7) == HASH_FUNCTION_OUTPUT_LENGTH * sizeof(md5_byte_t))
+      signature.fullhash = sqlite3_column_blob(query_foreachsignature, 7);
+    else
+      signature.fullhash = 0;
+
+    signature.hashfunction = sqlite3_column_int(query_foreachsignature, 8);
+
+    result = callback(
+      (const char *) sqlite3_column_text(query_foreachsignature, 0),
+      (const char *) sqlite3_column_text(query_foreachsignature, 1),
+      &signature
+    );
+
+    if (result == 0) {
+      sqlite3_reset(query_foreachsignature);
+      return 1;
+    }
+
+    result = sqlite3_step(query_foreachsignature);
+  }
+
+  sqlite3_reset(query_foreachsignature);
+
+  return result == SQLITE_DONE;
+}
@@ -25,7 +25,43 @@
 #include "fdupes.h"
 #include <sqlite3.h>
 
-sqlite3 *hashdb_open(const char *path);
+#define HASH_FUNCTION_MD5 1
+/* MD5 of the MD5 digests of consecutive TREE_HASH_CHUNK_SIZE chunks */
+#define HASH_FUNCTION_MD5_TREE 2
+
+#define HASH_FUNCTION HASH_FUNCTION_MD5
+#define HASH_FUNCTION_OUTPUT_LENGTH 16
+
+/* Digests of consecutive fixed-size blocks of a file, together with the
+   state of the whole-file digest at the end of the last complete block. */
+struct hashdb_blocklist
+{
+  ino_t inode;
+  off_t size;
+  time_t ctime;
+  time_t mtime;
+  long ctime_nsec;
+  long mtime_nsec;
+  off_t blocksize;
+  size_t blockcount;
+  md5_byte_t *digests;
+  md5_state_t state;
+};
+
+/* A file signature as stored in the database, without the details
+   (inode, ctime) that tie it to one particular filesystem. */
+struct hashdb_signature
+{
+  off_t size;
+  time_t mtime;
+  long mtime_nsec;
+  int hashfunction;
+  off_t partialbytes;
+  const md5_byte_t *partialhash;
+  const md5_byte_t *fullhash;
+};
+
+sqlite3 *hashdb_open(const char *path, int readonly);
 int hashdb_close(sqlite3 *db);
 int hashdb_begintransaction(sqlite3 *db);
 int hashdb_committransaction(sqlite3 *db);
@@ -36,10 +72,21 @@ int hashdb_savedirectory(sqlite3 *db, const char *path);
 int hashdb_deletedirectory(sqlite3 *db, sqlite3_int64 id);
 int hashdb_cleardirectories(sqlite3 *db);
 int hashdb_foreachdirectory(sqlite3 *db, const sqlite3_int64 *parentid, int (*callback)(const sqlite3_int64, const char*, const char*, const sqlite3_int64));
-int hashdb_loadhash(sqlite3 *db, const file_t *entry, md5_byte_t **partialhash, md5_byte_t **fullhash);
-int hashdb_savehash(sqlite3 *db, const file_t *entry, md5_byte_t *partialhash, md5_byte_t *fullhash);
+int hashdb_loadhash(sqlite3 *db, const file_t *entry, int hashfunction, md5_byte_t **partialhash, md5_byte_t **fullhash);
+int hashdb_savehash(sqlite3 *db, const file_t *entry, int hashfunction, md5_byte_t *partialhash, md5_byte_t *fullhash);
 int hashdb_foreachhash(sqlite3 *db, sqlite3_int64 *directoryid, int (*callback)(const sqlite3_int64, const char*, const char*));
 int hashdb_deletehash(sqlite3 *db, sqlite3_int64 directoryid, const char *filename);
 int hashdb_deletehashforpath(sqlite3 *db, const char *path);
+int hashdb_loadconfirmation(sqlite3 *db, const file_t *entry1, const file_t *entry2);
+int hashdb_saveconfirmation(sqlite3 *db, const file_t *entry1, const file_t *entry2);
+int hashdb_loadblocks(sqlite3 *db, const file_t *entry, off_t blocksize, struct hashdb_blocklist *blocks);
+int hashdb_saveblocks(sqlite3 *db, const file_t *entry, const struct hashdb_blocklist *blocks);
+int hashdb_loadheuristichash(sqlite3 *db, const file_t *entry, off_t samplebytes, off_t sampleinterval, md5_byte_t **hash);
+int hashdb_saveheuristichash(sqlite3 *db, const file_t *entry, off_t samplebytes, off_t sampleinterval, md5_byte_t *hash);
+int hashdb_loadprefixhash(sqlite3 *db, const file_t *entry, off_t prefixbytes, md5_byte_t **hash);
+int hashdb_saveprefixhash(sqlite3 *db, const file_t *entry, off_t prefixbytes, md5_byte_t *hash);
+int hashdb_loadsamplehash(sqlite3 *db, const file_t *entry, off_t samplebytes, int samplecount, md5_byte_t **hash);
+int hashdb_savesamplehash(sqlite3 *db, const file_t *entry, off_t samplebytes, int samplecount, md5_byte_t *hash);
+int hashdb_foreachsignature(sqlite3 *db, const char *root, int (*callback)(const char*, const char*, const struct hashdb_signature*));
 
 #endif
\ No newline at end of file
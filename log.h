@@ -38,12 +38,14 @@ struct log_info
   int append;
   int log_start;
   struct log_file *deleted;
+  struct log_file *linked;
   struct log_file *remaining;
 };
 
 struct log_info *log_open(char *filename, int *error);
 void log_begin_set(struct log_info *info);
 int log_file_deleted(struct log_info *info, char *name);
+int log_file_linked(struct log_info *info, char *name);
 int log_file_remaining(struct log_info *info, char *name);
 void log_end_set(struct log_info *info);
 void log_close(struct log_info *info);
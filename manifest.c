@@ -0,0 +1,647 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "manifest.h"
+#include "hashdb.h"
+#include "getrealpath.h"
+#include "errormsg.h"
+#include "sigint.h"
+
+/* A manifest lists file signatures by path relative to some root
+   directory, so that signatures calculated on one host can seed the
+   cache of another holding a copy of the same files. It consists of
+   a header followed by records sorted by path, all integers stored
+   most significant byte first:
+
+     header:  "FDUPESMF", format version (1 byte)
+
+     record:  path length (4 bytes), path (no terminator),
+              size (8), mtime seconds (8), mtime nanoseconds (4),
+              hash function (1), contents (1), partial hash bytes (8),
+              partial hash (16, if contents & MANIFEST_HAS_PARTIAL),
+              full hash (16, if contents & MANIFEST_HAS_FULL)
+
+   Nanoseconds are only compared when contents & MANIFEST_HAS_NSEC,
+   as hosts without sub-second file times record them as zero.
+*/
+
+#define MANIFEST_MAGIC "FDUPESMF"
+#define MANIFEST_MAGIC_LENGTH 8
+#define MANIFEST_VERSION 1
+#define MANIFEST_MAX_PATH_LENGTH 65536
+
+#define MANIFEST_HAS_PARTIAL 1
+#define MANIFEST_HAS_FULL    2
+#define MANIFEST_HAS_NSEC    4
+
+/* number of imported entries per cache transaction */
+#define MANIFEST_IMPORT_BATCH 1000
+
+struct manifest_entry
+{
+  char *path;
+  off_t size;
+  time_t mtime;
+  long mtime_nsec;
+  int hashfunction;
+  int contents;
+  off_t partialbytes;
+  md5_byte_t partialhash[HASH_FUNCTION_OUTPUT_LENGTH];
+  md5_byte_t fullhash[HASH_FUNCTION_OUTPUT_LENGTH];
+  size_t order;
+};
+
+struct manifest
+{
+  struct manifest_entry *entries;
+  size_t count;
+  size_t allocated;
+};
+
+/* manifest being filled in by manifest__addsignature */
+static struct manifest *export_manifest;
+static size_t export_rootlength;
+
+static struct manifest_entry *manifest__newentry(struct manifest *manifest)
+{
+  struct manifest_entry *entries;
+  size_t allocated;
+
+  if (manifest->count == manifest->allocated)
+  {
+    allocated = manifest->allocated == 0 ? 1024 : manifest->allocated * 2;
+
+    entries = realloc(manifest->entries, allocated * sizeof(struct manifest_entry));
+    if (entries == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    manifest->entries = entries;
+    manifest->allocated = allocated;
+  }
+
+  memset(&manifest->entries[manifest->count], 0, sizeof(struct manifest_entry));
+  manifest->entries[manifest->count].order = manifest->count;
+
+  return &manifest->entries[manifest->count++];
+}
+
+static void manifest__free(struct manifest *manifest)
+{
+  size_t x;
+
+  for (x = 0; x < manifest->count; ++x)
+    free(manifest->entries[x].path);
+
+  free(manifest->entries);
+
+  manifest->entries = 0;
+  manifest->count = 0;
+  manifest->allocated = 0;
+}
+
+/* order by path, then oldest to newest, then by position in input */
+static int manifest__compare(const void *a, const void *b)
+{
+  const struct manifest_entry *entry1 = a;
+  const struct manifest_entry *entry2 = b;
+  int result;
+
+  result = strcmp(entry1->path, entry2->path);
+  if (result != 0)
+    return result;
+
+  if (entry1->mtime != entry2->mtime)
+    return entry1->mtime < entry2->mtime ? -1 : 1;
+
+  if (entry1->mtime_nsec != entry2->mtime_nsec)
+    return entry1->mtime_nsec < entry2->mtime_nsec ? -1 : 1;
+
+  if (entry1->order != entry2->order)
+    return entry1->order < entry2->order ? -1 : 1;
+
+  return 0;
+}
+
+static int manifest__samefile(const struct manifest_entry *entry1, const struct manifest_entry *entry2)
+{
+  return entry1->size == entry2->size &&
+    entry1->mtime == entry2->mtime &&
+    entry1->mtime_nsec == entry2->mtime_nsec &&
+    entry1->hashfunction == entry2->hashfunction;
+}
+
+/* Sort entries, keeping only the newest entry for each path. Hashes
+   missing from it are taken from older entries describing the same
+   version of the file. */
+static void manifest__sort(struct manifest *manifest)
+{
+  struct manifest_entry *newest;
+  struct manifest_entry *entry;
+  size_t kept;
+  size_t first;
+  size_t last;
+  size_t x;
+
+  qsort(manifest->entries, manifest->count, sizeof(struct manifest_entry), manifest__compare);
+
+  kept = 0;
+  first = 0;
+  while (first < manifest->count)
+  {
+    last = first;
+    while (last + 1 < manifest->count && strcmp(manifest->entries[last + 1].path, manifest->entries[first].path) == 0)
+      ++last;
+
+    newest = &manifest->entries[last];
+
+    for (x = last; x > first; --x)
+    {
+      entry = &manifest->entries[x - 1];
+
+      if (manifest__samefile(entry, newest))
+      {
+        if (!(newest->contents & MANIFEST_HAS_PARTIAL) && (entry->contents & MANIFEST_HAS_PARTIAL))
+        {
+          memcpy(newest->partialhash, entry->partialhash, sizeof(newest->partialhash));
+          newest->partialbytes = entry->partialbytes;
+          newest->contents |= MANIFEST_HAS_PARTIAL;
+        }
+
+        if (!(newest->contents & MANIFEST_HAS_FULL) && (entry->contents & MANIFEST_HAS_FULL))
+        {
+          memcpy(newest->fullhash, entry->fullhash, sizeof(newest->fullhash));
+          newest->contents |= MANIFEST_HAS_FULL;
+        }
+      }
+
+      free(entry->path);
+    }
+
+    manifest->entries[kept++] = *newest;
+
+    first = last + 1;
+  }
+
+  manifest->count = kept;
+}
+
+static int manifest__put(FILE *file, unsigned long long value, int length)
+{
+  unsigned char bytes[8];
+  int x;
+
+  for (x = length - 1; x >= 0; --x) {
+    bytes[x] = value & 0xff;
+    value >>= 8;
+  }
+
+  return fwrite(bytes, length, 1, file) == 1;
+}
+
+static int manifest__get(FILE *file, unsigned long long *value, int length)
+{
+  unsigned char bytes[8];
+  int x;
+
+  if (fread(bytes, length, 1, file) != 1)
+    return 0;
+
+  *value = 0;
+  for (x = 0; x < length; ++x)
+    *value = (*value << 8) | bytes[x];
+
+  return 1;
+}
+
+static int manifest__write(const struct manifest *manifest, const char *path)
+{
+  const struct manifest_entry *entry;
+  FILE *file;
+  size_t length;
+  size_t x;
+  int ok;
+
+  file = fopen(path, "wb");
+  if (file == 0)
+    return 0;
+
+  ok = fwrite(MANIFEST_MAGIC, MANIFEST_MAGIC_LENGTH, 1, file) == 1 &&
+    manifest__put(file, MANIFEST_VERSION, 1);
+
+  for (x = 0; ok && x < manifest->count; ++x)
+  {
+    entry = &manifest->entries[x];
+    length = strlen(entry->path);
+
+    ok = manifest__put(file, length, 4) &&
+      fwrite(entry->path, length, 1, file) == 1 &&
+      manifest__put(file, entry->size, 8) &&
+      manifest__put(file, entry->mtime, 8) &&
+      manifest__put(file, entry->mtime_nsec, 4) &&
+      manifest__put(file, entry->hashfunction, 1) &&
+      manifest__put(file, entry->contents, 1) &&
+      manifest__put(file, entry->partialbytes, 8);
+
+    if (ok && (entry->contents & MANIFEST_HAS_PARTIAL))
+      ok = fwrite(entry->partialhash, sizeof(entry->partialhash), 1, file) == 1;
+
+    if (ok && (entry->contents & MANIFEST_HAS_FULL))
+      ok = fwrite(entry->fullhash, sizeof(entry->fullhash), 1, file) == 1;
+  }
+
+  if (fclose(file) != 0)
+    ok = 0;
+
+  return ok;
+}
+
+/* Append the entries of manifest file path to manifest. */
+static int manifest__read(struct manifest *manifest, const char *path)
+{
+  struct manifest_entry *entry;
+  char magic[MANIFEST_MAGIC_LENGTH];
+  unsigned long long value;
+  FILE *file;
+  int ok;
+  int c;
+
+  file = fopen(path, "rb");
+  if (file == 0)
+    return 0;
+
+  if (fread(magic, MANIFEST_MAGIC_LENGTH, 1, file) != 1 ||
+      memcmp(magic, MANIFEST_MAGIC, MANIFEST_MAGIC_LENGTH) != 0 ||
+      !manifest__get(file, &value, 1) ||
+      value != MANIFEST_VERSION)
+  {
+    fclose(file);
+    return 0;
+  }
+
+  ok = 1;
+  while (ok && (c = getc(file)) != EOF)
+  {
+    ungetc(c, file);
+
+    if (!manifest__get(file, &value, 4) || value == 0 || value > MANIFEST_MAX_PATH_LENGTH)
+    {
+      ok = 0;
+      break;
+    }
+
+    entry = manifest__newentry(manifest);
+
+    entry->path = malloc(value + 1);
+    if (entry->path == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    ok = fread(entry->path, value, 1, file) == 1;
+    entry->path[value] = '\0';
+
+    ok = ok && manifest__get(file, &value, 8);
+    entry->size = value;
+
+    ok = ok && manifest__get(file, &value, 8);
+    entry->mtime = value;
+
+    ok = ok && manifest__get(file, &value, 4);
+    entry->mtime_nsec = value;
+
+    ok = ok && manifest__get(file, &value, 1);
+    entry->hashfunction = value;
+
+    ok = ok && manifest__get(file, &value, 1);
+    entry->contents = value;
+
+    ok = ok && manifest__get(file, &value, 8);
+    entry->partialbytes = value;
+
+    if (ok && (entry->contents & MANIFEST_HAS_PARTIAL))
+      ok = fread(entry->partialhash, sizeof(entry->partialhash), 1, file) == 1;
+
+    if (ok && (entry->contents & MANIFEST_HAS_FULL))
+      ok = fread(entry->fullhash, sizeof(entry->fullhash), 1, file) == 1;
+  }
+
+  fclose(file);
+
+  return ok;
+}
+
+/* Whether path stays beneath the directory it is relative to. */
+static int manifest__isrelative(const char *path)
+{
+  const char *component;
+  size_t length;
+
+  if (*path == '\0' || *path == '/')
+    return 0;
+
+  for (component = path; *component != '\0'; component += length)
+  {
+    length = strcspn(component, "/");
+    if (length == 2 && component[0] == '.' && component[1] == '.')
+      return 0;
+
+    if (component[length] == '/')
+      ++length;
+  }
+
+  return 1;
+}
+
+static int manifest__addsignature(const char *directory, const char *filename, const struct hashdb_signature *signature)
+{
+  struct manifest_entry *entry;
+  const char *relative;
+
+  if (signature->partialhash == 0 && signature->fullhash == 0)
+    return 1;
+
+  /* path relative to root, which is either the root itself or a prefix
+     of directory followed by a slash (unless root is "/") */
+  relative = directory + export_rootlength;
+  if (*relative == '/')
+    ++relative;
+
+  entry = manifest__newentry(export_manifest);
+
+  entry->path = malloc(strlen(relative) + strlen(filename) + 2);
+  if (entry->path == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  strcpy(entry->path, relative);
+  if (*relative != '\0')
+    strcat(entry->path, "/");
+  strcat(entry->path, filename);
+
+  entry->size = signature->size;
+  entry->mtime = signature->mtime;
+  entry->mtime_nsec = signature->mtime_nsec;
+  entry->hashfunction = signature->hashfunction;
+  entry->partialbytes = signature->partialbytes;
+
+#ifdef HAVE_NSEC_TIMES
+  entry->contents |= MANIFEST_HAS_NSEC;
+#endif
+
+  if (signature->partialhash != 0)
+  {
+    memcpy(entry->partialhash, signature->partialhash, sizeof(entry->partialhash));
+    entry->contents |= MANIFEST_HAS_PARTIAL;
+  }
+
+  if (signature->fullhash != 0)
+  {
+    memcpy(entry->fullhash, signature->fullhash, sizeof(entry->fullhash));
+    entry->contents |= MANIFEST_HAS_FULL;
+  }
+
+  return 1;
+}
+
+/* Write the signatures of all cached files at or below root to a
+   manifest at path. */
+int manifest_export(sqlite3 *db, const char *root, const char *path)
+{
+  struct manifest manifest = {0, 0, 0};
+  char *realroot;
+  int result;
+
+  realroot = getrealpath(root, 0);
+  if (realroot == 0)
+    return 0;
+
+  export_manifest = &manifest;
+  export_rootlength = strcmp(realroot, "/") == 0 ? 0 : strlen(realroot);
+
+  result = hashdb_foreachsignature(db, realroot, manifest__addsignature);
+
+  free(realroot);
+
+  if (result)
+  {
+    manifest__sort(&manifest);
+    result = manifest__write(&manifest, path);
+  }
+
+  manifest__free(&manifest);
+
+  return result;
+}
+
+/* Seed the cache with the signatures from the manifest at path, for
+   files below root whose size and modification time still match. The
+   modification time is compared to the second only when the manifest
+   was produced on a host that does not record nanoseconds. */
+int manifest_import(sqlite3 *db, const char *root, const char *path)
+{
+  struct manifest manifest = {0, 0, 0};
+  struct manifest_entry *entry;
+  md5_byte_t *partialhash;
+  md5_byte_t *fullhash;
+  md5_byte_t *cachedpartialhash;
+  md5_byte_t *cachedfullhash;
+  struct stat info;
+  file_t file;
+  size_t rootlength;
+  size_t batch;
+  size_t x;
+
+  if (!manifest__read(&manifest, path))
+  {
+    manifest__free(&manifest);
+    return 0;
+  }
+
+  rootlength = strlen(root);
+
+  batch = 0;
+  for (x = 0; x < manifest.count && !got_sigint; ++x)
+  {
+    entry = &manifest.entries[x];
+
+    if (entry->hashfunction != HASH_FUNCTION_MD5 && entry->hashfunction != HASH_FUNCTION_MD5_TREE)
+      continue;
+
+    /* never look outside root on behalf of another host */
+    if (!manifest__isrelative(entry->path))
+      continue;
+
+    file.d_name = malloc(rootlength + strlen(entry->path) + 2);
+    if (file.d_name == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    strcpy(file.d_name, root);
+    if (rootlength == 0 || root[rootlength - 1] != '/')
+      strcat(file.d_name, "/");
+    strcat(file.d_name, entry->path);
+
+    if (stat(file.d_name, &info) != 0 ||
+        !S_ISREG(info.st_mode) ||
+        info.st_size != entry->size ||
+        info.st_mtime != entry->mtime
+#ifdef HAVE_NSEC_TIMES
+        || ((entry->contents & MANIFEST_HAS_NSEC) && info.st_mtim.tv_nsec != entry->mtime_nsec)
+#endif
+       )
+    {
+      free(file.d_name);
+      continue;
+    }
+
+    file.size = info.st_size;
+    file.device = info.st_dev;
+    file.inode = info.st_ino;
+    file.mtime = info.st_mtime;
+    file.ctime = info.st_ctime;
+#ifdef HAVE_NSEC_TIMES
+    file.mtime_nsec = info.st_mtim.tv_nsec;
+    file.ctime_nsec = info.st_ctim.tv_nsec;
+#else
+    file.mtime_nsec = 0;
+    file.ctime_nsec = 0;
+#endif
+
+    partialhash = 0;
+    if ((entry->contents & MANIFEST_HAS_PARTIAL) && entry->partialbytes == PARTIAL_MD5_SIZE)
+      partialhash = entry->partialhash;
+
+    fullhash = 0;
+    if (entry->contents & MANIFEST_HAS_FULL)
+      fullhash = entry->fullhash;
+
+    /* keep whatever the local cache already knows about the file */
+    cachedpartialhash = 0;
+    cachedfullhash = 0;
+    hashdb_loadhash(db, &file, entry->hashfunction, &cachedpartialhash, &cachedfullhash);
+
+    if (partialhash == 0)
+      partialhash = cachedpartialhash;
+
+    if (fullhash == 0)
+      fullhash = cachedfullhash;
+
+    if (partialhash != 0 || fullhash != 0)
+    {
+      if (batch == 0)
+        hashdb_begintransaction(db);
+
+      hashdb_savehash(db, &file, entry->hashfunction, partialhash, fullhash);
+
+      if (++batch == MANIFEST_IMPORT_BATCH)
+      {
+        hashdb_committransaction(db);
+        batch = 0;
+      }
+    }
+
+    free(cachedpartialhash);
+    free(cachedfullhash);
+    free(file.d_name);
+  }
+
+  if (batch != 0)
+    hashdb_committransaction(db);
+
+  manifest__free(&manifest);
+
+  return 1;
+}
+
+/* Combine the manifests named in inputs into a single manifest. Where
+   several describe the same path, the entry with the most recent
+   modification time wins; on a tie, the one named last. */
+int manifest_merge(char **inputs, int count, const char *output)
+{
+  struct manifest manifest = {0, 0, 0};
+  int result;
+  int x;
+
+  for (x = 0; x < count; ++x)
+  {
+    if (!manifest__read(&manifest, inputs[x]))
+    {
+      errormsg("could not read manifest %s\n", inputs[x]);
+      manifest__free(&manifest);
+      return 0;
+    }
+  }
+
+  manifest__sort(&manifest);
+  result = manifest__write(&manifest, output);
+
+  manifest__free(&manifest);
+
+  return result;
+}
+
+/* Call callback for every entry in the manifest at path. */
+int manifest_foreachentry(const char *path, int (*callback)(const char*, const struct hashdb_signature*))
+{
+  struct manifest manifest = {0, 0, 0};
+  struct manifest_entry *entry;
+  struct hashdb_signature signature;
+  size_t x;
+
+  if (!manifest__read(&manifest, path))
+  {
+    manifest__free(&manifest);
+    return 0;
+  }
+
+  for (x = 0; x < manifest.count; ++x)
+  {
+    entry = &manifest.entries[x];
+
+    signature.size = entry->size;
+    signature.mtime = entry->mtime;
+    signature.mtime_nsec = entry->mtime_nsec;
+    signature.hashfunction = entry->hashfunction;
+    signature.partialbytes = entry->partialbytes;
+    signature.partialhash = (entry->contents & MANIFEST_HAS_PARTIAL) ? entry->partialhash : 0;
+    signature.fullhash = (entry->contents & MANIFEST_HAS_FULL) ? entry->fullhash : 0;
+
+    if (!callback(entry->path, &signature))
+      break;
+  }
+
+  manifest__free(&manifest);
+
+  return 1;
+}
@@ -24,24 +24,16 @@
 #include "ncurses-commands.h"
 #include "fileaction.h"
 #include "flags.h"
-#include "confirmmatch.h"
 #include "errormsg.h"
 #include "wcs.h"
 #include "mbstowcs_escape_invalid.h"
 #include "log.h"
-#include "removeifnotchanged.h"
-#ifndef NO_SQLITE
-  #include "hashdb.h"
-  #include "getrealpath.h"
-#endif
+#include "deletion.h"
 #include <wchar.h>
 #include <pcre2.h>
 
-#ifndef NO_SQLITE
-extern sqlite3 *db;
-#endif
-
 void set_file_action(struct groupfile *file, int new_action, size_t *deletion_tally);
+int confirmfiles(file_t *file1, file_t *file2);
 
 struct command_map command_list[] = {
   {L"sel", COMMAND_SELECT_CONTAINING},
@@ -710,12 +702,11 @@ int cmd_prune(struct filegroup *groups, int groupcount, wchar_t *commandargument
   int adjusttopline;
   int toplineoffset;
   int groupfirstline;
-  FILE *file1;
-  FILE *file2;
   int ismatch;
   wchar_t *statuscopy;
   struct groupfile *firstnotdeleted;
-  char *deletepath;
+  file_t *target;
+  int t;
 
   if (logfile != 0)
     loginfo = log_open(logfile, 0);
@@ -759,10 +750,6 @@ int cmd_prune(struct filegroup *groups, int groupcount, wchar_t *commandargument
     if (loginfo)
       log_begin_set(loginfo);
 
-#ifndef NO_SQLITE
-    hashdb_begintransaction(db);
-#endif
-
     /* delete files marked for deletion unless no files left undeleted */
     if (deletecount < groups[g].filecount)
     {
@@ -770,53 +757,47 @@ int cmd_prune(struct filegroup *groups, int groupcount, wchar_t *commandargument
       {
         if (groups[g].files[f].action == FILEACTION_DELETE)
         {
+          target = 0;
+
+          /* with --link, link to a file left on the same device if possible */
+          if (ISFLAG(flags, F_LINKFILES))
+          {
+            target = firstnotdeleted->file;
+
+            for (t = 0; t < groups[g].filecount; ++t)
+            {
+              if (groups[g].files[t].action != FILEACTION_DELETE &&
+                  groups[g].files[t].file->device == groups[g].files[f].file->device)
+              {
+                target = groups[g].files[t].file;
+                break;
+              }
+            }
+          }
+
           if (ISFLAG(flags, F_DEFERCONFIRMATION) && !ISFLAG(flags, F_NOCONFIRMATION))
           {
             format_status_left(status, L"Confirming duplicates...");
             print_status(statuswin, status);
             wrefresh(statuswin);
 
-            file1 = fopen(groups[g].files[f].file->d_name, "rb");
-            file2 = fopen(firstnotdeleted->file->d_name, "rb");
-
-            if (file1 && file2)
-              ismatch = confirmmatch(file1, file2);
-            else
-              ismatch = 0;
-
-            if (file2)
-              fclose(file2);
-
-            if (file1)
-              fclose(file1);
+            ismatch = confirmfiles(groups[g].files[f].file, target != 0 ? target : firstnotdeleted->file) == 1;
           }
           else
           {
             ismatch = 1;
           }
 
-#ifndef NO_SQLITE
-          if (ismatch && db)
-          {
-            deletepath = getrealpath(groups[g].files[f].file->d_name, GETREALPATH_IGNORE_MISSING_BASENAME);
-            if (deletepath != 0)
-            {
-              if (!ISFLAG(flags, F_READONLYCACHE))
-                hashdb_deletehashforpath(db, deletepath);
-
-              free(deletepath);
-            }
-          }
-#endif
-
-          if (ismatch && removeifnotchanged(groups[g].files[f].file, 0) == 0)
+          if (ismatch && deletion_replace(groups[g].files[f].file, target, 0) == 0)
           {
             set_file_action(&groups[g].files[f], FILEACTION_DELIST, deletiontally);
 
             deletedbytes += groups[g].files[f].file->size;
             ++totaldeleted;
 
-            if (loginfo)
+            if (loginfo && target != 0)
+              log_file_linked(loginfo, groups[g].files[f].file->d_name);
+            else if (loginfo)
               log_file_deleted(loginfo, groups[g].files[f].file->d_name);
           }
           else
@@ -841,10 +822,6 @@ int cmd_prune(struct filegroup *groups, int groupcount, wchar_t *commandargument
       deletecount = 0;
     }
 
-#ifndef NO_SQLITE
-    hashdb_committransaction(db);
-#endif
-
     if (loginfo)
       log_end_set(loginfo);
 
@@ -878,17 +855,19 @@ int cmd_prune(struct filegroup *groups, int groupcount, wchar_t *commandargument
       *cursorfile = groups[g].filecount - 1;
   }
 
+  deletion_finish();
+
   if (loginfo != 0)
     log_close(loginfo);
 
   if (deletedbytes < 1000.0)
-    format_status_left(status, L"Deleted %ld files (occupying %.0f bytes)%c", totaldeleted, deletedbytes, totalfailed ? ';' : '.');
+    format_status_left(status, L"%S %ld files (occupying %.0f bytes)%c", ISFLAG(flags, F_LINKFILES) ? L"Linked" : L"Deleted", totaldeleted, deletedbytes, totalfailed ? ';' : '.');
   else if (deletedbytes <= (1000.0 * 1000.0))
-    format_status_left(status, L"Deleted %ld files (occupying %.1f KB)%c", totaldeleted, deletedbytes / 1000.0, totalfailed ? ';' : '.');
+    format_status_left(status, L"%S %ld files (occupying %.1f KB)%c", ISFLAG(flags, F_LINKFILES) ? L"Linked" : L"Deleted", totaldeleted, deletedbytes / 1000.0, totalfailed ? ';' : '.');
   else if (deletedbytes <= (1000.0 * 1000.0 * 1000.0))
-    format_status_left(status, L"Deleted %ld files (occupying %.1f MB)%c", totaldeleted, deletedbytes / (1000.0 * 1000.0), totalfailed ? ';' : '.');
+    format_status_left(status, L"%S %ld files (occupying %.1f MB)%c", ISFLAG(flags, F_LINKFILES) ? L"Linked" : L"Deleted", totaldeleted, deletedbytes / (1000.0 * 1000.0), totalfailed ? ';' : '.');
   else
-    format_status_left(status, L"Deleted %ld files (occupying %.1f GB)%c", totaldeleted, deletedbytes / (1000.0 * 1000.0 * 1000.0), totalfailed ? ';' : '.');
+    format_status_left(status, L"%S %ld files (occupying %.1f GB)%c", ISFLAG(flags, F_LINKFILES) ? L"Linked" : L"Deleted", totaldeleted, deletedbytes / (1000.0 * 1000.0 * 1000.0), totalfailed ? ';' : '.');
 
   if (totalfailed > 0)
   {
@@ -541,6 +541,9 @@ void deletefiles_ncurses(file_t *files, char *logfile)
       groups[totalgroups].files[groupfilecount].file = dupefile;
       groups[totalgroups].files[groupfilecount].action = FILEACTION_UNRESOLVED;
       groups[totalgroups].files[groupfilecount].selected = 0;
+
+      /* actions restored from saved results count toward pending deletions */
+      set_file_action(&groups[totalgroups].files[groupfilecount], dupefile->action, &globaldeletiontally);
       ++groupfilecount;
 
       dupefile = dupefile->duplicates;
@@ -1328,6 +1331,11 @@ void deletefiles_ncurses(file_t *files, char *logfile)
   free_command_identifier_tree(commandidentifier);
   free_command_identifier_tree(confirmationkeywordidentifier);
 
+  /* keep actions chosen for files that remain, so they can be saved */
+  for (g = 0; g < totalgroups; ++g)
+    for (f = 0; f < groups[g].filecount; ++f)
+      groups[g].files[f].file->action = groups[g].files[f].action;
+
   for (g = 0; g < totalgroups; ++g)
     free(groups[g].files);
 
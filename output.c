@@ -0,0 +1,217 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "output.h"
+#include "errormsg.h"
+#include "flags.h"
+
+/* size of the buffer standing between stdout and anything but a terminal */
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+char *fmttime(time_t t);
+
+static int output_format = OUTPUT_TEXT;
+
+void output_open(int format)
+{
+  static char *buffer = 0;
+
+  output_format = format;
+
+  if (!isatty(fileno(stdout)) && buffer == 0)
+  {
+    buffer = (char*) malloc(OUTPUT_BUFFER_SIZE);
+    if (buffer == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    setvbuf(stdout, buffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+  }
+}
+
+void output_flush()
+{
+  fflush(stdout);
+}
+
+/* Write name, escaping characters in escape_list with a backslash. */
+static void output__escaped(const char *name, const char *escape_list)
+{
+  for (; *name != '\0'; ++name)
+  {
+    if (strchr(escape_list, *name) != 0)
+      putchar('\\');
+
+    putchar(*name);
+  }
+}
+
+static void output__textfile(const file_t *file)
+{
+  if (ISFLAG(flags, F_SHOWTIME))
+    printf("%s ", fmttime(file->mtime));
+
+  if (ISFLAG(flags, F_DSAMELINE))
+    output__escaped(file->d_name, "\\ ");
+  else
+    fputs(file->d_name, stdout);
+
+  putchar(ISFLAG(flags, F_DSAMELINE) ? ' ' : '\n');
+}
+
+static void output__text(const file_t *files)
+{
+  const file_t *tmpfile;
+
+  if (!ISFLAG(flags, F_OMITFIRST)) {
+    if (ISFLAG(flags, F_SHOWSIZE)) printf("%lld byte%seach:\n", (long long int)files->size,
+      (files->size != 1) ? "s " : " ");
+    output__textfile(files);
+  }
+
+  for (tmpfile = files->duplicates; tmpfile != NULL; tmpfile = tmpfile->duplicates)
+    output__textfile(tmpfile);
+
+  putchar('\n');
+}
+
+/* Write name as a JSON string. Bytes that are not part of valid UTF-8
+   are written as lone surrogates U+DC80 to U+DCFF, as Python's
+   "surrogateescape" error handler does, so names can be recovered. */
+static void output__jsonstring(const char *name)
+{
+  const unsigned char *c = (const unsigned char*) name;
+  int length;
+  int x;
+
+  putchar('"');
+
+  while (*c != '\0')
+  {
+    if (*c == '"' || *c == '\\') {
+      putchar('\\');
+      putchar(*c++);
+      continue;
+    }
+
+    if (*c < 0x20) {
+      printf("\\u%04x", *c++);
+      continue;
+    }
+
+    if (*c < 0x80) {
+      putchar(*c++);
+      continue;
+    }
+
+    if (*c >= 0xc2 && *c <= 0xdf)
+      length = 2;
+    else if (*c >= 0xe0 && *c <= 0xef)
+      length = 3;
+    else if (*c >= 0xf0 && *c <= 0xf4)
+      length = 4;
+    else
+      length = 0;
+
+    for (x = 1; x < length; ++x)
+      if ((c[x] & 0xc0) != 0x80)
+        length = 0;
+
+    /* reject overlong forms, surrogates and code points beyond U+10FFFF */
+    if ((length == 3 && c[0] == 0xe0 && c[1] < 0xa0) ||
+        (length == 3 && c[0] == 0xed && c[1] >= 0xa0) ||
+        (length == 4 && c[0] == 0xf0 && c[1] < 0x90) ||
+        (length == 4 && c[0] == 0xf4 && c[1] >= 0x90))
+      length = 0;
+
+    if (length == 0) {
+      printf("\\udc%02x", *c++);
+      continue;
+    }
+
+    fwrite(c, length, 1, stdout);
+    c += length;
+  }
+
+  putchar('"');
+}
+
+static void output__jsonl(const file_t *files)
+{
+  const file_t *tmpfile;
+
+  printf("{\"size\":%lld,\"files\":[", (long long int)files->size);
+
+  output__jsonstring(files->d_name);
+
+  for (tmpfile = files->duplicates; tmpfile != NULL; tmpfile = tmpfile->duplicates)
+  {
+    putchar(',');
+    output__jsonstring(tmpfile->d_name);
+  }
+
+  fputs("]}\n", stdout);
+}
+
+/* Each name is followed by a NUL, and each set by another. */
+static void output__nul(const file_t *files)
+{
+  const file_t *tmpfile;
+
+  if (!ISFLAG(flags, F_OMITFIRST)) {
+    fputs(files->d_name, stdout);
+    putchar('\0');
+  }
+
+  for (tmpfile = files->duplicates; tmpfile != NULL; tmpfile = tmpfile->duplicates)
+  {
+    fputs(tmpfile->d_name, stdout);
+    putchar('\0');
+  }
+
+  putchar('\0');
+}
+
+/* Write the set of matches headed by files in the selected format. */
+void output_group(file_t *files)
+{
+  switch (output_format)
+  {
+    case OUTPUT_JSONL:
+      output__jsonl(files);
+      break;
+
+    case OUTPUT_NUL:
+      output__nul(files);
+      break;
+
+    default:
+      output__text(files);
+      break;
+  }
+}
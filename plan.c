@@ -0,0 +1,390 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "plan.h"
+#include "fileaction.h"
+#include "errormsg.h"
+
+/* A deletion plan records which files of each set of matches are to be
+   kept and which deleted, so that the decisions can be reviewed (and
+   edited) before being carried out by a later run. It is a text file
+   whose first line is the header below, with one line per file and sets
+   separated by blank lines. Lines starting with '#' are ignored. Each
+   file's line reads
+
+     ACTION DEVICE INODE SIZE MTIME.NSEC CTIME.NSEC NAME
+
+   where ACTION is "keep" or "delete". As in md5sum output, a line whose
+   name contains a newline or backslash starts with a backslash, and
+   these characters appear in the name as "\n" and "\\".
+*/
+
+#define PLAN_HEADER "fdupes deletion plan 1"
+
+struct plan
+{
+  FILE *file;
+  char *path;
+  char *temporary;
+};
+
+/* Start writing a plan to a temporary file renamed to path once
+   plan_finish() succeeds, so that an interrupted run never leaves a
+   partial plan behind. Returns 0 if the file cannot be created. */
+struct plan *plan_create(const char *path)
+{
+  struct plan *plan;
+
+  plan = (struct plan*) malloc(sizeof(struct plan));
+  if (plan == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  plan->path = strdup(path);
+  plan->temporary = (char*) malloc(strlen(path) + 5);
+  if (plan->path == 0 || plan->temporary == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  strcpy(plan->temporary, path);
+  strcat(plan->temporary, ".tmp");
+
+  plan->file = fopen(plan->temporary, "w");
+  if (plan->file == 0 || fprintf(plan->file, "%s\n", PLAN_HEADER) < 0)
+  {
+    if (plan->file != 0)
+    {
+      fclose(plan->file);
+      remove(plan->temporary);
+    }
+
+    free(plan->path);
+    free(plan->temporary);
+    free(plan);
+    return 0;
+  }
+
+  return plan;
+}
+
+static int plan__writename(FILE *file, const char *name)
+{
+  for (; *name != '\0'; ++name)
+  {
+    if (*name == '\n')
+    {
+      if (fputs("\\n", file) == EOF)
+        return 0;
+    }
+    else if (*name == '\\')
+    {
+      if (fputs("\\\\", file) == EOF)
+        return 0;
+    }
+    else if (putc(*name, file) == EOF)
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Add a set of matches, keeping those members whose preserve flag is set. */
+int plan_writeset(struct plan *plan, file_t **members, const int *preserve, int count)
+{
+  const file_t *member;
+  int escaped;
+  int x;
+
+  for (x = 0; x < count; ++x)
+  {
+    member = members[x];
+
+    escaped = strpbrk(member->d_name, "\n\\") != 0;
+
+    if (fprintf(plan->file, "%s%s %llu %llu %lld %lld.%09ld %lld.%09ld ",
+          escaped ? "\\" : "",
+          preserve[x] ? "keep" : "delete",
+          (unsigned long long) member->device,
+          (unsigned long long) member->inode,
+          (long long) member->size,
+          (long long) member->mtime, member->mtime_nsec,
+          (long long) member->ctime, member->ctime_nsec) < 0)
+      return 0;
+
+    if (escaped)
+    {
+      if (!plan__writename(plan->file, member->d_name))
+        return 0;
+    }
+    else if (fputs(member->d_name, plan->file) == EOF)
+      return 0;
+
+    if (putc('\n', plan->file) == EOF)
+      return 0;
+  }
+
+  return putc('\n', plan->file) != EOF;
+}
+
+/* Complete the plan and put it in place, or discard it on failure. */
+int plan_finish(struct plan *plan)
+{
+  int ok;
+
+  ok = fclose(plan->file) == 0;
+
+  if (ok)
+    ok = rename(plan->temporary, plan->path) == 0;
+
+  if (!ok)
+    remove(plan->temporary);
+
+  free(plan->path);
+  free(plan->temporary);
+  free(plan);
+
+  return ok;
+}
+
+static void plan__unescape(char *name)
+{
+  char *from = name;
+  char *to = name;
+
+  while (*from != '\0')
+  {
+    if (from[0] == '\\' && from[1] == 'n') {
+      *to++ = '\n';
+      from += 2;
+    } else if (from[0] == '\\' && from[1] == '\\') {
+      *to++ = '\\';
+      from += 2;
+    } else {
+      *to++ = *from++;
+    }
+  }
+
+  *to = '\0';
+}
+
+/* Parse the line for one file, or return 0 if it is malformed. */
+static file_t *plan__parseline(char *line)
+{
+  file_t *member;
+  char action[7];
+  unsigned long long device;
+  unsigned long long inode;
+  long long size;
+  long long mtime;
+  long mtime_nsec;
+  long long ctime;
+  long ctime_nsec;
+  int escaped;
+  int offset;
+
+  escaped = line[0] == '\\';
+  if (escaped)
+    ++line;
+
+  offset = -1;
+  if (sscanf(line, "%6s %llu %llu %lld %lld.%9ld %lld.%9ld %n", action, &device, &inode,
+        &size, &mtime, &mtime_nsec, &ctime, &ctime_nsec, &offset) != 8 || offset < 0 ||
+      line[offset] == '\0')
+    return 0;
+
+  if (strcmp(action, "keep") != 0 && strcmp(action, "delete") != 0)
+    return 0;
+
+  member = (file_t*) malloc(sizeof(file_t));
+  if (member == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  memset(member, 0, sizeof(file_t));
+
+  member->d_name = strdup(line + offset);
+  if (member->d_name == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  if (escaped)
+    plan__unescape(member->d_name);
+
+  member->device = (dev_t) device;
+  member->inode = (ino_t) inode;
+  member->size = (off_t) size;
+  member->mtime = (time_t) mtime;
+  member->mtime_nsec = mtime_nsec;
+  member->ctime = (time_t) ctime;
+  member->ctime_nsec = ctime_nsec;
+  member->action = strcmp(action, "keep") == 0 ? FILEACTION_KEEP : FILEACTION_DELETE;
+
+  return member;
+}
+
+static void plan__freefiles(file_t *files)
+{
+  file_t *next;
+
+  while (files != 0)
+  {
+    next = files->next;
+    free(files->d_name);
+    free(files);
+    files = next;
+  }
+}
+
+/* Load the sets of matches in the plan at path into files, with each
+   file's action set to FILEACTION_KEEP or FILEACTION_DELETE. Returns 0,
+   after reporting the problem, if the plan cannot be read or a set in it
+   keeps no file. */
+int plan_load(const char *path, file_t **files)
+{
+  FILE *file;
+  char *line = 0;
+  size_t linesize = 0;
+  size_t length;
+  unsigned long linenumber = 0;
+  file_t *member;
+  file_t *head = 0;
+  file_t *last = 0;
+  file_t **tail;
+  int kept = 0;
+  int sawheader = 0;
+  int ended = 0;
+  int ok = 1;
+
+  *files = 0;
+  tail = files;
+
+  file = fopen(path, "r");
+  if (file == 0)
+  {
+    errormsg("could not open plan %s\n", path);
+    return 0;
+  }
+
+  while (ok)
+  {
+    if (getline(&line, &linesize, file) == -1)
+    {
+      if (ferror(file))
+      {
+        errormsg("could not read plan %s\n", path);
+        ok = 0;
+        break;
+      }
+
+      if (line != 0)
+        line[0] = '\0';
+
+      ended = 1;
+    }
+    else
+      ++linenumber;
+
+    length = line != 0 ? strlen(line) : 0;
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+      line[--length] = '\0';
+
+    if (!sawheader)
+    {
+      if (ended || strcmp(line, PLAN_HEADER) != 0)
+      {
+        errormsg("%s doesn't look like an fdupes deletion plan\n", path);
+        ok = 0;
+        break;
+      }
+
+      sawheader = 1;
+      continue;
+    }
+
+    if (line[0] == '#')
+      continue;
+
+    /* a blank line, or the end of the plan, ends the current set */
+    if (length == 0)
+    {
+      if (head != 0 && kept == 0)
+      {
+        errormsg("set ending at line %lu of plan %s keeps no file\n", linenumber, path);
+        ok = 0;
+      }
+
+      head = 0;
+      kept = 0;
+
+      if (ended)
+        break;
+
+      continue;
+    }
+
+    member = plan__parseline(line);
+    if (member == 0)
+    {
+      errormsg("could not parse line %lu of plan %s\n", linenumber, path);
+      ok = 0;
+      break;
+    }
+
+    if (member->action == FILEACTION_KEEP)
+      ++kept;
+
+    if (head == 0)
+    {
+      head = member;
+      head->hasdupes = 1;
+    }
+    else
+      last->duplicates = member;
+
+    last = member;
+
+    *tail = member;
+    tail = &member->next;
+  }
+
+  free(line);
+  fclose(file);
+
+  if (!ok)
+  {
+    plan__freefiles(*files);
+    *files = 0;
+  }
+
+  return ok;
+}
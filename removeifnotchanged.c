@@ -25,25 +25,41 @@
 #include <string.h>
 #include <stdio.h>
 
+/* Tell whether st shows a size, times or inode other than those
+   recorded for file. */
+int statchanged(const file_t *file, const struct stat *st)
+{
+  return file->device != st->st_dev ||
+      file->inode != st->st_ino ||
+      file->ctime != st->st_ctime ||
+      file->mtime != st->st_mtime ||
+#ifdef HAVE_NSEC_TIMES
+      file->ctime_nsec != st->st_ctim.tv_nsec ||
+      file->mtime_nsec != st->st_mtim.tv_nsec ||
+#endif
+      file->size != st->st_size;
+}
+
+/* Tell whether file is missing, or no longer has the size, times and
+   inode recorded for it. */
+int haschanged(const file_t *file)
+{
+  struct stat st;
+
+  if (stat(file->d_name, &st) != 0)
+    return 1;
+
+  return statchanged(file, &st);
+}
+
 int removeifnotchanged(const file_t *file, char **errorstring)
 {
   int result;
-  struct stat st;
 
   static char *filechanged = "File contents changed during processing";
   static char *unknownerror = "Unknown error";
 
-  stat(file->d_name, &st);
-
-  if (file->device != st.st_dev ||
-      file->inode != st.st_ino ||
-      file->ctime != st.st_ctime ||
-      file->mtime != st.st_mtime ||
-#ifdef HAVE_NSEC_TIMES
-      file->ctime_nsec != st.st_ctim.tv_nsec ||
-      file->mtime_nsec != st.st_mtim.tv_nsec ||
-#endif
-      file->size != st.st_size)
+  if (haschanged(file))
   {
     if (errorstring != 0)
         *errorstring = filechanged;
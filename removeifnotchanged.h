@@ -24,6 +24,8 @@
 
 #include "fdupes.h"
 
+int statchanged(const file_t *file, const struct stat *st);
+int haschanged(const file_t *file);
 int removeifnotchanged(const file_t *file, char **errorstring);
 
 #endif
\ No newline at end of file
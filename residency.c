@@ -0,0 +1,93 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+/* for mincore */
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef HAVE_MINCORE
+#include <sys/mman.h>
+#endif
+#include "residency.h"
+#include "errormsg.h"
+
+/* Tell whether the first RESIDENCY_PROBE_SIZE bytes of a file open for
+   reading as fd, or all of it if smaller, are in the page cache. Pages
+   are mapped but never touched, so nothing is read from the file. */
+int residency_check(int fd, off_t size)
+{
+#ifdef HAVE_MINCORE
+  unsigned char *vector;
+  long pagesize;
+  size_t length;
+  size_t pages;
+  size_t x;
+  void *map;
+  int result;
+
+  if (size == 0)
+    return RESIDENCY_RESIDENT;
+
+  pagesize = sysconf(_SC_PAGESIZE);
+  if (pagesize <= 0)
+    return RESIDENCY_UNKNOWN;
+
+  length = size < RESIDENCY_PROBE_SIZE ? (size_t) size : RESIDENCY_PROBE_SIZE;
+  pages = (length + pagesize - 1) / pagesize;
+
+  vector = (unsigned char*) malloc(pages);
+  if (vector == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  map = mmap(0, length, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    free(vector);
+    return RESIDENCY_UNKNOWN;
+  }
+
+  if (mincore(map, length, vector) == 0)
+  {
+    result = RESIDENCY_RESIDENT;
+
+    for (x = 0; x < pages; ++x)
+      if ((vector[x] & 1) == 0)
+        result = RESIDENCY_COLD;
+  }
+  else
+  {
+    result = RESIDENCY_UNKNOWN;
+  }
+
+  munmap(map, length);
+  free(vector);
+
+  return result;
+#else
+  return RESIDENCY_UNKNOWN;
+#endif
+}
@@ -0,0 +1,376 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "results.h"
+#include "fileaction.h"
+#include "errormsg.h"
+#include "removeifnotchanged.h"
+
+/* A results file records the sets of matches found by a run, along
+   with the actions chosen for their members so far, so that they can be
+   reviewed again without rescanning. Members are identified by name and
+   by the stat() fields that tell whether they have changed since. All
+   integers are stored most significant byte first:
+
+     header:  "FDUPESRS", format version (1 byte)
+
+     group:   size (8 bytes), signature known (1), signature (16),
+              member count (4)
+
+     member:  device (8), inode (8), modification time (8 + 4),
+              status change time (8 + 4), action (1), name length (4),
+              then the name
+*/
+
+#define RESULTS_MAGIC "FDUPESRS"
+#define RESULTS_MAGIC_LENGTH 8
+#define RESULTS_VERSION 1
+#define RESULTS_MAX_NAME_LENGTH 65536
+#define RESULTS_MAX_MEMBERS 16777216
+
+#define MD5_DIGEST_LENGTH 16
+
+static int results__put(FILE *file, unsigned long long value, int length)
+{
+  unsigned char bytes[8];
+  int x;
+
+  for (x = length - 1; x >= 0; --x) {
+    bytes[x] = value & 0xff;
+    value >>= 8;
+  }
+
+  return fwrite(bytes, length, 1, file) == 1;
+}
+
+static int results__get(FILE *file, unsigned long long *value, int length)
+{
+  unsigned char bytes[8];
+  int x;
+
+  if (fread(bytes, length, 1, file) != 1)
+    return 0;
+
+  *value = 0;
+  for (x = 0; x < length; ++x)
+    *value = (*value << 8) | bytes[x];
+
+  return 1;
+}
+
+static int results__putmember(FILE *file, const file_t *member)
+{
+  size_t length;
+  int action;
+
+  /* only decisions survive; files delisted or not deleted are undecided */
+  action = member->action;
+  if (action != FILEACTION_KEEP && action != FILEACTION_DELETE)
+    action = FILEACTION_UNRESOLVED;
+
+  length = strlen(member->d_name);
+
+  return results__put(file, member->device, 8) &&
+    results__put(file, member->inode, 8) &&
+    results__put(file, member->mtime, 8) &&
+    results__put(file, member->mtime_nsec, 4) &&
+    results__put(file, member->ctime, 8) &&
+    results__put(file, member->ctime_nsec, 4) &&
+    results__put(file, action & 0xff, 1) &&
+    results__put(file, length, 4) &&
+    fwrite(member->d_name, length, 1, file) == 1;
+}
+
+/* Write the sets of matches in files to a temporary file renamed over
+   path once complete, so that an interrupted run never leaves a damaged
+   results file behind. */
+int results_save(file_t *files, const char *path)
+{
+  static const md5_byte_t nosignature[MD5_DIGEST_LENGTH] = { 0 };
+  const md5_byte_t *signature;
+  file_t *tmpfile;
+  char *temporary;
+  FILE *file;
+  size_t count;
+  int ok;
+
+  temporary = (char*) malloc(strlen(path) + 5);
+  if (temporary == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  strcpy(temporary, path);
+  strcat(temporary, ".tmp");
+
+  file = fopen(temporary, "wb");
+  if (file == 0)
+  {
+    free(temporary);
+    return 0;
+  }
+
+  ok = fwrite(RESULTS_MAGIC, RESULTS_MAGIC_LENGTH, 1, file) == 1 &&
+    results__put(file, RESULTS_VERSION, 1);
+
+  for (; ok && files != 0; files = files->next)
+  {
+    if (!files->hasdupes)
+      continue;
+
+    signature = files->crcsignature;
+    count = 1;
+
+    for (tmpfile = files->duplicates; tmpfile != 0; tmpfile = tmpfile->duplicates)
+    {
+      if (signature == 0)
+        signature = tmpfile->crcsignature;
+
+      ++count;
+    }
+
+    ok = results__put(file, files->size, 8) &&
+      results__put(file, signature != 0, 1) &&
+      fwrite(signature != 0 ? signature : nosignature, MD5_DIGEST_LENGTH, 1, file) == 1 &&
+      results__put(file, count, 4);
+
+    for (tmpfile = files; ok && tmpfile != 0; tmpfile = tmpfile->duplicates)
+      ok = results__putmember(file, tmpfile);
+  }
+
+  if (fclose(file) != 0)
+    ok = 0;
+
+  if (ok)
+    ok = rename(temporary, path) == 0;
+
+  if (!ok)
+    remove(temporary);
+
+  free(temporary);
+
+  return ok;
+}
+
+static file_t *results__getmember(FILE *file, off_t size, int *ok)
+{
+  file_t *member;
+  unsigned long long device;
+  unsigned long long inode;
+  unsigned long long mtime;
+  unsigned long long mtime_nsec;
+  unsigned long long ctime;
+  unsigned long long ctime_nsec;
+  unsigned long long action;
+  unsigned long long length;
+
+  *ok = results__get(file, &device, 8) &&
+    results__get(file, &inode, 8) &&
+    results__get(file, &mtime, 8) &&
+    results__get(file, &mtime_nsec, 4) &&
+    results__get(file, &ctime, 8) &&
+    results__get(file, &ctime_nsec, 4) &&
+    results__get(file, &action, 1) &&
+    results__get(file, &length, 4) &&
+    length > 0 && length <= RESULTS_MAX_NAME_LENGTH;
+
+  if (!*ok)
+    return 0;
+
+  member = (file_t*) malloc(sizeof(file_t));
+  if (member == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  memset(member, 0, sizeof(file_t));
+
+  member->d_name = (char*) malloc(length + 1);
+  if (member->d_name == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  *ok = fread(member->d_name, length, 1, file) == 1;
+  member->d_name[length] = '\0';
+
+  member->size = size;
+  member->device = (dev_t) device;
+  member->inode = (ino_t) inode;
+  member->mtime = (time_t) mtime;
+  member->mtime_nsec = (long) mtime_nsec;
+  member->ctime = (time_t) ctime;
+  member->ctime_nsec = (long) ctime_nsec;
+  member->action = (signed char) action;
+
+  return member;
+}
+
+static void results__freemember(file_t *member)
+{
+  free(member->d_name);
+  free(member->crcsignature);
+  free(member);
+}
+
+/* Load the sets of matches saved at path into files, leaving out any
+   member that has changed since, and any set with fewer than two members
+   left. Returns 0 if the file cannot be read. */
+int results_load(const char *path, file_t **files)
+{
+  char magic[RESULTS_MAGIC_LENGTH];
+  md5_byte_t signature[MD5_DIGEST_LENGTH];
+  unsigned long long size;
+  unsigned long long hassignature;
+  unsigned long long count;
+  unsigned long long x;
+  file_t **members;
+  file_t *member;
+  file_t *head;
+  file_t *last;
+  file_t **tail;
+  size_t allocated;
+  size_t kept;
+  FILE *file;
+  int ok;
+  int c;
+
+  *files = 0;
+
+  file = fopen(path, "rb");
+  if (file == 0)
+    return 0;
+
+  if (fread(magic, RESULTS_MAGIC_LENGTH, 1, file) != 1 ||
+      memcmp(magic, RESULTS_MAGIC, RESULTS_MAGIC_LENGTH) != 0 ||
+      !results__get(file, &count, 1) ||
+      count != RESULTS_VERSION)
+  {
+    fclose(file);
+    return 0;
+  }
+
+  members = 0;
+  allocated = 0;
+  tail = files;
+
+  ok = 1;
+  while (ok && (c = getc(file)) != EOF)
+  {
+    ungetc(c, file);
+
+    ok = results__get(file, &size, 8) &&
+      results__get(file, &hassignature, 1) &&
+      fread(signature, MD5_DIGEST_LENGTH, 1, file) == 1 &&
+      results__get(file, &count, 4) &&
+      count > 1 && count <= RESULTS_MAX_MEMBERS;
+
+    if (!ok)
+      break;
+
+    if (count > allocated)
+    {
+      free(members);
+
+      allocated = count;
+      members = (file_t**) malloc(allocated * sizeof(file_t*));
+      if (members == 0)
+      {
+        errormsg("out of memory\n");
+        exit(1);
+      }
+    }
+
+    kept = 0;
+    for (x = 0; ok && x < count; ++x)
+    {
+      member = results__getmember(file, (off_t) size, &ok);
+      if (member == 0)
+        break;
+
+      if (ok && !haschanged(member))
+        members[kept++] = member;
+      else
+        results__freemember(member);
+    }
+
+    if (!ok || kept < 2)
+    {
+      for (x = 0; x < kept; ++x)
+        results__freemember(members[x]);
+
+      continue;
+    }
+
+    head = members[0];
+    head->hasdupes = 1;
+
+    if (hassignature)
+    {
+      head->crcsignature = (md5_byte_t*) malloc(MD5_DIGEST_LENGTH);
+      if (head->crcsignature == 0)
+      {
+        errormsg("out of memory\n");
+        exit(1);
+      }
+
+      memcpy(head->crcsignature, signature, MD5_DIGEST_LENGTH);
+    }
+
+    last = head;
+    for (x = 0; x < kept; ++x)
+    {
+      if (x > 0)
+      {
+        last->duplicates = members[x];
+        last = members[x];
+      }
+
+      *tail = members[x];
+      tail = &members[x]->next;
+    }
+  }
+
+  fclose(file);
+
+  free(members);
+
+  if (!ok)
+  {
+    while (*files != 0)
+    {
+      member = (*files)->next;
+      results__freemember(*files);
+      *files = member;
+    }
+
+    return 0;
+  }
+
+  return 1;
+}
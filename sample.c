@@ -0,0 +1,117 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "sample.h"
+#include "errormsg.h"
+
+#define MD5_DIGEST_LENGTH 16
+
+/* A sample signature is the MD5 digest of SAMPLE_BLOCK_COUNT blocks of
+   SAMPLE_BLOCK_SIZE bytes: the last block of the file, the block in its
+   middle, and blocks at pseudo-random positions. Positions depend on
+   nothing but the size of the file, so files of the same size are
+   sampled at the same offsets, and files whose sample signatures differ
+   cannot be identical. The first block is left out, being covered by the
+   partial signature. */
+
+/* Fill offsets with the positions to sample in a file of the given size,
+   in increasing order. */
+static void sample__offsets(off_t size, off_t *offsets)
+{
+  unsigned long long seed;
+  off_t blocks;
+  off_t offset;
+  int x;
+  int y;
+
+  blocks = size / SAMPLE_BLOCK_SIZE;
+
+  offsets[0] = size - SAMPLE_BLOCK_SIZE;
+  offsets[1] = blocks / 2 * SAMPLE_BLOCK_SIZE;
+
+  /* xorshift64, seeded with the size of the file */
+  seed = (unsigned long long) size;
+  for (x = 2; x < SAMPLE_BLOCK_COUNT; ++x)
+  {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+
+    offsets[x] = (off_t) (seed % (unsigned long long) blocks) * SAMPLE_BLOCK_SIZE;
+  }
+
+  for (x = 1; x < SAMPLE_BLOCK_COUNT; ++x)
+  {
+    offset = offsets[x];
+
+    for (y = x; y > 0 && offsets[y - 1] > offset; --y)
+      offsets[y] = offsets[y - 1];
+
+    offsets[y] = offset;
+  }
+}
+
+/* Calculate the sample signature of a file of at least SAMPLE_MIN_SIZE
+   bytes, open for reading as fd. */
+md5_byte_t *sample_signature(int fd, const char *path, off_t size)
+{
+  off_t offsets[SAMPLE_BLOCK_COUNT];
+  static unsigned char block[SAMPLE_BLOCK_SIZE];
+  md5_state_t state;
+  md5_byte_t *digest;
+  size_t done;
+  ssize_t got;
+  int x;
+
+  digest = (md5_byte_t*) malloc(MD5_DIGEST_LENGTH * sizeof(md5_byte_t));
+  if (digest == NULL) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  sample__offsets(size, offsets);
+
+  md5_init(&state);
+
+  for (x = 0; x < SAMPLE_BLOCK_COUNT; ++x)
+  {
+    for (done = 0; done < SAMPLE_BLOCK_SIZE; done += got)
+    {
+      got = pread(fd, block + done, SAMPLE_BLOCK_SIZE - done, offsets[x] + done);
+      if (got <= 0) {
+        errormsg("error reading from file %s\n", path);
+        free(digest);
+        return NULL;
+      }
+    }
+
+    md5_append(&state, block, SAMPLE_BLOCK_SIZE);
+  }
+
+  md5_finish(&state, digest);
+
+  return digest;
+}
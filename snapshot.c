@@ -0,0 +1,508 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+#include "errormsg.h"
+#include "flags.h"
+
+/* A snapshot records the sets of matches found by a run, each
+   identified by the size and signature its members share, so that a
+   later run can report only what has changed since. It consists of a
+   header followed by groups sorted by size and signature, with members
+   sorted by name, all integers stored most significant byte first:
+
+     header:  "FDUPESSS", format version (1 byte)
+
+     group:   size (8 bytes), signature (16), member count (4),
+              then for each member its name length (4) and name
+*/
+
+#define SNAPSHOT_MAGIC "FDUPESSS"
+#define SNAPSHOT_MAGIC_LENGTH 8
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_NAME_LENGTH 65536
+#define SNAPSHOT_MAX_MEMBERS 16777216
+
+#define MD5_DIGEST_LENGTH 16
+
+struct snapshot_group
+{
+  off_t size;
+  md5_byte_t signature[MD5_DIGEST_LENGTH];
+  char **members;
+  size_t count;
+};
+
+struct snapshot
+{
+  struct snapshot_group *groups;
+  size_t count;
+  size_t allocated;
+};
+
+static struct snapshot *snapshot__new()
+{
+  struct snapshot *snapshot;
+
+  snapshot = (struct snapshot*) malloc(sizeof(struct snapshot));
+  if (snapshot == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  snapshot->groups = 0;
+  snapshot->count = 0;
+  snapshot->allocated = 0;
+
+  return snapshot;
+}
+
+static struct snapshot_group *snapshot__newgroup(struct snapshot *snapshot, off_t size, const md5_byte_t *signature, size_t count)
+{
+  struct snapshot_group *groups;
+  struct snapshot_group *group;
+  size_t allocated;
+
+  if (snapshot->count == snapshot->allocated)
+  {
+    allocated = snapshot->allocated == 0 ? 256 : snapshot->allocated * 2;
+
+    groups = realloc(snapshot->groups, allocated * sizeof(struct snapshot_group));
+    if (groups == 0)
+    {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    snapshot->groups = groups;
+    snapshot->allocated = allocated;
+  }
+
+  group = &snapshot->groups[snapshot->count++];
+
+  group->size = size;
+  memcpy(group->signature, signature, MD5_DIGEST_LENGTH);
+  group->count = 0;
+
+  group->members = (char**) calloc(count > 0 ? count : 1, sizeof(char*));
+  if (group->members == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  return group;
+}
+
+static void snapshot__addmember(struct snapshot_group *group, const char *name)
+{
+  group->members[group->count] = strdup(name);
+  if (group->members[group->count] == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  ++group->count;
+}
+
+void snapshot_free(struct snapshot *snapshot)
+{
+  size_t x;
+  size_t y;
+
+  if (snapshot == 0)
+    return;
+
+  for (x = 0; x < snapshot->count; ++x)
+  {
+    for (y = 0; y < snapshot->groups[x].count; ++y)
+      free(snapshot->groups[x].members[y]);
+
+    free(snapshot->groups[x].members);
+  }
+
+  free(snapshot->groups);
+  free(snapshot);
+}
+
+static int snapshot__comparegroups(const void *a, const void *b)
+{
+  const struct snapshot_group *group1 = a;
+  const struct snapshot_group *group2 = b;
+
+  if (group1->size != group2->size)
+    return group1->size < group2->size ? -1 : 1;
+
+  return memcmp(group1->signature, group2->signature, MD5_DIGEST_LENGTH);
+}
+
+static int snapshot__comparemembers(const void *a, const void *b)
+{
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Sort groups and their members, merging groups with the same size
+   and signature (as when hard links to a file are listed apart). */
+static void snapshot__sort(struct snapshot *snapshot)
+{
+  struct snapshot_group *group;
+  struct snapshot_group *into;
+  char **members;
+  size_t kept;
+  size_t x;
+
+  qsort(snapshot->groups, snapshot->count, sizeof(struct snapshot_group), snapshot__comparegroups);
+
+  kept = 0;
+  for (x = 0; x < snapshot->count; ++x)
+  {
+    group = &snapshot->groups[x];
+
+    if (kept > 0 && snapshot__comparegroups(&snapshot->groups[kept - 1], group) == 0)
+    {
+      into = &snapshot->groups[kept - 1];
+
+      members = realloc(into->members, (into->count + group->count) * sizeof(char*));
+      if (members == 0)
+      {
+        errormsg("out of memory\n");
+        exit(1);
+      }
+
+      memcpy(members + into->count, group->members, group->count * sizeof(char*));
+      into->members = members;
+      into->count += group->count;
+
+      free(group->members);
+    }
+    else
+    {
+      snapshot->groups[kept++] = *group;
+    }
+  }
+
+  snapshot->count = kept;
+
+  for (x = 0; x < snapshot->count; ++x)
+    qsort(snapshot->groups[x].members, snapshot->groups[x].count, sizeof(char*), snapshot__comparemembers);
+}
+
+/* Build a snapshot of the sets of matches in files. */
+struct snapshot *snapshot_fromfiles(file_t *files)
+{
+  struct snapshot *snapshot;
+  struct snapshot_group *group;
+  file_t *tmpfile;
+  md5_byte_t *signature;
+  size_t count;
+
+  snapshot = snapshot__new();
+
+  for (; files != 0; files = files->next)
+  {
+    if (!files->hasdupes)
+      continue;
+
+    signature = files->crcsignature;
+    count = 1;
+
+    for (tmpfile = files->duplicates; tmpfile != 0; tmpfile = tmpfile->duplicates)
+    {
+      if (signature == 0)
+        signature = tmpfile->crcsignature;
+
+      ++count;
+    }
+
+    if (signature == 0)
+      continue;
+
+    group = snapshot__newgroup(snapshot, files->size, signature, count);
+
+    snapshot__addmember(group, files->d_name);
+    for (tmpfile = files->duplicates; tmpfile != 0; tmpfile = tmpfile->duplicates)
+      snapshot__addmember(group, tmpfile->d_name);
+  }
+
+  snapshot__sort(snapshot);
+
+  return snapshot;
+}
+
+static int snapshot__put(FILE *file, unsigned long long value, int length)
+{
+  unsigned char bytes[8];
+  int x;
+
+  for (x = length - 1; x >= 0; --x) {
+    bytes[x] = value & 0xff;
+    value >>= 8;
+  }
+
+  return fwrite(bytes, length, 1, file) == 1;
+}
+
+static int snapshot__get(FILE *file, unsigned long long *value, int length)
+{
+  unsigned char bytes[8];
+  int x;
+
+  if (fread(bytes, length, 1, file) != 1)
+    return 0;
+
+  *value = 0;
+  for (x = 0; x < length; ++x)
+    *value = (*value << 8) | bytes[x];
+
+  return 1;
+}
+
+/* Load the snapshot at path, or return 0 if it cannot be read. */
+struct snapshot *snapshot_load(const char *path)
+{
+  struct snapshot *snapshot;
+  struct snapshot_group *group;
+  char magic[SNAPSHOT_MAGIC_LENGTH];
+  md5_byte_t signature[MD5_DIGEST_LENGTH];
+  unsigned long long size;
+  unsigned long long count;
+  unsigned long long length;
+  unsigned long long x;
+  char *name;
+  FILE *file;
+  int ok;
+  int c;
+
+  file = fopen(path, "rb");
+  if (file == 0)
+    return 0;
+
+  if (fread(magic, SNAPSHOT_MAGIC_LENGTH, 1, file) != 1 ||
+      memcmp(magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH) != 0 ||
+      !snapshot__get(file, &count, 1) ||
+      count != SNAPSHOT_VERSION)
+  {
+    fclose(file);
+    return 0;
+  }
+
+  snapshot = snapshot__new();
+
+  ok = 1;
+  while (ok && (c = getc(file)) != EOF)
+  {
+    ungetc(c, file);
+
+    ok = snapshot__get(file, &size, 8) &&
+      fread(signature, MD5_DIGEST_LENGTH, 1, file) == 1 &&
+      snapshot__get(file, &count, 4) &&
+      count > 0 && count <= SNAPSHOT_MAX_MEMBERS;
+
+    if (!ok)
+      break;
+
+    group = snapshot__newgroup(snapshot, size, signature, count);
+
+    for (x = 0; ok && x < count; ++x)
+    {
+      ok = snapshot__get(file, &length, 4) && length > 0 && length <= SNAPSHOT_MAX_NAME_LENGTH;
+      if (!ok)
+        break;
+
+      name = (char*) malloc(length + 1);
+      if (name == 0)
+      {
+        errormsg("out of memory\n");
+        exit(1);
+      }
+
+      ok = fread(name, length, 1, file) == 1;
+      name[length] = '\0';
+
+      group->members[group->count++] = name;
+    }
+  }
+
+  fclose(file);
+
+  if (!ok)
+  {
+    snapshot_free(snapshot);
+    return 0;
+  }
+
+  snapshot__sort(snapshot);
+
+  return snapshot;
+}
+
+/* Write snapshot to a temporary file renamed over path once complete,
+   so that an interrupted run never leaves a damaged snapshot behind. */
+int snapshot_save(const struct snapshot *snapshot, const char *path)
+{
+  const struct snapshot_group *group;
+  char *temporary;
+  FILE *file;
+  size_t length;
+  size_t x;
+  size_t y;
+  int ok;
+
+  temporary = (char*) malloc(strlen(path) + 5);
+  if (temporary == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  strcpy(temporary, path);
+  strcat(temporary, ".tmp");
+
+  file = fopen(temporary, "wb");
+  if (file == 0)
+  {
+    free(temporary);
+    return 0;
+  }
+
+  ok = fwrite(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH, 1, file) == 1 &&
+    snapshot__put(file, SNAPSHOT_VERSION, 1);
+
+  for (x = 0; ok && x < snapshot->count; ++x)
+  {
+    group = &snapshot->groups[x];
+
+    ok = snapshot__put(file, group->size, 8) &&
+      fwrite(group->signature, MD5_DIGEST_LENGTH, 1, file) == 1 &&
+      snapshot__put(file, group->count, 4);
+
+    for (y = 0; ok && y < group->count; ++y)
+    {
+      length = strlen(group->members[y]);
+
+      ok = snapshot__put(file, length, 4) &&
+        fwrite(group->members[y], length, 1, file) == 1;
+    }
+  }
+
+  if (fclose(file) != 0)
+    ok = 0;
+
+  if (ok)
+    ok = rename(temporary, path) == 0;
+
+  if (!ok)
+    remove(temporary);
+
+  free(temporary);
+
+  return ok;
+}
+
+static void snapshot__printgroupsize(const struct snapshot_group *group)
+{
+  if (ISFLAG(flags, F_SHOWSIZE))
+    printf("%lld byte%seach:\n", (long long int)group->size, (group->size != 1) ? "s " : " ");
+}
+
+static void snapshot__printgroup(const struct snapshot_group *group, const char *mark)
+{
+  size_t x;
+
+  snapshot__printgroupsize(group);
+
+  for (x = 0; x < group->count; ++x)
+    printf("%s%s\n", mark, group->members[x]);
+
+  printf("\n");
+}
+
+/* Print members of group after that are not members of group before,
+   along with the members they have in common, if there are any. */
+static void snapshot__printgrowth(const struct snapshot_group *before, const struct snapshot_group *after)
+{
+  size_t x;
+  size_t y;
+  int grown = 0;
+
+  for (x = 0, y = 0; x < after->count; ++x)
+  {
+    while (y < before->count && strcmp(before->members[y], after->members[x]) < 0)
+      ++y;
+
+    if (y == before->count || strcmp(before->members[y], after->members[x]) != 0)
+    {
+      grown = 1;
+      break;
+    }
+  }
+
+  if (!grown)
+    return;
+
+  snapshot__printgroupsize(after);
+
+  for (x = 0, y = 0; x < after->count; ++x)
+  {
+    while (y < before->count && strcmp(before->members[y], after->members[x]) < 0)
+      ++y;
+
+    if (y < before->count && strcmp(before->members[y], after->members[x]) == 0)
+      printf("  %s\n", after->members[x]);
+    else
+      printf("+ %s\n", after->members[x]);
+  }
+
+  printf("\n");
+}
+
+/* Print the sets of matches that appeared (marked "+"), gained members
+   (new members marked "+", others " ") or disappeared (marked "-")
+   between snapshots before and after. */
+void snapshot_printdelta(const struct snapshot *before, const struct snapshot *after)
+{
+  size_t x = 0;
+  size_t y = 0;
+  int order;
+
+  while (x < before->count || y < after->count)
+  {
+    if (x == before->count)
+      order = 1;
+    else if (y == after->count)
+      order = -1;
+    else
+      order = snapshot__comparegroups(&before->groups[x], &after->groups[y]);
+
+    if (order < 0)
+      snapshot__printgroup(&before->groups[x++], "- ");
+    else if (order > 0)
+      snapshot__printgroup(&after->groups[y++], "+ ");
+    else
+      snapshot__printgrowth(&before->groups[x++], &after->groups[y++]);
+  }
+}
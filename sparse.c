@@ -0,0 +1,100 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+/* for SEEK_DATA and SEEK_HOLE */
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "sparse.h"
+
+static const unsigned char zeros[CHUNK_SIZE];
+
+/* Find the first region of data in a file at or after offset, setting
+   *data to where it starts and *hole to where it ends, no further than
+   size. Both are set to size if no data remains. Where holes cannot be
+   found, or too little remains for finding them to be worthwhile, the
+   rest of the file is taken to be data. Moves the file offset of fd. */
+void sparse_region(int fd, off_t offset, off_t size, off_t *data, off_t *hole)
+{
+#ifdef SEEK_DATA
+  off_t found;
+
+  if (size - offset > CHUNK_SIZE)
+  {
+    found = lseek(fd, offset, SEEK_DATA);
+    if (found == -1 && errno == ENXIO)
+    {
+      *data = size;
+      *hole = size;
+      return;
+    }
+
+    if (found != -1)
+    {
+      if (found > size)
+        found = size;
+
+      *data = found;
+
+      found = lseek(fd, found, SEEK_HOLE);
+      *hole = found == -1 || found > size || found <= *data ? size : found;
+
+      return;
+    }
+  }
+#endif
+
+  *data = offset;
+  *hole = size;
+}
+
+/* Add length bytes of zeros, as read from a hole, to an MD5 signature. */
+void sparse_appendzeros(md5_state_t *state, size_t length)
+{
+  size_t toappend;
+
+  while (length > 0)
+  {
+    toappend = length > sizeof(zeros) ? sizeof(zeros) : length;
+    md5_append(state, zeros, toappend);
+    length -= toappend;
+  }
+}
+
+int sparse_iszero(const unsigned char *buffer, size_t length)
+{
+  size_t tocompare;
+
+  while (length > 0)
+  {
+    tocompare = length > sizeof(zeros) ? sizeof(zeros) : length;
+    if (memcmp(buffer, zeros, tocompare) != 0)
+      return 0;
+
+    buffer += tocompare;
+    length -= tocompare;
+  }
+
+  return 1;
+}
@@ -0,0 +1,243 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include "treehash.h"
+#include "sparse.h"
+#include "errormsg.h"
+#include "sigint.h"
+
+#define MD5_DIGEST_LENGTH 16
+
+/* bytes read per call, by each thread */
+#define TREEHASH_BUFFER_SIZE (1024 * 1024)
+
+/* A tree signature is the MD5 digest of the MD5 digests of consecutive
+   TREE_HASH_CHUNK_SIZE chunks of a file, so that chunks can be hashed
+   independently. Chunk i is hashed by thread i % threads, which reads it
+   with pread() into a buffer of its own. */
+
+struct treehash_worker
+{
+  int fd;
+  off_t size;
+  size_t chunkcount;
+  md5_byte_t *digests;
+  int index;
+  int threads;
+  int failed;
+#ifdef HAVE_PTHREAD
+  pthread_t thread;
+#endif
+};
+
+int treehash_defaultthreads()
+{
+#if defined(HAVE_PTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+  long processors;
+
+  processors = sysconf(_SC_NPROCESSORS_ONLN);
+  if (processors < 1)
+    return 1;
+
+  return processors > TREEHASH_MAX_THREADS ? TREEHASH_MAX_THREADS : (int) processors;
+#else
+  return 1;
+#endif
+}
+
+/* Hash the bytes from start to end into digest, taking holes to be the
+   zeros they read as. */
+static int treehash__chunk(int fd, off_t start, off_t end, unsigned char *buffer, md5_byte_t *digest)
+{
+  md5_state_t state;
+  off_t offset;
+  off_t data = start;
+  off_t hole = start;
+  ssize_t got;
+  size_t toread;
+
+  md5_init(&state);
+
+  offset = start;
+  while (offset < end)
+  {
+    if (got_sigint)
+      return 0;
+
+    if (offset >= hole)
+      sparse_region(fd, offset, end, &data, &hole);
+
+    if (offset < data)
+    {
+      toread = data - offset > TREEHASH_BUFFER_SIZE ? TREEHASH_BUFFER_SIZE : data - offset;
+      sparse_appendzeros(&state, toread);
+      offset += toread;
+      continue;
+    }
+
+    toread = hole - offset > TREEHASH_BUFFER_SIZE ? TREEHASH_BUFFER_SIZE : hole - offset;
+
+    got = pread(fd, buffer, toread, offset);
+    if (got <= 0)
+      return 0;
+
+    md5_append(&state, buffer, got);
+    offset += got;
+  }
+
+  md5_finish(&state, digest);
+
+  return 1;
+}
+
+static void *treehash__work(void *argument)
+{
+  struct treehash_worker *worker = argument;
+  unsigned char *buffer;
+  size_t chunk;
+  off_t start;
+  off_t end;
+
+  buffer = (unsigned char*) malloc(TREEHASH_BUFFER_SIZE);
+  if (buffer == 0)
+  {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  for (chunk = worker->index; chunk < worker->chunkcount && !worker->failed; chunk += worker->threads)
+  {
+    start = (off_t) chunk * TREE_HASH_CHUNK_SIZE;
+    end = start + TREE_HASH_CHUNK_SIZE < worker->size ? start + TREE_HASH_CHUNK_SIZE : worker->size;
+
+    if (!treehash__chunk(worker->fd, start, end, buffer, worker->digests + chunk * MD5_DIGEST_LENGTH))
+      worker->failed = 1;
+  }
+
+  free(buffer);
+
+  return 0;
+}
+
+/* Calculate the tree signature of a file open for reading as fd, using
+   up to the given number of threads where supported. */
+md5_byte_t *treehash_signature(int fd, const char *path, off_t size, int threads)
+{
+  struct treehash_worker *workers;
+  md5_state_t state;
+  md5_byte_t *digests;
+  md5_byte_t *digest;
+  size_t chunkcount;
+  int failed;
+  int x;
+#ifdef HAVE_PTHREAD
+  int *started;
+#endif
+
+  chunkcount = (size + TREE_HASH_CHUNK_SIZE - 1) / TREE_HASH_CHUNK_SIZE;
+
+  if (threads > (int) chunkcount)
+    threads = (int) chunkcount;
+
+  if (threads < 1)
+    threads = 1;
+
+  digests = (md5_byte_t*) malloc((chunkcount > 0 ? chunkcount : 1) * MD5_DIGEST_LENGTH);
+  workers = (struct treehash_worker*) malloc(threads * sizeof(struct treehash_worker));
+  digest = (md5_byte_t*) malloc(MD5_DIGEST_LENGTH * sizeof(md5_byte_t));
+  if (digests == NULL || workers == NULL || digest == NULL) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  for (x = 0; x < threads; ++x)
+  {
+    workers[x].fd = fd;
+    workers[x].size = size;
+    workers[x].chunkcount = chunkcount;
+    workers[x].digests = digests;
+    workers[x].index = x;
+    workers[x].threads = threads;
+    workers[x].failed = 0;
+  }
+
+#ifdef HAVE_PTHREAD
+  if (threads > 1)
+  {
+    started = (int*) malloc(threads * sizeof(int));
+    if (started == NULL) {
+      errormsg("out of memory\n");
+      exit(1);
+    }
+
+    for (x = 0; x < threads; ++x)
+      started[x] = pthread_create(&workers[x].thread, 0, treehash__work, &workers[x]) == 0;
+
+    /* do the work of any thread that could not be started here */
+    for (x = 0; x < threads; ++x)
+    {
+      if (started[x])
+        pthread_join(workers[x].thread, 0);
+      else
+        treehash__work(&workers[x]);
+    }
+
+    free(started);
+  }
+  else
+#endif
+    treehash__work(&workers[0]);
+
+  if (got_sigint) {
+    printf("\n");
+    exit(0);
+  }
+
+  failed = 0;
+  for (x = 0; x < threads; ++x)
+    if (workers[x].failed)
+      failed = 1;
+
+  free(workers);
+
+  if (failed) {
+    errormsg("error reading from file %s\n", path);
+    free(digests);
+    free(digest);
+    return NULL;
+  }
+
+  md5_init(&state);
+  md5_append(&state, digests, chunkcount * MD5_DIGEST_LENGTH);
+  md5_finish(&state, digest);
+
+  free(digests);
+
+  return digest;
+}
@@ -0,0 +1,265 @@
+/* FDUPES Copyright (c) 2026 Adrian Lopez
+
+   Permission is hereby granted, free of charge, to any person
+   obtaining a copy of this software and associated documentation files
+   (the "Software"), to deal in the Software without restriction,
+   including without limitation the rights to use, copy, modify, merge,
+   publish, distribute, sublicense, and/or sell copies of the Software,
+   and to permit persons to whom the Software is furnished to do so,
+   subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+   IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+   CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+   TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+   SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+#include "xattrcache.h"
+#include "errormsg.h"
+
+/* Signatures are stored in extended attributes of the files themselves,
+   so that they travel with files copied between hosts (e.g. rsync -X).
+   Each attribute holds the file size and times at the moment the digest
+   was calculated, in a byte order independent of the host:
+
+     offset  length  field
+          0       1  record format (XATTR_RECORD_VERSION)
+          1       1  hash function (XATTR_HASH_MD5 or XATTR_HASH_MD5_TREE)
+          2       8  file size
+         10       8  mtime (seconds)
+         18       4  mtime (nanoseconds)
+         22       8  ctime (seconds)
+         30       4  ctime (nanoseconds)
+         34       8  first parameter (bytes hashed, sampled or per chunk)
+         42       8  second parameter (sampling interval)
+         50      16  digest
+
+   Only size and mtime are checked when loading a signature: writing the
+   attribute itself changes ctime, and copies never preserve it. */
+
+#define XATTR_RECORD_VERSION 1
+#define XATTR_HASH_MD5 1
+#define XATTR_HASH_MD5_TREE 2
+#define XATTR_DIGEST_LENGTH 16
+#define XATTR_RECORD_LENGTH (50 + XATTR_DIGEST_LENGTH)
+
+#define XATTR_MAX_UNSUPPORTED_DEVICES 64
+
+#ifdef HAVE_SYS_XATTR_H
+
+static const char *xattr_names[] = {
+  "user.fdupes.partial",
+  "user.fdupes.full",
+  "user.fdupes.heuristic",
+  "user.fdupes.tree"
+};
+
+/* devices found not to support extended attributes */
+static dev_t unsupported_devices[XATTR_MAX_UNSUPPORTED_DEVICES];
+static int unsupported_device_count = 0;
+
+static int xattr__unsupported(dev_t device)
+{
+  int x;
+
+  for (x = 0; x < unsupported_device_count; ++x)
+    if (unsupported_devices[x] == device)
+      return 1;
+
+  return 0;
+}
+
+static void xattr__setunsupported(dev_t device)
+{
+  if (unsupported_device_count < XATTR_MAX_UNSUPPORTED_DEVICES)
+    unsupported_devices[unsupported_device_count++] = device;
+}
+
+static void xattr__put(unsigned char *to, unsigned long long value, int length)
+{
+  int x;
+
+  for (x = length - 1; x >= 0; --x) {
+    to[x] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+static unsigned long long xattr__get(const unsigned char *from, int length)
+{
+  unsigned long long value = 0;
+  int x;
+
+  for (x = 0; x < length; ++x)
+    value = (value << 8) | from[x];
+
+  return value;
+}
+
+static void xattr__parameters(int kind, off_t *first, off_t *second)
+{
+  switch (kind)
+  {
+    case XATTR_HASH_PARTIAL:
+      *first = PARTIAL_MD5_SIZE;
+      *second = 0;
+      break;
+
+    case XATTR_HASH_HEURISTIC:
+      *first = HEURISTIC_BLOCK;
+      *second = HEURISTIC_INTERVAL;
+      break;
+
+    case XATTR_HASH_TREE:
+      *first = TREE_HASH_CHUNK_SIZE;
+      *second = 0;
+      break;
+
+    default:
+      *first = 0;
+      *second = 0;
+      break;
+  }
+}
+
+static ssize_t xattr__read(const char *path, const char *name, void *value, size_t size)
+{
+#ifdef __APPLE__
+  return getxattr(path, name, value, size, 0, 0);
+#else
+  return getxattr(path, name, value, size);
+#endif
+}
+
+static int xattr__write(const char *path, const char *name, const void *value, size_t size)
+{
+#ifdef __APPLE__
+  return setxattr(path, name, value, size, 0, 0);
+#else
+  return setxattr(path, name, value, size, 0);
+#endif
+}
+
+int xattr_loadhash(const file_t *file, int kind, md5_byte_t **hash)
+{
+  unsigned char record[XATTR_RECORD_LENGTH];
+  ssize_t length;
+  off_t first;
+  off_t second;
+
+  *hash = 0;
+
+  if (xattr__unsupported(file->device))
+    return 0;
+
+  length = xattr__read(file->d_name, xattr_names[kind], record, sizeof(record));
+  if (length < 0)
+  {
+    if (errno == ENOTSUP)
+      xattr__setunsupported(file->device);
+
+    return 0;
+  }
+
+  xattr__parameters(kind, &first, &second);
+
+  if (length != XATTR_RECORD_LENGTH ||
+      record[0] != XATTR_RECORD_VERSION ||
+      record[1] != (kind == XATTR_HASH_TREE ? XATTR_HASH_MD5_TREE : XATTR_HASH_MD5) ||
+      (off_t) xattr__get(record + 2, 8) != file->size ||
+      (time_t) xattr__get(record + 10, 8) != file->mtime ||
+      (long) xattr__get(record + 18, 4) != file->mtime_nsec ||
+      (off_t) xattr__get(record + 34, 8) != first ||
+      (off_t) xattr__get(record + 42, 8) != second)
+    return 0;
+
+  *hash = (md5_byte_t*) malloc(XATTR_DIGEST_LENGTH * sizeof(md5_byte_t));
+  if (*hash == 0) {
+    errormsg("out of memory\n");
+    exit(1);
+  }
+
+  memcpy(*hash, record + 50, XATTR_DIGEST_LENGTH);
+
+  return 1;
+}
+
+/* Save a signature, then pick up the ctime change caused by doing so,
+   as long as nothing else about the file appears to have changed. */
+int xattr_savehash(file_t *file, int kind, const md5_byte_t *hash)
+{
+  unsigned char record[XATTR_RECORD_LENGTH];
+  struct stat st;
+  off_t first;
+  off_t second;
+
+  if (hash == 0 || xattr__unsupported(file->device))
+    return 0;
+
+  xattr__parameters(kind, &first, &second);
+
+  record[0] = XATTR_RECORD_VERSION;
+  record[1] = kind == XATTR_HASH_TREE ? XATTR_HASH_MD5_TREE : XATTR_HASH_MD5;
+  xattr__put(record + 2, file->size, 8);
+  xattr__put(record + 10, file->mtime, 8);
+  xattr__put(record + 18, file->mtime_nsec, 4);
+  xattr__put(record + 22, file->ctime, 8);
+  xattr__put(record + 30, file->ctime_nsec, 4);
+  xattr__put(record + 34, first, 8);
+  xattr__put(record + 42, second, 8);
+  memcpy(record + 50, hash, XATTR_DIGEST_LENGTH);
+
+  if (xattr__write(file->d_name, xattr_names[kind], record, sizeof(record)) != 0)
+  {
+    if (errno == ENOTSUP)
+      xattr__setunsupported(file->device);
+
+    return 0;
+  }
+
+  if (stat(file->d_name, &st) == 0 &&
+      st.st_dev == file->device &&
+      st.st_ino == file->inode &&
+      st.st_size == file->size &&
+#ifdef HAVE_NSEC_TIMES
+      st.st_mtim.tv_nsec == file->mtime_nsec &&
+#endif
+      st.st_mtime == file->mtime)
+  {
+    file->ctime = st.st_ctime;
+#ifdef HAVE_NSEC_TIMES
+    file->ctime_nsec = st.st_ctim.tv_nsec;
+#endif
+  }
+
+  return 1;
+}
+
+#else
+
+int xattr_loadhash(const file_t *file, int kind, md5_byte_t **hash)
+{
+  *hash = 0;
+
+  return 0;
+}
+
+int xattr_savehash(file_t *file, int kind, const md5_byte_t *hash)
+{
+  return 0;
+}
+
+#endif